@@ -27,11 +27,13 @@
 #ifndef __DRAFT_UTIL_BUFFER_POOL_HH__
 #define __DRAFT_UTIL_BUFFER_POOL_HH__
 
-#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <memory>
-#include <mutex>
-#include <vector>
 
+#include <sys/uio.h>
+
+#include "Futex.hh"
 #include "ScopedMMap.hh"
 
 namespace draft::util {
@@ -39,6 +41,13 @@ namespace draft::util {
 ////////////////////////////////////////////////////////////////////////////////
 // FreeList
 
+/**
+ * Lock-free (Treiber) stack of free indices.
+ *
+ * The head carries a tag that's bumped on every update, so a get racing
+ * with a get/put pair of the same index can't succeed with a stale next
+ * link (ABA).
+ */
 class FreeList
 {
 public:
@@ -48,29 +57,91 @@ public:
 
     explicit FreeList(size_t size);
 
+    // not thread safe.
+    FreeList(FreeList &&o) noexcept;
+    FreeList &operator=(FreeList &&o) noexcept;
+
     size_t get();
     void put(size_t idx);
 
 private:
-    std::vector<size_t> list_{ };
-    size_t free_{ };
+    static constexpr auto Nil = ~uint32_t{0};
+
+    static constexpr uint64_t pack(uint32_t tag, uint32_t idx) noexcept
+    {
+        return uint64_t{tag} << 32 | idx;
+    }
+
+    std::unique_ptr<std::atomic<uint32_t>[]> next_{ };
+    size_t size_{ };
+    std::atomic<uint64_t> head_{pack(0, Nil)};
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 // BufferPool
 
-class BufferPool: public std::enable_shared_from_this<BufferPool>
+enum class HugePages
 {
-public:
-    using Lock = std::unique_lock<std::timed_mutex>;
+    None,
+    Transparent,
+    Huge2M,
+    Huge1G
+};
 
+/**
+ * Backing memory options.
+ *
+ * Explicit huge pages (Huge2M, Huge1G) are mapped with MAP_HUGETLB, which
+ * needs pages reserved up front via /proc/sys/vm/nr_hugepages (1GiB pages
+ * usually at boot). If that fails, the pool falls back to transparent huge
+ * pages.
+ *
+ * A non-negative numaNode prefers that node for the pool's memory.
+ */
+struct BufferPoolOptions
+{
+    HugePages hugePages{HugePages::None};
+    bool lock{false};
+    int numaNode{-1};
+};
+
+/**
+ * Fixed-size pool of buffers carved from one mapping.
+ *
+ * Free buffers live on a lock-free free list, fronted by a few small
+ * per-thread magazines (thread-indexed caches guarded by a trylock), so most
+ * gets & puts don't touch shared state. Threads only block when the pool is
+ * empty.
+ *
+ * Buffers are intrusively refcounted handles - the count lives in the pool,
+ * per slot - so they can be shared between queues without allocating. The
+ * pool stays alive while any of its buffers are outstanding.
+ */
+class BufferPool
+{
+public:
     struct Buffer
     {
     public:
         Buffer() = default;
 
-        Buffer(const Buffer &) = delete;
-        Buffer &operator=(const Buffer &) = delete;
+        Buffer(const Buffer &o) noexcept:
+            data_(o.data_),
+            size_(o.size_),
+            freeIdx_(o.freeIdx_),
+            pool_(o.pool_)
+        {
+            if (pool_)
+                pool_->retain(freeIdx_);
+        }
+
+        Buffer &operator=(const Buffer &o) noexcept
+        {
+            if (this != &o)
+                *this = Buffer{o};
+
+            return *this;
+        }
 
         Buffer(Buffer &&o) noexcept
         {
@@ -81,8 +152,7 @@ public:
 
         ~Buffer() noexcept
         {
-            if (pool_)
-                pool_->put(freeIdx_);
+            reset();
         }
 
         void *data() noexcept { return data_; };
@@ -95,44 +165,112 @@ public:
 
         size_t freeIndex() const noexcept { return freeIdx_; }
 
+        /**
+         * Number of handles sharing this buffer (0 if invalid).
+         */
+        size_t useCount() const noexcept;
+
+        /**
+         * Drop this handle, returning the buffer to its pool if this was
+         * the last one.
+         */
+        void reset() noexcept;
+
         explicit operator bool() const noexcept { return valid(); }
         bool valid() const noexcept { return data_; }
 
     private:
         friend class BufferPool;
 
-        Buffer(const std::shared_ptr<BufferPool> &pool, size_t index, void *data, size_t size);
+        Buffer(BufferPool *pool, size_t index, void *data, size_t size);
 
         void *data_{ };
         size_t size_{ };
         size_t freeIdx_{ };
-        std::shared_ptr<BufferPool> pool_{ };
+        BufferPool *pool_{ };
     };
 
-    static std::shared_ptr<BufferPool> make(size_t chunkSize, size_t count);
+    static std::shared_ptr<BufferPool> make(size_t chunkSize, size_t count, const BufferPoolOptions &opts = { });
 
     ~BufferPool() noexcept;
 
     Buffer get();
     Buffer get(std::chrono::steady_clock::time_point deadline);
 
+    size_t count() const noexcept
+    {
+        return chunkCount_;
+    }
+
+    /**
+     * The pool's backing memory, eg. for registration with io_uring.
+     */
+    iovec region() const noexcept;
+
+    /**
+     * The page size backing the pool, after any fallback.
+     */
+    HugePages backing() const noexcept
+    {
+        return backing_;
+    }
+
+    /**
+     * True if the pool's memory is mlock'd.
+     */
+    bool locked() const noexcept
+    {
+        return locked_;
+    }
+
 private:
     BufferPool() = default;
 
     BufferPool(size_t chunkSize, size_t chunkCount);
 
-    void init(size_t chunkSize, size_t chunkCount);
+    void init(size_t chunkSize, size_t chunkCount, const BufferPoolOptions &opts);
     void init();
 
+    void mapHugeTlb(size_t len, int populate);
+    void mapTransparent(size_t len);
+
+    static constexpr size_t MagazineCount = 8;
+    static constexpr size_t MagazineSize = 8;
+
+    struct alignas(64) Magazine
+    {
+        std::atomic_flag busy{ };
+        size_t count{ };
+        size_t slots[MagazineSize]{ };
+    };
+
+    Buffer doGet(const std::chrono::steady_clock::time_point *deadline);
+    Buffer makeBuffer(size_t index);
+
+    size_t tryGet();
     void put(size_t index);
 
-    std::timed_mutex mtx_{ };
-    std::condition_variable_any cond_{ };
+    void retain(size_t index) noexcept;
+    void release(size_t index) noexcept;
+    void unref() noexcept;
+
+    Magazine &magazine() noexcept;
+
+    // one reference for the owning shared_ptrs, plus one per outstanding
+    // buffer.
+    std::atomic<size_t> refs_{1};
+    std::unique_ptr<std::atomic<uint32_t>[]> bufferRefs_{ };
+    std::unique_ptr<Magazine[]> magazines_{ };
+    size_t magazineLimit_{ };
+    Futex available_{ };
     FreeList freeList_{ };
     ScopedMMap mmap_{ };
     size_t chunkSize_{ };
     size_t chunkCount_{ };
-    bool done_{ };
+    BufferPoolOptions opts_{ };
+    HugePages backing_{HugePages::None};
+    bool locked_{ };
+    std::atomic_bool done_{ };
 };
 
 using BufferPoolPtr = std::shared_ptr<BufferPool>;
@@ -0,0 +1,115 @@
+/**
+ * @file ChunkCodec.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_CHUNK_CODEC_HH__
+#define __DRAFT_UTIL_CHUNK_CODEC_HH__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Util.hh"
+
+struct blosc2_context_s;
+
+namespace draft::util {
+
+/**
+ * Estimate whether a chunk is worth compressing from the byte entropy of a
+ * few samples spread across it; already compressed or encrypted data is
+ * close to 8 bits per byte.
+ */
+bool compressible(const uint8_t *data, size_t len);
+
+/**
+ * Per-chunk blosc2 compression for the transfer pipeline.
+ *
+ * Chunks are compressed & decompressed in place, in their own buffers,
+ * through a scratch buffer owned by the codec. Codecs aren't thread safe;
+ * each thread uses its own, from local().
+ */
+class ChunkCodec
+{
+public:
+    static constexpr unsigned MaxLevel = 9;
+
+    /**
+     * Whether draft was built with blosc2.
+     */
+    static bool supported() noexcept;
+
+    /**
+     * The calling thread's codec.
+     *
+     * @throws std::runtime_error if draft was built without blosc2.
+     */
+    static ChunkCodec &local();
+
+    ChunkCodec(const ChunkCodec &) = delete;
+    ChunkCodec &operator=(const ChunkCodec &) = delete;
+
+    ~ChunkCodec() noexcept;
+
+    /**
+     * Compress a chunk, if it looks compressible and shrinks by at least an
+     * eighth - otherwise it's left as it is, to be sent raw.
+     *
+     * @return the compressed length, or 0 if the chunk was left raw.
+     */
+    size_t compress(uint8_t *data, size_t len, unsigned level);
+
+    /**
+     * Decompress a chunk of len bytes to its rawLen bytes.
+     *
+     * @param capacity the size of the chunk's buffer.
+     * @throws std::runtime_error if the chunk is corrupt, or doesn't fit.
+     */
+    void decompress(uint8_t *data, size_t len, size_t rawLen, size_t capacity);
+
+private:
+    ChunkCodec();
+
+    blosc2_context_s *cctx_{ };
+    blosc2_context_s *dctx_{ };
+    unsigned level_{ };
+    std::vector<uint8_t> scratch_;
+};
+
+/**
+ * Compress a queued chunk in place, at level (1 - 9; 0 leaves it raw).
+ */
+void compress(BDesc &desc, unsigned level);
+
+/**
+ * Decompress a received chunk in place, if it was sent compressed.
+ *
+ * @return whether it was.
+ */
+bool decompress(BDesc &desc);
+
+}
+
+#endif
@@ -0,0 +1,173 @@
+/**
+ * @file Dispatcher.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_DISPATCHER_HH__
+#define __DRAFT_UTIL_DISPATCHER_HH__
+
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "Futex.hh"
+
+namespace draft::util {
+
+/**
+ * Decides which of the streams sending from a shared queue take its
+ * chunks, by each stream's delivery rate & backlog, tracked from TCP_INFO.
+ *
+ * Left to pull chunks whenever its socket takes more data, a slow link
+ * with a deep socket buffer keeps taking chunks at the pace of the fast
+ * ones, then crawls through them. Instead, a stream only takes a chunk
+ * while its backlog would be delivered within a short horizon, so chunks
+ * go to the streams in proportion to their rates. And once it's known how
+ * much is left to send, a stream is passed over if the others would
+ * finish it all before it could deliver one more chunk.
+ */
+class Dispatcher
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * For shouldTake, when it isn't known yet how much is left to send.
+     */
+    static constexpr size_t Unknown = std::numeric_limits<size_t>::max();
+
+    struct LinkEstimate
+    {
+        double rate{ };         // bytes/sec acked by the peer; 0 if unknown
+        size_t backlog{ };      // bytes written but not yet acked
+        double rtt{ };          // sec
+    };
+
+    /**
+     * Seconds for a link to deliver its backlog and len more bytes.
+     */
+    static double finishTime(const LinkEstimate &link, size_t len) noexcept;
+
+    /**
+     * Seconds of backlog a link may hold and still take chunks - enough to
+     * keep it busy until it's next asked.
+     */
+    static double horizon(const LinkEstimate &link) noexcept;
+
+    /**
+     * Whether link should take one more len byte chunk, of the remaining
+     * bytes left to send (or Unknown): if its backlog is within its
+     * horizon, and either no other link would deliver the chunk sooner or
+     * the others wouldn't finish the lot before it anyway. Links with an
+     * unknown rate always take chunks, and aren't counted on to.
+     */
+    static bool shouldTake(
+        const LinkEstimate &link,
+        const std::vector<LinkEstimate> &others,
+        size_t len,
+        size_t remaining) noexcept;
+
+    /**
+     * Register a stream's socket, before its sender starts.
+     *
+     * @return the stream's slot.
+     */
+    unsigned add(int fd, unsigned streamId);
+
+    /**
+     * The session has its whole file list, so what's left to send can be
+     * told from the stats.
+     */
+    void haveAllFiles() noexcept
+    {
+        haveAllFiles_ = true;
+    }
+
+    /**
+     * Sample the stream's socket & decide whether it takes the next of
+     * the count chunks in the queue. How much is left to send is known
+     * once all files are, or exactly, when the queue is draining, i.e.
+     * holds all there is.
+     */
+    bool admit(unsigned slot, size_t count, bool draining);
+
+    /**
+     * Block a stream admit() passed over until another stream takes or
+     * sends a chunk, its own backlog should have drained enough for it to
+     * take one, or the deadline.
+     */
+    void wait(unsigned slot, Clock::time_point deadline);
+
+    /**
+     * Wake all waiting streams, e.g. once the session stops.
+     */
+    void wakeAll() noexcept;
+
+    /**
+     * Record a chunk a stream sent, for the average chunk size.
+     */
+    void sent(size_t len) noexcept;
+
+    LinkEstimate estimate(unsigned slot) const noexcept;
+
+private:
+    struct Slot
+    {
+        int fd{-1};
+        unsigned streamId{ };
+
+        // written by the slot's sender only.
+        std::atomic<double> rate{ };
+        std::atomic_size_t backlog{ };
+        std::atomic<double> rtt{ };
+        std::atomic_uint64_t sampleNs{ };
+
+        double measuredRate{ };
+        uint64_t prevAcked{ };
+        uint64_t prevNs{ };
+        size_t prevBacklog{ };
+
+        // as of the last admit: the change count, & when the stream's
+        // backlog should allow it to take a chunk (0 if it's up to others).
+        uint32_t changes{ };
+        uint64_t retryNs{ };
+    };
+
+    void sample(Slot &slot);
+
+    std::vector<std::unique_ptr<Slot>> slots_;
+    std::atomic_uint64_t sentBytes_{ };
+    std::atomic_uint64_t sentCount_{ };
+    std::atomic_bool haveAllFiles_{ };
+
+    // counts chunks taken & sent, for waiting streams.
+    std::atomic_uint32_t changes_{ };
+    Futex waiters_;
+};
+
+}
+
+#endif
@@ -0,0 +1,134 @@
+/**
+ * @file FileScanner.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_FILE_SCANNER_HH__
+#define __DRAFT_UTIL_FILE_SCANNER_HH__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Util.hh"
+
+namespace draft::util {
+
+/**
+ * Parallel directory tree scanner.
+ *
+ * Worker threads list directories with getdents64 & statx each entry,
+ * sharing directories out by work stealing. Entries are returned in a
+ * fixed order regardless - a pre-order walk with each directory's entries
+ * sorted by name - so file ids are the same from scan to scan.
+ *
+ * Entries are available in batches as soon as the directories leading up
+ * to them have been scanned, so work on the first files can start while
+ * the rest of the tree is still being scanned.
+ */
+class FileScanner
+{
+public:
+    static constexpr unsigned DefaultThreadCount = 16;
+
+    /**
+     * Start scanning the directory tree under root. The root itself isn't
+     * included.
+     */
+    explicit FileScanner(std::string root, unsigned threadCount = DefaultThreadCount);
+    ~FileScanner() noexcept;
+
+    FileScanner(const FileScanner &) = delete;
+    FileScanner &operator=(const FileScanner &) = delete;
+
+    /**
+     * Wait for, and return, up to maxCount more entries. Directories have
+     * an id of zero; everything else is numbered from one.
+     *
+     * @return an empty batch once the whole tree has been returned.
+     * @throws the first error hit by a scanning thread, or
+     * std::runtime_error if the tree has more files than there are ids.
+     */
+    std::vector<FileInfo> next(size_t maxCount = 4096);
+
+private:
+    struct Dir;
+
+    struct Entry
+    {
+        std::string name;
+        FileInfo::Status status{ };
+        std::unique_ptr<Dir> dir{ };
+    };
+
+    struct Dir
+    {
+        std::string path;
+        std::vector<Entry> entries{ };
+        bool scanned{ };
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Dir *> dirs;
+    };
+
+    void run(size_t index);
+    void scan(Dir &dir, size_t index);
+
+    void push(Dir *dir, size_t index);
+    Dir *pop(size_t index);
+    bool waitForWork();
+
+    std::unique_ptr<Dir> root_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    // directories queued or being scanned.
+    std::atomic_size_t pending_{ };
+    std::atomic_size_t queued_{ };
+    std::atomic_bool stop_{ };
+    std::mutex idleMutex_;
+    std::condition_variable idleCv_;
+
+    std::mutex scannedMutex_;
+    std::condition_variable scannedCv_;
+    std::exception_ptr error_;
+
+    // pre-order walk state: each directory on the path, and its next entry.
+    std::vector<std::pair<Dir *, size_t>> walk_;
+    unsigned nextId_{ };
+
+    std::vector<std::thread> threads_;
+};
+
+}
+
+#endif
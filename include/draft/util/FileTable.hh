@@ -0,0 +1,83 @@
+/**
+ * @file FileTable.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_FILE_TABLE_HH__
+#define __DRAFT_UTIL_FILE_TABLE_HH__
+
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+namespace draft::util {
+
+/**
+ * Maps file ids to the receiver's open target files.
+ *
+ * Files are added as the sender's manifest arrives, so data for a file may
+ * show up before its entry does; lookups wait for the entry until the
+ * table is closed.
+ */
+class FileTable
+{
+public:
+    FileTable() = default;
+
+    FileTable(const FileTable &) = delete;
+    FileTable &operator=(const FileTable &) = delete;
+
+    void add(unsigned id, int fd);
+
+    /**
+     * No more files will be added; wakes any lookups still waiting.
+     */
+    void close();
+
+    /**
+     * Find the fd for a file id, waiting for it to be added if need be.
+     *
+     * @return the fd, or -1 if the table was closed without it.
+     */
+    int fd(unsigned id);
+
+    /**
+     * Find the fd for a file id without waiting.
+     *
+     * @return the fd, -1 if the table was closed without it, or nothing if
+     * it may yet be added.
+     */
+    std::optional<int> tryFd(unsigned id);
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<unsigned, int> fds_;
+    bool closed_{ };
+};
+
+}
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * @file Futex.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_FUTEX_HH__
+#define __DRAFT_UTIL_FUTEX_HH__
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace draft::util {
+
+/**
+ * Futex-based wait list, for waking threads blocked on lock-free state.
+ *
+ * Wakers only make a syscall when someone is actually waiting.
+ */
+class alignas(64) Futex
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * Sleep until woken or the deadline passes, unless ready() is already
+     * true.
+     *
+     * ready is checked after registering as a waiter, so a wake between the
+     * caller's last failed attempt and the sleep isn't lost.
+     *
+     * @return false on timeout.
+     */
+    template <typename Ready>
+    bool wait(const Clock::time_point *deadline, Ready &&ready)
+    {
+        count_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        const auto seq = seq_.load();
+
+        auto woken = true;
+
+        if (!ready())
+            woken = sleep(seq, deadline);
+
+        count_.fetch_sub(1);
+
+        return woken;
+    }
+
+    void wake(int count = 1) noexcept
+    {
+        // pairs with the count increment in wait().
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (!count_.load(std::memory_order_relaxed))
+            return;
+
+        seq_.fetch_add(1);
+
+        ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq_),
+            FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+    }
+
+    void wakeAll() noexcept
+    {
+        wake(INT_MAX);
+    }
+
+private:
+    bool sleep(uint32_t expected, const Clock::time_point *deadline)
+    {
+        auto ts = timespec{ };
+
+        if (deadline)
+        {
+            // steady_clock is CLOCK_MONOTONIC, which FUTEX_WAIT_BITSET
+            // uses for absolute timeouts.
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                deadline->time_since_epoch()).count();
+
+            if (ns <= 0)
+                return false;
+
+            ts.tv_sec = static_cast<time_t>(ns / 1'000'000'000);
+            ts.tv_nsec = static_cast<long>(ns % 1'000'000'000);
+        }
+
+        const auto stat = ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq_),
+            FUTEX_WAIT_BITSET_PRIVATE, expected, deadline ? &ts : nullptr,
+            nullptr, FUTEX_BITSET_MATCH_ANY);
+
+        return !(stat < 0 && errno == ETIMEDOUT);
+    }
+
+    std::atomic<uint32_t> seq_{ };
+    std::atomic<uint32_t> count_{ };
+};
+
+}
+
+#endif
@@ -27,27 +27,51 @@
 #ifndef __DRAFT_UTIL_INFO_RECEIVER_HH__
 #define __DRAFT_UTIL_INFO_RECEIVER_HH__
 
+#include <optional>
 #include <vector>
 
 #include "Util.hh"
 
 namespace draft::util {
 
+/**
+ * Receives the sender's manifest over the service connection, one batch
+ * at a time.
+ */
 class InfoReceiver
 {
 public:
+    /**
+     * Upper bound on a single manifest message's payload.
+     */
+    static constexpr size_t MaxMessageSize = 64u << 20;
+
     explicit InfoReceiver(ScopedFd fd);
 
-    bool runOnce();
+    /**
+     * Read the next batch of the manifest, accepting the service connection
+     * first if need be.
+     *
+     * @return the batch, or nothing if interrupted by a signal; call again
+     * to pick up where it left off.
+     */
+    std::optional<ManifestBatch> next();
 
-    TransferRequest info() const;
+    /**
+     * The accepted service connection, for replying to the sender.
+     */
+    int fd() const noexcept
+    {
+        return fd_.get();
+    }
 
 private:
+    bool fill(size_t len);
+
     std::vector<uint8_t> buf_{ };
     size_t offset_{ };
     ScopedFd fd_{ };
     ScopedFd srvFd_{ };
-    bool haveInfo_{ };
 };
 
 }
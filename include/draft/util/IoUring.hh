@@ -0,0 +1,231 @@
+/**
+ * @file IoUring.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_IO_URING_HH__
+#define __DRAFT_UTIL_IO_URING_HH__
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include "BufferPool.hh"
+#include "ScopedFd.hh"
+#include "ScopedMMap.hh"
+
+namespace draft::util {
+
+////////////////////////////////////////////////////////////////////////////////
+// IoUring
+
+/**
+ * Thin wrapper around an io_uring submission/completion queue pair.
+ *
+ * This talks to the kernel interface directly (no liburing), and only covers
+ * the operations draft uses. A ring is not thread-safe - each ring is meant to
+ * be driven by a single thread at a time.
+ */
+class IoUring
+{
+public:
+    using Cqe = io_uring_cqe;
+    using Sqe = io_uring_sqe;
+
+    IoUring() = default;
+
+    explicit IoUring(unsigned entries);
+
+    IoUring(IoUring &&) = default;
+    IoUring &operator=(IoUring &&) = default;
+
+    /**
+     * Check that io_uring is available on this host (it may be disabled via
+     * kernel config, sysctl, or seccomp).
+     */
+    static bool supported() noexcept;
+
+    bool valid() const noexcept { return fd_.get() >= 0; }
+
+    unsigned entries() const noexcept { return sqEntries_; }
+
+    /**
+     * The number of submission entries that can be acquired before the next
+     * submit.
+     */
+    unsigned sqSpace() const noexcept;
+
+    /**
+     * Get the next free submission entry, or null if the submission queue is
+     * full.
+     *
+     * The entry is zeroed, and is published on the next submit call.
+     */
+    Sqe *getSqe() noexcept;
+
+    unsigned submit();
+    unsigned submitAndWait(unsigned waitCount);
+
+    /**
+     * Submit pending entries, and wait up to tmo for at least one completion.
+     *
+     * @return false if the wait timed-out.
+     */
+    bool submitAndWait(std::chrono::nanoseconds tmo);
+
+    /**
+     * Invoke f for each available completion, consuming the completions.
+     *
+     * @return the number of completions consumed.
+     */
+    template <typename F>
+    unsigned forEachCompletion(F &&f)
+    {
+        auto head = *cqHead_;
+        const auto tail = std::atomic_ref<unsigned>(*cqTail_).load(std::memory_order_acquire);
+
+        unsigned count{ };
+
+        for (; head != tail; ++head, ++count)
+        {
+            // copy the entry out so the slot can be recycled before f runs.
+            const auto cqe = cqes_[head & *cqMask_];
+            std::atomic_ref<unsigned>(*cqHead_).store(head + 1, std::memory_order_release);
+
+            f(cqe);
+        }
+
+        return count;
+    }
+
+    void registerBuffers(const iovec *iovs, unsigned count);
+    void registerFiles(const int *fds, unsigned count);
+    void updateFile(unsigned index, int fd);
+
+    unsigned registeredBufferCount() const noexcept { return bufferCount_; }
+    unsigned registeredFileCount() const noexcept { return fileCount_; }
+
+    static void prepRead(Sqe *sqe, int fd, void *buf, size_t len, size_t offset) noexcept;
+    static void prepReadFixed(Sqe *sqe, int fd, void *buf, size_t len, size_t offset, unsigned bufIndex) noexcept;
+    static void prepWrite(Sqe *sqe, int fd, const void *buf, size_t len, size_t offset) noexcept;
+    static void prepWriteFixed(Sqe *sqe, int fd, const void *buf, size_t len, size_t offset, unsigned bufIndex) noexcept;
+    static void prepRecv(Sqe *sqe, int fd, void *buf, size_t len, unsigned flags) noexcept;
+    static void prepAccept(Sqe *sqe, int fd) noexcept;
+
+private:
+    int enter(unsigned submitCount, unsigned waitCount, unsigned flags, const void *arg, size_t argSize);
+    unsigned flush() noexcept;
+
+    ScopedFd fd_{ };
+    ScopedMMap sqRing_{ };
+    ScopedMMap cqRing_{ };
+    ScopedMMap sqeMap_{ };
+
+    unsigned *sqHead_{ };
+    unsigned *sqTail_{ };
+    unsigned *sqMask_{ };
+    unsigned *cqHead_{ };
+    unsigned *cqTail_{ };
+    unsigned *cqMask_{ };
+    Sqe *sqes_{ };
+    Cqe *cqes_{ };
+
+    unsigned sqEntries_{ };
+    unsigned sqeTail_{ };
+    unsigned features_{ };
+    unsigned bufferCount_{ };
+    unsigned fileCount_{ };
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// IoUringPool
+
+/**
+ * A set of rings which have a BufferPool's mapping registered as a fixed
+ * buffer, and one fixed file slot.
+ *
+ * Rings are created on demand and recycled on release, so the (relatively
+ * expensive) page pinning for buffer registration happens once per ring
+ * rather than once per file.
+ */
+class IoUringPool
+{
+public:
+    using RingPtr = std::unique_ptr<IoUring>;
+
+    class Lease
+    {
+    public:
+        Lease(IoUringPool *pool, RingPtr ring) noexcept:
+            pool_(pool),
+            ring_(std::move(ring))
+        {
+        }
+
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+
+        ~Lease() noexcept
+        {
+            if (pool_ && ring_)
+                pool_->release(std::move(ring_));
+        }
+
+        IoUring *operator->() const noexcept { return ring_.get(); }
+        IoUring &operator*() const noexcept { return *ring_; }
+
+    private:
+        IoUringPool *pool_{ };
+        RingPtr ring_{ };
+    };
+
+    IoUringPool(BufferPoolPtr pool, unsigned depth);
+
+    Lease acquire();
+
+    unsigned depth() const noexcept
+    {
+        return depth_;
+    }
+
+private:
+    RingPtr makeRing();
+    void release(RingPtr ring) noexcept;
+
+    std::mutex mtx_{ };
+    std::vector<RingPtr> rings_{ };
+    BufferPoolPtr pool_{ };
+    unsigned depth_{ };
+    std::atomic_bool tryFixedBuffers_{true};
+    std::atomic_bool tryFixedFiles_{true};
+};
+
+}
+
+#endif
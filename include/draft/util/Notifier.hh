@@ -0,0 +1,69 @@
+/**
+ * @file Notifier.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_NOTIFIER_HH__
+#define __DRAFT_UTIL_NOTIFIER_HH__
+
+#include "ScopedFd.hh"
+
+namespace draft::util {
+
+/**
+ * eventfd-based wakeup, for telling a session loop that one of its workers
+ * has something for it.
+ *
+ * Notifications coalesce until the next wait. notify() is async-signal-safe.
+ */
+class Notifier
+{
+public:
+    Notifier();
+
+    Notifier(const Notifier &) = delete;
+    Notifier &operator=(const Notifier &) = delete;
+
+    void notify() noexcept;
+
+    /**
+     * Wait up to tmoMs (-1 for no limit) for a notification, consuming any
+     * that are pending.
+     *
+     * @return false on timeout or interruption by a signal.
+     */
+    bool wait(int tmoMs);
+
+    int fd() const noexcept
+    {
+        return fd_.get();
+    }
+
+private:
+    ScopedFd fd_{ };
+};
+
+}
+
+#endif
@@ -0,0 +1,120 @@
+/**
+ * @file Numa.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_NUMA_HH__
+#define __DRAFT_UTIL_NUMA_HH__
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stop_token>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+#include <spdlog/spdlog.h>
+
+namespace draft::util {
+
+namespace numa {
+
+/**
+ * Return the NUMA node of the NIC carrying a socket's local address, or -1
+ * if it can't be determined (wildcard binds, loopback, virtual devices, or
+ * single node hosts).
+ */
+int socketNode(int fd);
+
+/**
+ * Return the NUMA node of a network interface's device, or -1.
+ */
+int interfaceNode(const std::string &ifname);
+
+/**
+ * Return the cpus local to a NUMA node, or an empty list if unknown.
+ */
+std::vector<unsigned> nodeCpus(int node);
+
+/**
+ * Parse a kernel cpu list, e.g. "0-3,8,10-11".
+ */
+std::vector<unsigned> parseCpuList(const std::string &str);
+
+/**
+ * Restrict a thread (by default, the calling thread) to the given cpus.
+ * An empty list is a no-op.
+ *
+ * @return false (with errno set) on failure.
+ */
+bool pinThread(const std::vector<unsigned> &cpus, pthread_t thread = ::pthread_self());
+
+/**
+ * Prefer a NUMA node for a memory range, migrating any pages already
+ * faulted in.
+ *
+ * @return false (with errno set) on failure.
+ */
+bool bindMemory(void *addr, size_t len, int node);
+
+}
+
+/**
+ * Runnable adapter pinning the thread it runs on to a set of cpus.
+ */
+template <typename T>
+class Pinned
+{
+public:
+    Pinned(T runnable, std::vector<unsigned> cpus):
+        runnable_(std::move(runnable)),
+        cpus_(std::move(cpus))
+    {
+    }
+
+    bool runOnce(std::stop_token stopToken)
+    {
+        if (!pinned_)
+        {
+            if (!numa::pinThread(cpus_))
+                spdlog::warn("unable to set thread cpu affinity: {}", std::strerror(errno));
+
+            pinned_ = true;
+        }
+
+        return runnable_.runOnce(stopToken);
+    }
+
+private:
+    T runnable_;
+    std::vector<unsigned> cpus_;
+    bool pinned_{ };
+};
+
+}
+
+#endif
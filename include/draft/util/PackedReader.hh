@@ -0,0 +1,111 @@
+/**
+ * @file PackedReader.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_PACKED_READER_HH__
+#define __DRAFT_UTIL_PACKED_READER_HH__
+
+#include <memory>
+#include <stop_token>
+#include <string>
+#include <vector>
+
+#include "Util.hh"
+
+namespace draft::util {
+
+/**
+ * Read a run of small files, whole, into one packed chunk (see
+ * wire::PackedTable), so they share a buffer, a chunk header and a task.
+ */
+class PackedReader
+{
+public:
+    /**
+     * Files up to this size are packed, rather than read by a Reader.
+     */
+    static constexpr size_t MaxFileSize = size_t{1u << 17};
+
+    struct Item
+    {
+        std::string path;
+        size_t size{ };
+        unsigned fileId{ };
+    };
+
+    /**
+     * @param items files that fit a chunk - see packedPayloadSize.
+     */
+    PackedReader(std::vector<Item> items, const BufferPoolPtr &pool, BufQueue *queue);
+
+    int operator()(std::stop_token stopToken);
+
+    void setDirectIO(bool on = true)
+    {
+        directIO_ = on;
+    }
+
+    /**
+     * Leave out files whose digest matches the receiver's copy (delta mode).
+     */
+    void skipMatching(const std::shared_ptr<const ChunkDigests> &digests)
+    {
+        digests_ = digests;
+    }
+
+    /**
+     * Hash each file as it's read, and carry the digests in the chunk's
+     * table - for the receiver to verify - and its BDesc, for the sender's
+     * journal.
+     */
+    void computeDigests(bool on = true)
+    {
+        hashing_ = on;
+    }
+
+    /**
+     * Compress the packed chunk at level before queueing it.
+     */
+    void setCompressLevel(unsigned level)
+    {
+        compressLevel_ = level;
+    }
+
+private:
+    size_t read(const Item &item, uint8_t *data);
+    bool matchesReceiver(unsigned fileId, uint64_t digest) const;
+
+    std::vector<Item> items_{ };
+    std::shared_ptr<const ChunkDigests> digests_{ };
+    BufferPoolPtr pool_{ };
+    BufQueue *queue_{ };
+    unsigned compressLevel_{ };
+    bool directIO_{true};
+    bool hashing_{ };
+};
+
+}
+
+#endif
@@ -51,7 +51,19 @@ struct ChunkHeader
 {
     enum Flag
     {
-        More = 1
+        More = 1,
+        Packed = 2,
+        Digest = 4
+    };
+
+    /**
+     * How the payload is encoded; compressed payloads are rawLength bytes
+     * once decoded.
+     */
+    enum Codec
+    {
+        Raw = 0,
+        Blosc2 = 1
     };
 
     static constexpr size_t BlockSize = 4096u;
@@ -65,8 +77,16 @@ struct ChunkHeader
     uint64_t payloadLength{ };
     uint16_t fileId{ };
     uint8_t flags{ };
-    uint8_t pad0[3]{ };
-    uint8_t pad_align[BlockSize - 32]{ };
+    uint8_t codec{ };
+    uint32_t rawLength{ };
+
+    /**
+     * With the Digest flag, the XXH3 digest of the decoded payload - or,
+     * for a Packed chunk, of its table; each file's data is covered by its
+     * entry's digest.
+     */
+    uint64_t digest{ };
+    uint8_t pad_align[BlockSize - 40]{ };
 };
 
 constexpr size_t UnalignedChunkHeaderSize =
@@ -75,6 +95,31 @@ constexpr size_t UnalignedChunkHeaderSize =
 static_assert(sizeof(ChunkHeader) == ChunkHeader::BlockSize);
 static_assert(alignof(ChunkHeader) == 8);
 
+/**
+ * A Packed chunk carries many small files, whole, in one payload: a
+ * PackedTable, its entries, then each file's data.
+ *
+ * The table and each file's data start on a BlockSize boundary, so files
+ * can be written with direct-io straight from the chunk buffer.
+ */
+struct PackedTable
+{
+    uint32_t count{ };
+    uint8_t pad0[4]{ };
+};
+
+struct PackedEntry
+{
+    uint32_t payloadOffset{ };
+    uint32_t len{ };
+    uint16_t fileId{ };
+    uint8_t pad0[6]{ };
+    uint64_t digest{ };
+};
+
+static_assert(sizeof(PackedTable) == 8);
+static_assert(sizeof(PackedEntry) == 24);
+
 }
 
 #endif
@@ -28,17 +28,30 @@
 #define __DRAFT_UTIL_READER_HH__
 
 #include <memory>
+#include <optional>
 #include <stop_token>
 
 #include "Util.hh"
 
 namespace draft::util {
 
+class IoUringPool;
+
 class Reader
 {
 public:
     using Buffer = BufferPool::Buffer;
 
+    /**
+     * Chunks being hashed are read, and hashed, in slices of this size, so
+     * each slice is hashed while it's still in cache.
+     */
+    static constexpr size_t HashSliceSize = size_t{1u << 20};
+
+    /**
+     * Read the byte range [segment.offset, segment.offset + segment.len)
+     * of fd, in BufSize chunks.
+     */
     Reader(const std::shared_ptr<ScopedFd> &fd, unsigned fileId, Segment segment, const BufferPoolPtr &pool, BufQueue *queue);
 
     int operator()(std::stop_token stopToken);
@@ -48,15 +61,62 @@ public:
         hashQueue_ = &q;
     }
 
+    /**
+     * Read via io_uring, keeping up to the ring pool's depth of reads in
+     * flight for this segment.
+     */
+    void useRings(const std::shared_ptr<IoUringPool> &rings)
+    {
+        rings_ = rings;
+    }
+
+    /**
+     * Drop chunks whose XXH3 digest matches the receiver's copy (delta
+     * mode) instead of queueing them for sending. They're still queued for
+     * hashing.
+     */
+    void skipMatching(const std::shared_ptr<const ChunkDigests> &digests)
+    {
+        digests_ = digests;
+    }
+
+    /**
+     * Hash each chunk as it's read, and carry the XXH3 digest in its BDesc,
+     * for the chunk header and the sender's journal.
+     */
+    void computeDigests(bool on = true)
+    {
+        hashing_ = on;
+    }
+
+    /**
+     * Compress chunks at level before queueing them (see ChunkCodec).
+     * Chunks are compressed in place, so this doesn't mix with a hash queue.
+     */
+    void setCompressLevel(unsigned level)
+    {
+        compressLevel_ = level;
+    }
+
 private:
+    int readSync(std::stop_token stopToken);
+    int readUring(std::stop_token stopToken);
+
     size_t read(Buffer &buf);
+    std::pair<size_t, uint64_t> readHashed(Buffer &buf);
+    void enqueue(const BufferPtr &buf, size_t offset, size_t len, std::optional<uint64_t> digest, std::stop_token stopToken);
+    bool matchesReceiver(const BDesc &desc) const;
 
     std::shared_ptr<ScopedFd> fd_{ };
+    std::shared_ptr<IoUringPool> rings_{ };
+    std::shared_ptr<const ChunkDigests> digests_{ };
     Segment segment_{ };
     BufferPoolPtr pool_{ };
     BufQueue *queue_{ };
     BufQueue *hashQueue_{ };
     unsigned fileId_{ };
+    unsigned compressLevel_{ };
+    bool hashing_{ };
 };
 
 }
@@ -27,11 +27,16 @@
 #ifndef __DRAFT_UTIL_RECEIVER_HH__
 #define __DRAFT_UTIL_RECEIVER_HH__
 
+#include <memory>
 #include <stop_token>
 
+#include "FileTable.hh"
 #include "Journal.hh"
+#include "Retransmit.hh"
 #include "Util.hh"
 
+struct XXH3_state_s;
+
 namespace draft::util {
 
 class Receiver
@@ -46,6 +51,38 @@ public:
         hashLog_ = hashLog;
     }
 
+    /**
+     * Request chunks that fail verification again through list, rather
+     * than failing the transfer.
+     */
+    void useRetransmits(const std::shared_ptr<RetransmitList> &list)
+    {
+        retransmits_ = list;
+    }
+
+    /**
+     * Count this connection's traffic as stream id, in streamStats().
+     */
+    void setStreamId(unsigned id)
+    {
+        streamId_ = id;
+    }
+
+    void setPoolOptions(const BufferPoolOptions &opts)
+    {
+        poolOptions_ = opts;
+    }
+
+    /**
+     * Move payloads directly from the socket to the target files with
+     * splice(2), via a per-connection pipe.
+     *
+     * No pool buffers are used, and nothing is put on the write queue, so
+     * this is incompatible with hash logging. Plain chunks are verified by
+     * reading them back from the page cache once they're written.
+     */
+    void useSplice(std::shared_ptr<FileTable> files);
+
     bool runOnce(std::stop_token stopToken);
 
 private:
@@ -54,17 +91,69 @@ private:
 
     int readHeader();
     int read();
+    int spliceRead();
+
+    void startHash();
+    std::vector<ChunkRange> verify(BDesc &desc);
+    void verifySpliced();
+    void requestAgain(const std::vector<ChunkRange> &corrupt);
+    void logHash(const BDesc &desc, const std::vector<ChunkRange> &corrupt);
+    void writeBuffered(const BDesc &desc);
+
+    bool packed() const noexcept
+    {
+        return header_.flags & wire::ChunkHeader::Packed;
+    }
+
+    bool digested() const noexcept
+    {
+        return header_.flags & wire::ChunkHeader::Digest;
+    }
+
+    bool compressed() const noexcept
+    {
+        return header_.codec != wire::ChunkHeader::Raw;
+    }
+
+    /**
+     * Whether the current chunk's payload is spliced straight to its file.
+     */
+    bool spliced() const noexcept
+    {
+        return splice_ && !packed() && !compressed();
+    }
+
+    unsigned fileId() const noexcept
+    {
+        return packed() ? PackedFileId : header_.fileId;
+    }
+
+    struct HashStateDeleter
+    {
+        void operator()(XXH3_state_s *state) const noexcept;
+    };
 
     BufferPoolPtr pool_{ };
+    BufferPoolOptions poolOptions_{ };
     BufQueue *queue_{ };
     BufQueue *hashQueue_{ };
     std::shared_ptr<Journal> hashLog_{ };
+    std::shared_ptr<RetransmitList> retransmits_{ };
     wire::ChunkHeader header_{ };
     Buffer buf_{ };
     size_t offset_{ };
+    unsigned streamId_{ };
+    std::unique_ptr<XXH3_state_s, HashStateDeleter> hashState_{ };
+    std::vector<uint8_t> readBack_{ };
     ScopedFd fd_{ };
     ScopedFd svcFd_{ };
+    std::shared_ptr<FileTable> files_{ };
+    ScopedFd pipeRead_{ };
+    ScopedFd pipeWrite_{ };
+    ScopedFd nullFd_{ };
     bool haveHeader_{ };
+    bool hashing_{ };
+    bool splice_{ };
 };
 
 }
@@ -0,0 +1,85 @@
+/**
+ * @file Retransmit.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_RETRANSMIT_HH__
+#define __DRAFT_UTIL_RETRANSMIT_HH__
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "Util.hh"
+
+namespace draft::util {
+
+/**
+ * Chunks that failed verification on receipt, collected from the
+ * receivers. Once the data connections are done, the rx session asks the
+ * sender for them again over the service connection.
+ */
+class RetransmitList
+{
+public:
+    /**
+     * Request chunks again; safe to call from any receiver thread.
+     */
+    void add(std::vector<ChunkRange> chunks);
+
+    /**
+     * Take the chunks requested so far.
+     */
+    std::vector<ChunkRange> take();
+
+private:
+    std::mutex mutex_;
+    std::vector<ChunkRange> chunks_;
+};
+
+/**
+ * Check a received (and decoded) chunk against the digest its sender put
+ * in the header, if it has one. A plain chunk's digest is left in the
+ * desc, for the journal.
+ *
+ * @return the ranges to request again - the chunk, or a packed chunk's
+ * corrupt files - or nothing, if it's intact.
+ * @throws std::runtime_error if a packed chunk's table is corrupt, since
+ * there's no telling which files it held.
+ */
+std::vector<ChunkRange> verifyChunk(BDesc &desc, uint64_t digest);
+
+/**
+ * Whether a packed chunk's file is among the corrupt ranges verifyChunk
+ * found.
+ */
+inline bool isCorrupt(const std::vector<ChunkRange> &corrupt, unsigned fileId) noexcept
+{
+    return std::any_of(begin(corrupt), end(corrupt),
+        [fileId](const auto &c) { return c.fileId == fileId; });
+}
+
+}
+
+#endif
@@ -0,0 +1,490 @@
+/**
+ * @file RingQueue.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_RING_QUEUE_HH__
+#define __DRAFT_UTIL_RING_QUEUE_HH__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stop_token>
+
+#include "Futex.hh"
+
+namespace draft::util {
+
+/**
+ * Bounded, lock-free MPMC queue.
+ *
+ * A drop-in for WaitQueue's put/get/cancel semantics, based on Dmitry
+ * Vyukov's bounded MPMC ring: each cell carries a sequence number which
+ * tells producers & consumers whose turn it is, so the fast path is a single
+ * CAS on the head or tail index.
+ *
+ * Blocked consumers (and producers waiting for space) sleep on a futex,
+ * which is only touched when someone is actually waiting.
+ */
+template <typename T>
+class RingQueue
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using Value = T;
+    using ReturnType = std::optional<Value>;
+
+    static constexpr size_t DefaultCapacity = 1024;
+
+    RingQueue()
+    {
+        allocate(DefaultCapacity);
+    }
+
+    explicit RingQueue(size_t capacity)
+    {
+        allocate(capacity);
+    }
+
+    RingQueue(const RingQueue &) = delete;
+    RingQueue &operator=(const RingQueue &) = delete;
+
+    ~RingQueue() noexcept
+    {
+        clear();
+    }
+
+    /**
+     * Put without waiting.
+     *
+     * @return false if the queue is full.
+     */
+    bool put(Value t)
+    {
+        return tryPush(std::move(t));
+    }
+
+    /**
+     * Put, waiting until the deadline for space if the queue is full.
+     *
+     * @return false if the queue is still full at the deadline, or was
+     * cancelled while waiting.
+     */
+    bool put(Value t, const Clock::time_point &deadline)
+    {
+        return doPut(std::move(t), &deadline);
+    }
+
+    template <typename Rep, typename Period>
+    bool put(Value t, const std::chrono::duration<Rep, Period> &tmo)
+    {
+        const auto deadline = Clock::now() + tmo;
+        return doPut(std::move(t), &deadline);
+    }
+
+    /**
+     * Put as many of [first, last) as will fit, without waiting.
+     *
+     * The free cells are claimed with a single CAS, and consumers are woken
+     * once for the batch. Items are copied, or moved with
+     * std::move_iterator - either way, only once they're known to fit.
+     *
+     * @return the number of items moved into the queue.
+     */
+    template <typename ForwardIt>
+    size_t putMany(ForwardIt first, ForwardIt last)
+    {
+        return tryPushMany(first, last);
+    }
+
+    /**
+     * Put [first, last), waiting until the deadline for space as required.
+     *
+     * @return the number of items moved into the queue.
+     */
+    template <typename ForwardIt>
+    size_t putMany(ForwardIt first, ForwardIt last, const Clock::time_point &deadline)
+    {
+        size_t count{ };
+
+        for (;;)
+        {
+            const auto n = tryPushMany(first, last);
+
+            count += n;
+            std::advance(first, n);
+
+            if (first == last || done_)
+                return count;
+
+            if (!putWaiters_.wait(&deadline, [this]{ return done_ || size() < capacity_; }))
+                return done_ ? count : count + tryPushMany(first, last);
+        }
+    }
+
+    ReturnType get()
+    {
+        return doGet(nullptr);
+    }
+
+    template <typename Rep, typename Period>
+    ReturnType get(const std::chrono::duration<Rep, Period> &tmo)
+    {
+        auto deadline = Clock::now() + tmo;
+        return doGet(&deadline);
+    }
+
+    ReturnType get(const Clock::time_point &deadline)
+    {
+        return doGet(&deadline);
+    }
+
+    /**
+     * Get, returning early if stopToken is stopped while the queue is empty,
+     * so consumers needn't wake periodically to check for cancellation.
+     * Queued values are still returned after the stop.
+     */
+    ReturnType get(const Clock::time_point &deadline, std::stop_token stopToken)
+    {
+        std::stop_callback wakeOnStop(stopToken, [this]{ getWaiters_.wakeAll(); });
+
+        return doGet(&deadline, &stopToken);
+    }
+
+    ReturnType tryGet()
+    {
+        if (done_)
+            return { };
+
+        return tryPop();
+    }
+
+    /**
+     * Get up to maxCount items, waiting until the deadline for the first.
+     *
+     * @return the number of items written to out.
+     */
+    template <typename OutputIt>
+    size_t getMany(OutputIt out, size_t maxCount, const Clock::time_point &deadline)
+    {
+        if (!maxCount)
+            return 0;
+
+        for (;;)
+        {
+            if (done_)
+                return 0;
+
+            if (const auto n = tryPopMany(out, maxCount))
+                return n;
+
+            if (!getWaiters_.wait(&deadline, [this]{ return done_ || size(); }))
+                return done_ ? 0 : tryPopMany(out, maxCount);
+        }
+    }
+
+    /**
+     * Get up to maxCount items without waiting.
+     *
+     * The published cells are claimed with a single CAS, and producers are
+     * woken once for the batch.
+     *
+     * @return the number of items written to out.
+     */
+    template <typename OutputIt>
+    size_t getMany(OutputIt out, size_t maxCount)
+    {
+        if (done_)
+            return 0;
+
+        return tryPopMany(out, maxCount);
+    }
+
+    void cancel() noexcept
+    {
+        done_ = true;
+
+        getWaiters_.wakeAll();
+        putWaiters_.wakeAll();
+    }
+
+    void resume() noexcept
+    {
+        done_ = false;
+    }
+
+    /**
+     * Resize the ring, dropping anything queued.
+     *
+     * The minimum size is 2.
+     *
+     * Not thread safe - call before the queue is shared.
+     */
+    void setSizeLimit(size_t limit)
+    {
+        clear();
+        allocate(limit);
+    }
+
+    size_t sizeLimit() const noexcept
+    {
+        return capacity_;
+    }
+
+    /**
+     * Approximate number of queued items.
+     */
+    size_t size() const noexcept
+    {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        const auto head = head_.load(std::memory_order_relaxed);
+
+        return head > tail ? head - tail : 0;
+    }
+
+    bool done() const noexcept
+    {
+        return done_;
+    }
+
+private:
+    struct alignas(64) Cell
+    {
+        std::atomic<size_t> seq{ };
+        alignas(Value) std::byte storage[sizeof(Value)];
+    };
+
+    void allocate(size_t capacity)
+    {
+        // with a single cell, "published for lap n" and "free for lap n + 1"
+        // would be the same sequence number.
+        capacity_ = std::max<size_t>(capacity, 2);
+        cells_ = std::make_unique<Cell[]>(capacity_);
+
+        for (size_t i = 0; i < capacity_; ++i)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+    }
+
+    void clear() noexcept
+    {
+        while (tryPop())
+        {
+        }
+    }
+
+    /**
+     * Claim up to want consecutive cells from index with one CAS: cells
+     * whose sequence is their position plus lag - 0 for free cells, 1 for
+     * published ones.
+     *
+     * The claimed cells can't be taken by anyone else, since index has moved
+     * past them, and their sequence numbers only change once their owner
+     * updates them.
+     *
+     * @return the number of cells claimed, starting at pos.
+     */
+    size_t claim(std::atomic<size_t> &index, size_t want, size_t lag, size_t &pos) noexcept
+    {
+        pos = index.load(std::memory_order_relaxed);
+
+        const auto limit = std::min(want, capacity_);
+
+        for (;;)
+        {
+            const auto seq = cells_[pos % capacity_].seq.load(std::memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + lag);
+
+            // for producers, the consumer from the previous lap hasn't freed
+            // this cell; for consumers, its producer hasn't published yet.
+            if (diff < 0)
+                return 0;
+
+            if (diff > 0)
+            {
+                pos = index.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            auto count = size_t{1};
+
+            while (count < limit
+                && cells_[(pos + count) % capacity_].seq.load(std::memory_order_acquire) == pos + count + lag)
+            {
+                ++count;
+            }
+
+            if (index.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+                return count;
+        }
+    }
+
+    template <typename U>
+    void publish(size_t pos, U &&t)
+    {
+        auto &cell = cells_[pos % capacity_];
+
+        new (cell.storage) Value(std::forward<U>(t));
+        cell.seq.store(pos + 1, std::memory_order_release);
+    }
+
+    Value consume(size_t pos)
+    {
+        auto &cell = cells_[pos % capacity_];
+
+        auto p = std::launder(reinterpret_cast<Value *>(cell.storage));
+        auto v = Value(std::move(*p));
+        p->~Value();
+
+        cell.seq.store(pos + capacity_, std::memory_order_release);
+
+        return v;
+    }
+
+    // forwards (moves) from t only on success.
+    template <typename U>
+    bool tryPush(U &&t)
+    {
+        auto pos = size_t{ };
+
+        if (!claim(head_, 1, 0, pos))
+            return false;
+
+        publish(pos, std::forward<U>(t));
+
+        getWaiters_.wake();
+
+        return true;
+    }
+
+    template <typename ForwardIt>
+    size_t tryPushMany(ForwardIt first, ForwardIt last)
+    {
+        const auto want = static_cast<size_t>(std::distance(first, last));
+
+        if (!want)
+            return 0;
+
+        auto pos = size_t{ };
+        const auto count = claim(head_, want, 0, pos);
+
+        for (size_t i = 0; i < count; ++i, ++first)
+            publish(pos + i, *first);
+
+        if (count)
+            getWaiters_.wake(static_cast<int>(count));
+
+        return count;
+    }
+
+    ReturnType tryPop()
+    {
+        auto pos = size_t{ };
+
+        if (!claim(tail_, 1, 1, pos))
+            return { };
+
+        auto v = ReturnType{consume(pos)};
+
+        putWaiters_.wake();
+
+        return v;
+    }
+
+    template <typename OutputIt>
+    size_t tryPopMany(OutputIt &out, size_t maxCount)
+    {
+        if (!maxCount)
+            return 0;
+
+        auto pos = size_t{ };
+        const auto count = claim(tail_, maxCount, 1, pos);
+
+        for (size_t i = 0; i < count; ++i)
+            *out++ = consume(pos + i);
+
+        if (count)
+            putWaiters_.wake(static_cast<int>(count));
+
+        return count;
+    }
+
+    ReturnType doGet(const Clock::time_point *deadline, const std::stop_token *stopToken = nullptr)
+    {
+        const auto stopped = [stopToken] {
+                return stopToken && stopToken->stop_requested();
+            };
+
+        for (;;)
+        {
+            if (done_)
+                return { };
+
+            if (auto v = tryPop())
+                return v;
+
+            if (stopped())
+                return { };
+
+            if (!getWaiters_.wait(deadline, [&]{ return done_ || size() || stopped(); }))
+                return done_ ? ReturnType{ } : tryPop();
+        }
+    }
+
+    template <typename U>
+    bool doPut(U &&t, const Clock::time_point *deadline)
+    {
+        for (;;)
+        {
+            if (tryPush(std::forward<U>(t)))
+                return true;
+
+            if (done_)
+                return false;
+
+            if (!putWaiters_.wait(deadline, [this]{ return done_ || size() < capacity_; }))
+                return !done_ && tryPush(std::forward<U>(t));
+        }
+    }
+
+    std::unique_ptr<Cell[]> cells_{ };
+    size_t capacity_{ };
+    alignas(64) std::atomic<size_t> head_{ };
+    alignas(64) std::atomic<size_t> tail_{ };
+    Futex getWaiters_{ };
+    Futex putWaiters_{ };
+    std::atomic_bool done_{ };
+};
+
+}
+
+#endif
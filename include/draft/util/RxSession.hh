@@ -27,29 +27,120 @@
 #ifndef __DRAFT_UTIL_RX_SESSION_HH__
 #define __DRAFT_UTIL_RX_SESSION_HH__
 
+#include <filesystem>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <stop_token>
 #include <vector>
 
+#include "Notifier.hh"
+#include "TaskPool.hh"
 #include "ThreadExecutor.hh"
 #include "Util.hh"
 
 namespace draft::util {
 
+class FileTable;
 class Journal;
+class RetransmitList;
 
 class RxSession
 {
 public:
+    /**
+     * Target files are opened & preallocated by a pool of this many
+     * threads, in batches of SetupBatchSize.
+     */
+    static constexpr size_t SetupThreadCount = 8;
+    static constexpr size_t SetupBatchSize = 64;
+
+    /**
+     * Chunks still corrupt after this many rounds of retransmits fail the
+     * transfer.
+     */
+    static constexpr unsigned MaxRetransmitRounds = 3;
+
     RxSession(SessionConfig conf);
     ~RxSession() noexcept;
 
+    /**
+     * Pick up where an interrupted transfer left off.
+     *
+     * Loads the journal left by the earlier session, keeps the records whose
+     * chunks are intact on disk (checking the chunks at the edges of each
+     * contiguous run), and carries them over to this session's journal.
+     * Call before start().
+     *
+     * @return the ranges that needn't be sent again.
+     */
+    CompletedRanges resume(const util::TransferRequest &req);
+
+    /**
+     * Collect digests of the chunks already in the target files, so the
+     * sender can skip the ones that match.
+     *
+     * Reuses the records of an earlier session's journal for files still
+     * the size it recorded, and hashes any other existing files. A reused
+     * journal is moved aside to <journal>.prev. Call before start().
+     */
+    ChunkDigests delta(const util::TransferRequest &req);
+
+    /**
+     * Start receiving, with the files listed in the request. More may be
+     * added with addFiles() as the rest of the sender's manifest arrives;
+     * data for a file that isn't known yet waits until endFiles().
+     *
+     * The journal only lists the files given here, so a journaled session
+     * should be given the whole manifest.
+     */
     void start(util::TransferRequest req);
+
+    /**
+     * Create the target files for a batch of the manifest. Each file is
+     * opened & preallocated in the background, and writes to it wait only
+     * until it's open. May be called from another thread while the session
+     * runs.
+     */
+    void addFiles(std::vector<util::FileInfo> info);
+
+    /**
+     * The manifest is complete. Waits for the remaining files to be set up.
+     *
+     * @throws the first error hit setting up a file.
+     */
+    void endFiles();
+
+    /**
+     * Once the data connections are done, ask the sender for the chunks that
+     * failed verification, over fd (the service connection), and write them
+     * in place. Ends with an empty request, which the sender waits for -
+     * so call this even when nothing's corrupt.
+     *
+     * @throws std::runtime_error if chunks are still corrupt after
+     * MaxRetransmitRounds.
+     */
+    void retransmit(int fd);
+
     void finish() noexcept;
 
     void truncateFiles();
 
     bool runOnce();
 
+    /**
+     * Wait up to tmoMs for the session's workers to make progress.
+     */
+    bool wait(int tmoMs)
+    {
+        return notifier_.wait(tmoMs);
+    }
+
+    Notifier &notifier() noexcept
+    {
+        return notifier_;
+    }
+
 private:
     struct FileInfo
     {
@@ -57,21 +148,48 @@ private:
         ScopedFd fd;
         size_t size{ };
         mode_t mode{ };
+        unsigned id{ };
+    };
+
+    /**
+     * Receiver to writer pipeline; see TxSession::Link.
+     */
+    struct Link
+    {
+        BufQueue queue;
+        int numaNode{-1};
+        std::vector<unsigned> cpus;
     };
 
-    std::pair<FdMap, std::vector<FileInfo>> createFiles(
-        const util::TransferRequest &req);
+    struct SetupItem
+    {
+        std::filesystem::path path;
+        util::FileInfo info;
+    };
+
+    int setupFiles(const std::vector<SetupItem> &items, std::stop_token stopToken);
+    void receiveRetransmit(int fd);
 
-    WaitQueue<BDesc> queue_;
-    WaitQueue<BDesc> hashQueue_;
+    Link &linkFor(size_t stream);
+
+    Notifier notifier_;
+    std::vector<std::unique_ptr<Link>> links_;
+    BufQueue hashQueue_;
     std::shared_ptr<BufferPool> pool_;
     ThreadExecutor recvExec_;
     ThreadExecutor writeExec_;
     ThreadExecutor hashExec_;
     SessionConfig conf_;
     std::vector<ScopedFd> targetFds_;
+    std::shared_ptr<FileTable> files_;
+    std::mutex fileMutex_;
     std::vector<FileInfo> fileInfo_;
+    std::vector<std::future<int>> setupResults_;
     std::shared_ptr<Journal> journal_;
+    std::shared_ptr<RetransmitList> retransmits_;
+
+    // last, so running setup tasks are done before the rest goes.
+    TaskPool setupExec_{SetupThreadCount};
 };
 
 }
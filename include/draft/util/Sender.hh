@@ -27,8 +27,11 @@
 #ifndef __DRAFT_UTIL_SENDER_HH_
 #define __DRAFT_UTIL_SENDER_HH_
 
+#include <deque>
+#include <optional>
 #include <stop_token>
 
+#include "Dispatcher.hh"
 #include "Journal.hh"
 #include "Util.hh"
 
@@ -46,14 +49,71 @@ public:
         hashLog_ = hashLog;
     }
 
+    static constexpr size_t DefaultMaxZeroCopyPending = 8;
+
+    /**
+     * Send with MSG_ZEROCOPY.
+     *
+     * Chunk buffers are held until the kernel reports that it's finished
+     * with them on the socket error queue. Completions are reaped after
+     * every send, and the sender waits for them once maxPending buffers
+     * are held, so the pool isn't drained - keep it well under the pool's
+     * share for this stream.
+     *
+     * @return false if the socket doesn't support zero-copy sends.
+     */
+    bool useZeroCopy(size_t maxPending = DefaultMaxZeroCopyPending);
+
+    /**
+     * Count this connection's traffic as stream id, in streamStats().
+     */
+    void setStreamId(unsigned id)
+    {
+        streamId_ = id;
+    }
+
+    /**
+     * Take chunks as the dispatcher decides, instead of whenever this
+     * stream is ready for one. Call after setStreamId.
+     */
+    void useDispatcher(const std::shared_ptr<Dispatcher> &dispatcher)
+    {
+        dispatcher_ = dispatcher;
+        slot_ = dispatcher->add(fd_.get(), streamId_);
+    }
+
     bool runOnce(std::stop_token stopToken);
 
 private:
+    struct ZeroCopySend
+    {
+        wire::ChunkHeader header{ };
+        BufferPtr buf{ };
+        uint32_t lastSeq{ };
+        bool sent{ };
+    };
+
+    std::optional<BDesc> take(std::stop_token stopToken);
     size_t write(BDesc desc);
+    size_t writeZeroCopy(BDesc desc);
+    void logHash(const BDesc &desc);
+
+    void reapCompletions(int tmoMs);
+    void drainCompletions();
 
     BufQueue *queue_{ };
     ScopedFd fd_{ };
     std::shared_ptr<Journal> hashLog_{ };
+    std::shared_ptr<Dispatcher> dispatcher_{ };
+    unsigned slot_{ };
+
+    // deque, so headers keep their address while the kernel references them.
+    std::deque<ZeroCopySend> zcPending_{ };
+    uint32_t zcSeq_{ };
+    uint32_t zcCompletedSeq_{ };
+    size_t zcMaxPending_{DefaultMaxZeroCopyPending};
+    unsigned streamId_{ };
+    bool zeroCopy_{ };
 };
 
 }
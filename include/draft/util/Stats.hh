@@ -27,8 +27,11 @@
 #ifndef __DRAFT_UTIL_STATS_HH__
 #define __DRAFT_UTIL_STATS_HH__
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
+#include <memory>
 #include <optional>
 #include <vector>
 
@@ -43,30 +46,137 @@ struct Stats
     std::atomic_uint64_t dequeuedBlockCount{ };
     std::atomic_uint64_t netByteCount{ };
     std::atomic_uint64_t fileByteCount{ };
+    std::atomic_uint64_t deltaSkipByteCount{ };
+    std::atomic_uint64_t holeByteCount{ };
+    std::atomic_uint64_t compressRawByteCount{ };
+    std::atomic_uint64_t compressedByteCount{ };
+    std::atomic_uint64_t compressSkipCount{ };
+    std::atomic_uint64_t hashByteCount{ };
+    std::atomic_uint64_t hashBusyNs{ };
+    std::atomic_uint64_t hashIdleNs{ };
+    std::atomic_uint64_t hashQueueFullCount{ };
+    std::atomic_uint64_t corruptChunkCount{ };
+    std::atomic_uint64_t retransmitByteCount{ };
+    std::atomic_uint64_t zeroCopySendCount{ };
+    std::atomic_uint64_t zeroCopyCopiedCount{ };
+    std::atomic_uint64_t poolByteCount{ };
+    std::atomic_uint64_t poolHugeTlbByteCount{ };
+    std::atomic_uint64_t poolThpByteCount{ };
+    std::atomic_uint64_t poolLockedByteCount{ };
+    std::atomic_uint64_t poolFallbackCount{ };
+};
+
+/**
+ * Traffic over one data connection, for per-stream throughput: bytes over
+ * the time from its first chunk to its last.
+ */
+struct StreamStats
+{
+    using Clock = std::chrono::steady_clock;
+
+    void addChunk(size_t len) noexcept
+    {
+        const auto now = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count());
+
+        auto unset = uint64_t{ };
+        firstNs.compare_exchange_strong(unset, now);
+        lastNs = now;
+
+        byteCount += len;
+        ++chunkCount;
+    }
+
+    /**
+     * In bytes per second.
+     */
+    double throughput() const noexcept
+    {
+        const auto ns = lastNs - firstNs;
+
+        return ns ? static_cast<double>(byteCount) * 1e9 / static_cast<double>(ns) : 0.0;
+    }
+
+    std::atomic_uint64_t byteCount{ };
+    std::atomic_uint64_t chunkCount{ };
+    std::atomic_uint64_t firstNs{ };
+    std::atomic_uint64_t lastNs{ };
+
+    // tx only: the socket's latest TCP_INFO, and the time the dispatcher
+    // kept the stream waiting for chunks.
+    std::atomic_uint32_t rttUs{ };
+    std::atomic_uint32_t cwnd{ };
+    std::atomic_uint32_t retransmits{ };
+    std::atomic_uint64_t passNs{ };
 };
 
 struct StatsManager
 {
+    // file ids are 16 bits on the wire.
+    static constexpr size_t MaxFileCount = size_t{1} << 16;
+    static constexpr size_t FileBlockSize = 1024;
+
     Stats &get()
     {
         return globalStats;
     }
 
+    /**
+     * Reset the per-file stats to size entries. Not safe while they're in
+     * use; see grow().
+     */
     void reallocate(size_t size)
     {
-        fileStats = std::vector<Stats>(size);
+        fileCount = 0;
+        fileBlocks = { };
+
+        grow(size);
+    }
+
+    /**
+     * Make room for ids below size, leaving existing entries where they
+     * are, so the per-file stats can follow a streamed manifest while
+     * they're being updated. Calls to grow() must not overlap.
+     */
+    void grow(size_t size)
+    {
+        size = std::min(size, MaxFileCount);
+
+        for (auto i = fileCount.load() / FileBlockSize; i * FileBlockSize < size; ++i)
+        {
+            if (!fileBlocks[i])
+                fileBlocks[i] = std::make_unique<Stats[]>(FileBlockSize);
+        }
+
+        if (size > fileCount)
+            fileCount.store(size, std::memory_order_release);
     }
 
     Stats *get(unsigned id)
     {
-        if (id >= fileStats.size())
+        if (id >= fileCount.load(std::memory_order_acquire))
             return { };
 
-        return &fileStats[id];
+        return &fileBlocks[id / FileBlockSize][id % FileBlockSize];
+    }
+
+    void reallocateStreams(size_t size)
+    {
+        streamStats = std::vector<StreamStats>(size);
+    }
+
+    StreamStats *getStream(unsigned id)
+    {
+        if (id >= streamStats.size())
+            return { };
+
+        return &streamStats[id];
     }
 
     Stats globalStats;
-    std::vector<Stats> fileStats;
+    std::array<std::unique_ptr<Stats[]>, MaxFileCount / FileBlockSize> fileBlocks;
+    std::atomic_size_t fileCount{ };
+    std::vector<StreamStats> streamStats;
 };
 
 struct BandwidthMonitor
@@ -128,6 +238,11 @@ inline decltype(auto) stats(size_t id)
     return statsMgr().get(id);
 }
 
+inline decltype(auto) streamStats(unsigned id)
+{
+    return statsMgr().getStream(id);
+}
+
 }
 
 #endif
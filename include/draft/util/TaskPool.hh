@@ -34,6 +34,7 @@
 #include <type_traits>
 #include <vector>
 
+#include "Notifier.hh"
 #include "Util.hh"
 
 namespace draft::util {
@@ -52,12 +53,26 @@ public:
 
     void setQueueSizeLimit(size_t limit);
 
+    /**
+     * Notify when a task completes, or is taken off the queue (making room
+     * to launch another).
+     */
+    void setNotifier(Notifier *notifier) noexcept
+    {
+        notifier_ = notifier;
+    }
+
     void cancel() noexcept;
     bool cancelled() const noexcept;
 
     size_t size() const noexcept;
     void resize(size_t newSize);
 
+    /**
+     * Restrict the pool's threads, current and future, to the given cpus.
+     */
+    void setAffinity(std::vector<unsigned> cpus);
+
     template <typename Function, typename ...Args>
         requires std::invocable<Function, std::stop_token, Args...>
     [[nodiscard]]
@@ -75,12 +90,16 @@ public:
         auto ok = q_.put([
             f = std::move(f),
             ...args = std::forward<Args>(args),
-            p = std::move(promise)](std::stop_token stopToken) mutable {
+            p = std::move(promise),
+            n = notifier_](std::stop_token stopToken) mutable {
                 try {
                     p->set_value(std::invoke(std::move(f), stopToken, std::forward<Args>(args)...));
                 } catch (...) {
                     p->set_exception(std::current_exception());
                 }
+
+                if (n)
+                    n->notify();
             });
 
         if (!ok)
@@ -96,6 +115,8 @@ private:
 
     WaitQueue<Work> q_;
     std::vector<std::jthread> threads_;
+    std::vector<unsigned> cpus_;
+    Notifier *notifier_{ };
 };
 
 }
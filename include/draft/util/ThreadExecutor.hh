@@ -33,6 +33,8 @@
 #include <ranges>
 #include <thread>
 
+#include "Notifier.hh"
+
 namespace draft::util {
 
 class ThreadExecutor
@@ -50,11 +52,19 @@ public:
         (add(std::forward<Args>(args)), ...);
     }
 
+    /**
+     * Notify when a runnable finishes. Applies to runnables added afterwards.
+     */
+    void setNotifier(Notifier *notifier) noexcept
+    {
+        notifier_ = notifier;
+    }
+
     template <typename T>
     ThreadExecutor &add(T &&runnable, unsigned opts = 0)
     {
         runq_.push_back(
-            std::make_unique<Runnable_<T>>(std::forward<T>(runnable), opts));
+            std::make_unique<Runnable_<T>>(std::forward<T>(runnable), opts, notifier_));
 
         return *this;
     }
@@ -63,9 +73,9 @@ public:
     ThreadExecutor &add(std::vector<T> runnables, unsigned opts = 0)
     {
         auto runnablesView = std::views::transform(
-            runnables, [opts](auto &&r) {
+            runnables, [this, opts](auto &&r) {
                 return std::make_unique<Runnable_<T>>(
-                    std::forward<T>(r), opts);
+                    std::forward<T>(r), opts, notifier_);
             });
 
         runq_.insert(
@@ -107,8 +117,9 @@ private:
     class Runnable_: public Runnable
     {
     public:
-        Runnable_(T t, unsigned options = 0):
-            options_(options)
+        Runnable_(T t, unsigned options = 0, Notifier *notifier = nullptr):
+            options_(options),
+            notifier_(notifier)
         {
             thd_ = std::jthread(
                 [this](std::stop_token token, T t_) mutable {
@@ -153,6 +164,9 @@ private:
 
                     finished_ = true;
                     spdlog::debug("thd runnable exiting.");
+
+                    if (notifier_)
+                        notifier_->notify();
                 }, std::move(t));
         }
 
@@ -185,12 +199,14 @@ private:
 
         std::atomic_bool finished_{ };
         unsigned options_{ };
+        Notifier *notifier_{ };
         mutable std::mutex exMtx_{ };
         std::exception_ptr exception_{ };
         std::jthread thd_{ };
     };
 
     std::vector<std::unique_ptr<Runnable>> runq_;
+    Notifier *notifier_{ };
 };
 
 }
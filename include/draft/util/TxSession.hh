@@ -28,15 +28,19 @@
 #define __DRAFT_UTIL_TX_SESSION_HH__
 
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "Dispatcher.hh"
+#include "Notifier.hh"
 #include "TaskPool.hh"
 #include "ThreadExecutor.hh"
 #include "Util.hh"
 
 namespace draft::util {
 
+class IoUringPool;
 class Journal;
 
 class TxSession
@@ -45,25 +49,101 @@ public:
     TxSession(SessionConfig conf);
     ~TxSession() noexcept;
 
-    void start(const std::string &path);
+    /**
+     * Skip ranges the receiver reported as already received, and chunks
+     * whose digests match the receiver's copy. Call before start().
+     */
+    void resume(ResumeInfo info)
+    {
+        completed_ = std::move(info.completed);
+
+        if (!info.digests.empty())
+            digests_ = std::make_shared<const ChunkDigests>(std::move(info.digests));
+    }
+
+    /**
+     * Add a batch of files to send, as sent to the receiver in the
+     * manifest. May be called from another thread while the session runs;
+     * the session finishes once the last batch has been sent.
+     */
+    void addFiles(std::vector<FileInfo> info, bool last);
+
+    /**
+     * Start sending files. The journal lists every file, so with journaling
+     * the last batch must have been added already.
+     */
+    void start();
+
+    /**
+     * Once everything's sent, serve the receiver's requests for chunks that
+     * failed verification, over fd (the service connection), until it
+     * sends an empty one.
+     */
+    void retransmit(int fd);
+
     void finish() noexcept;
 
     bool runOnce();
 
+    /**
+     * Wait up to tmoMs for the session's workers to make progress, i.e.
+     * until there's something for runOnce to do.
+     */
+    bool wait(int tmoMs)
+    {
+        return notifier_.wait(tmoMs);
+    }
+
+    Notifier &notifier() noexcept
+    {
+        return notifier_;
+    }
+
 private:
-    using file_info_iter_type = std::vector<FileInfo>::const_iterator;
+    /**
+     * Reader to sender pipeline. There's one shared by all senders, or,
+     * with numa pipelines, one per target placed on its NIC's node. The
+     * senders sharing a pipeline's queue stripe its chunks over their
+     * streams, as its dispatcher decides.
+     */
+    struct Link
+    {
+        BufQueue queue;
+        std::shared_ptr<Dispatcher> dispatcher;
+        std::shared_ptr<BufferPool> pool;
+        std::shared_ptr<IoUringPool> rings;
+        TaskPool readExec;
+        std::vector<unsigned> cpus;
+    };
 
-    file_info_iter_type nextFile(file_info_iter_type first, file_info_iter_type last);
+    void takeFiles();
+    size_t nextFile(size_t index) const;
 
     bool startFile(const FileInfo &info);
+    bool packable(const FileInfo &info) const;
+    bool startPacked();
+    void skipHoles(unsigned fileId, size_t fileSize);
+    void resend(int fd, const ChunkRange &chunk);
+
+    std::unique_ptr<Link> makeLink(int numaNode);
+    Link &linkFor(size_t stream);
 
-    WaitQueue<BDesc> queue_;
-    std::shared_ptr<BufferPool> pool_;
-    TaskPool readExec_;
+    Notifier notifier_;
+    std::vector<std::unique_ptr<Link>> links_;
+    size_t nextLink_{ };
     std::vector<std::future<int>> readResults_;
     ThreadExecutor sendExec_;
+    std::mutex addMutex_;
+    std::vector<FileInfo> added_;
+    bool addedLast_{ };
     std::vector<FileInfo> info_;
-    std::vector<FileInfo>::const_iterator fileIter_;
+    size_t nextFile_{ };
+    bool haveAllFiles_{ };
+    std::shared_ptr<ScopedFd> segmentFd_;
+    std::vector<Segment> segments_;
+    size_t nextSegment_{ };
+    CompletedRanges completed_;
+    std::shared_ptr<const ChunkDigests> digests_;
     SessionConfig conf_;
     std::vector<ScopedFd> targetFds_;
     std::shared_ptr<Journal> journal_;
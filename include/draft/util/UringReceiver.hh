@@ -0,0 +1,193 @@
+/**
+ * @file UringReceiver.hh
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DRAFT_UTIL_URING_RECEIVER_HH__
+#define __DRAFT_UTIL_URING_RECEIVER_HH__
+
+#include <memory>
+#include <optional>
+#include <stop_token>
+#include <vector>
+
+#include "FileTable.hh"
+#include "IoUring.hh"
+#include "Journal.hh"
+#include "Retransmit.hh"
+#include "Util.hh"
+
+namespace draft::util {
+
+/**
+ * Receive & write engine for all data connections of an rx session, driven
+ * by a single io_uring.
+ *
+ * Each connection alternates between receiving a chunk header and receiving
+ * its payload into a pool buffer. The payload recv is linked to the O_DIRECT
+ * write of that buffer, so the kernel starts the write as soon as the payload
+ * lands, and the next header recv is posted while the write is in flight.
+ *
+ * This replaces the per-connection Receiver threads, the Writer thread, and
+ * the queue between them. Connections count as streams, in streamStats(),
+ * in the order of their listening fds.
+ */
+class UringReceiver
+{
+public:
+    using Buffer = BufferPool::Buffer;
+
+    UringReceiver(std::vector<ScopedFd> listenFds, std::shared_ptr<FileTable> files, unsigned depth, const BufferPoolOptions &poolOptions = { });
+
+    void useHashLog(const std::shared_ptr<Journal> &hashLog)
+    {
+        hashLog_ = hashLog;
+    }
+
+    /**
+     * Request chunks that fail verification again through list. Plain
+     * chunks are written as they land, so they're verified after the
+     * fact, and overwritten when they're sent again.
+     */
+    void useRetransmits(const std::shared_ptr<RetransmitList> &list)
+    {
+        retransmits_ = list;
+    }
+
+    void setWritesEnabled(bool on = true)
+    {
+        writesEnabled_ = on;
+    }
+
+    bool runOnce(std::stop_token stopToken);
+
+private:
+    enum Op: uint8_t
+    {
+        Accept,
+        Header,
+        Payload,
+        Write
+    };
+
+    struct Connection
+    {
+        enum class State
+        {
+            Accept,
+            Header,
+            AwaitBuffer,
+            Payload,
+            Closed
+        };
+
+        ScopedFd listenFd{ };
+        ScopedFd fd{ };
+        wire::ChunkHeader header{ };
+        size_t offset{ };
+        size_t writeSlot{ };
+        State state{State::Accept};
+    };
+
+    /**
+     * One write of (part of) a buffer to a file. A short write is posted
+     * again from where it stopped.
+     */
+    struct WriteSegment
+    {
+        int fd{-1};
+        size_t bufOffset{ };
+        size_t len{ };
+        size_t fileOffset{ };
+        size_t done{ };
+    };
+
+    struct PendingWrite
+    {
+        Buffer buf{ };
+        size_t offset{ };
+        size_t len{ };
+        unsigned fileId{ };
+        uint8_t flags{ };
+        uint8_t codec{ };
+        uint32_t rawLen{ };
+        uint64_t digest{ };
+        std::vector<WriteSegment> segments{ };
+        unsigned pending{ };
+        bool received{ };
+        bool abandoned{ };
+        bool hashed{ };
+        bool linked{ };
+        bool awaitFile{ };
+    };
+
+    static uint64_t userData(Op op, size_t index) noexcept
+    {
+        return (static_cast<uint64_t>(index) << 8) | op;
+    }
+
+    static uint64_t writeData(size_t slot, size_t segment) noexcept
+    {
+        return userData(Op::Write, (segment << 16) | slot);
+    }
+
+    void handle(const IoUring::Cqe &cqe);
+    void handleAccept(Connection &conn, size_t index, int res);
+    void handleHeader(Connection &conn, size_t index, int res);
+    void handlePayload(Connection &conn, size_t index, int res);
+    void handleWrite(size_t slot, size_t segment, int res);
+    void postWrites(PendingWrite &write, size_t slot);
+    void postPackedWrites(PendingWrite &write, size_t slot);
+    void postWrite(PendingWrite &write, size_t slot);
+    void postSegment(IoUring::Sqe *sqe, PendingWrite &write, size_t slot, size_t segment);
+    void decompress(PendingWrite &write);
+    std::vector<ChunkRange> verify(PendingWrite &write);
+
+    void postAccept(Connection &conn, size_t index);
+    void postHeader(Connection &conn, size_t index);
+    bool postPayload(Connection &conn, size_t index);
+
+    void completeChunk(const PendingWrite &write, const std::vector<ChunkRange> &corrupt);
+    void finishWrite(const PendingWrite &write, size_t len);
+    void release(PendingWrite &write);
+
+    IoUring::Sqe *getSqe();
+
+    std::optional<int> getFd(unsigned id) const;
+
+    BufferPoolPtr pool_{ };
+    std::vector<Connection> conns_{ };
+    std::vector<PendingWrite> writes_{ };
+    std::shared_ptr<FileTable> files_{ };
+    std::shared_ptr<Journal> hashLog_{ };
+    std::shared_ptr<RetransmitList> retransmits_{ };
+    std::unique_ptr<IoUring> ring_{ };
+    size_t activeWrites_{ };
+    bool writesEnabled_{true};
+    bool started_{ };
+};
+
+}
+
+#endif
@@ -33,10 +33,13 @@
 #include <filesystem>
 #include <memory>
 #include <numeric>
+#include <span>
 #include <string>
 #include <system_error>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <fcntl.h>
 #include <sys/uio.h>
@@ -46,6 +49,7 @@
 #include "BufferPool.hh"
 #include "IOVec.hh"
 #include "Protocol.hh"
+#include "RingQueue.hh"
 #include "ScopedFd.hh"
 #include "ScopedMMap.hh"
 #include "WaitQueue.hh"
@@ -54,6 +58,7 @@ namespace draft::util {
 
 constexpr auto BlockSize = size_t{4096};
 constexpr auto BufSize = size_t{1u << 22};
+constexpr auto DefaultSegmentSize = size_t{1u << 30};
 
 constexpr size_t roundBlockSize(size_t len) noexcept
 {
@@ -62,7 +67,7 @@ constexpr size_t roundBlockSize(size_t len) noexcept
 
 struct MessageBuffer
 {
-    std::shared_ptr<BufferPool::Buffer> buf;
+    BufferPool::Buffer buf;
     size_t fileOffset{ };
     size_t payloadLength{ };
     unsigned fileId{ };
@@ -106,9 +111,50 @@ struct TransferRequest
     draft::util::FileAgentConfig config;
 };
 
+/**
+ * A batch of the sender's manifest, sent as the tree is scanned. The
+ * final batch is flagged, and may be empty.
+ */
+struct ManifestBatch
+{
+    std::vector<FileInfo> info;
+    bool last{ };
+};
+
+/**
+ * The file id of a packed chunk's descriptor; the files are in its table.
+ */
+constexpr auto PackedFileId = ~0u;
+
+/**
+ * The digest of one file in a packed chunk.
+ */
+struct PackedDigest
+{
+    unsigned fileId{ };
+    size_t len{ };
+    uint64_t digest{ };
+};
+
 struct BDesc
 {
-    std::shared_ptr<BufferPool::Buffer> buf{ };
+    BufferPool::Buffer buf{ };
+    unsigned fileId{ };
+    size_t offset{ };
+    size_t len{ };
+    uint8_t flags{ };
+    uint8_t codec{ };
+    uint32_t rawLen{ };
+    uint64_t digest{ };
+    bool hashed{ };
+    std::shared_ptr<const std::vector<PackedDigest>> packedDigests{ };
+};
+
+/**
+ * A range of a file, as sent in one chunk.
+ */
+struct ChunkRange
+{
     unsigned fileId{ };
     size_t offset{ };
     size_t len{ };
@@ -125,19 +171,59 @@ struct TransferInfo
     std::unordered_map<unsigned, ScopedFd> fileMap;
 };
 
+enum class IoEngine
+{
+    Sync,
+    Uring,
+    Splice
+};
+
 struct SessionConfig
 {
     std::vector<NetworkTarget> targets;
     NetworkTarget service;
     std::string pathRoot{"."};
     std::string journalPath{ };
+    IoEngine ioEngine{IoEngine::Sync};
+    unsigned ioDepth{32};
+    unsigned readerCount{1};
+    size_t segmentSize{DefaultSegmentSize};
     bool useDirectIO{true};
     bool noWrite{false};
+    bool zeroCopy{false};
+    bool numaPipelines{false};
+    unsigned compressLevel{ };
+    unsigned streamCount{1};
+    BufferPoolOptions poolOptions{ };
 };
 
-using BufQueue = WaitQueue<BDesc>;
-using BufferPtr = std::shared_ptr<BufferPool::Buffer>;
-using FdMap = std::unordered_map<unsigned, int>;
+/**
+ * Sorted, non-overlapping byte ranges the receiver already holds, keyed by
+ * file id - reported back to the sender when resuming a transfer.
+ */
+using CompletedRanges = std::unordered_map<unsigned, std::vector<Segment>>;
+
+/**
+ * XXH3 digests of the chunks in the receiver's existing copy of each file,
+ * keyed by file id, then chunk offset - reported back to the sender in
+ * delta mode, so it only sends chunks that differ.
+ */
+using ChunkDigests = std::unordered_map<unsigned, std::unordered_map<size_t, uint64_t>>;
+
+/**
+ * The receiver's reply to a transfer request: what it already has, and
+ * whether it's taking the rest of the manifest while data flows - if not,
+ * it replies once it has the whole manifest.
+ */
+struct ResumeInfo
+{
+    CompletedRanges completed;
+    ChunkDigests digests;
+    bool streaming{ };
+};
+
+using BufQueue = RingQueue<BDesc>;
+using BufferPtr = BufferPool::Buffer;
 
 size_t readChunk(int fd, void *data, size_t dlen, size_t fileOffset);
 size_t writeChunk(int fd, iovec *iov, size_t iovCount);
@@ -148,7 +234,88 @@ std::vector<FileInfo> getFileInfo(const std::string &path);
 draft::util::NetworkTarget parseTarget(const std::string &str);
 size_t parseSize(const std::string &str);
 
-void createTargetFiles(const std::string &root, const std::vector<FileInfo> &infos);
+/**
+ * Split a file into segments of (at most) segmentSize bytes, rounded up to
+ * a multiple of BufSize so no chunk straddles two segments.
+ *
+ * A segmentSize of zero yields a single segment covering the file.
+ */
+std::vector<Segment> splitSegments(size_t fileSize, size_t segmentSize);
+
+/**
+ * Remove completed ranges from a file's segments, splitting segments that
+ * are only partially complete.
+ *
+ * @param completed sorted, non-overlapping ranges.
+ */
+std::vector<Segment> subtractSegments(const std::vector<Segment> &segments, const std::vector<Segment> &completed);
+
+/**
+ * Whether a file has fewer bytes allocated than its size, i.e. has holes.
+ */
+constexpr bool isSparse(const FileInfo::Status &status) noexcept
+{
+    return static_cast<size_t>(status.blkCount) * 512 < status.size;
+}
+
+/**
+ * Find the holes in a file with SEEK_HOLE/SEEK_DATA.
+ *
+ * Only whole BufSize chunks are reported, so the data left to send is
+ * still split at chunk offsets. A hole running to eof takes in the final,
+ * partial chunk.
+ *
+ * @return sorted, non-overlapping ranges - suitable for subtractSegments.
+ */
+std::vector<Segment> findHoles(int fd, size_t fileSize);
+
+/**
+ * Bytes of payload needed to pack count files holding dataLen bytes,
+ * rounded up per file.
+ */
+constexpr size_t packedPayloadSize(size_t count, size_t dataLen) noexcept
+{
+    return roundBlockSize(sizeof(wire::PackedTable) + count * sizeof(wire::PackedEntry)) + dataLen;
+}
+
+/**
+ * Call fn(fileId, data, len) - or fn(fileId, data, len, digest), with the
+ * digest from the file's entry - for each file in a packed chunk's payload.
+ *
+ * @throws std::runtime_error if the table doesn't fit the payload.
+ */
+template <typename Fn>
+void forEachPacked(const uint8_t *payload, size_t payloadLen, Fn &&fn)
+{
+    if (payloadLen < sizeof(wire::PackedTable) || payloadLen > BufSize)
+        throw std::runtime_error("packed chunk: invalid payload length " + std::to_string(payloadLen));
+
+    const auto table = reinterpret_cast<const wire::PackedTable *>(payload);
+    const auto entries = reinterpret_cast<const wire::PackedEntry *>(table + 1);
+
+    if (packedPayloadSize(table->count, 0) > payloadLen)
+        throw std::runtime_error("packed chunk: invalid entry count " + std::to_string(table->count));
+
+    for (const auto &entry : std::span{entries, table->count})
+    {
+        if (entry.payloadOffset % BlockSize || size_t{entry.payloadOffset} + entry.len > payloadLen)
+        {
+            throw std::runtime_error(
+                "packed chunk: invalid entry for file " + std::to_string(entry.fileId));
+        }
+
+        if constexpr (std::is_invocable_v<Fn, unsigned, const uint8_t *, size_t, uint64_t>)
+            fn(unsigned{entry.fileId}, payload + entry.payloadOffset, size_t{entry.len}, entry.digest);
+        else
+            fn(unsigned{entry.fileId}, payload + entry.payloadOffset, size_t{entry.len});
+    }
+}
+
+/**
+ * The XXH3 digest of a packed chunk's table & entries, as carried in its
+ * header.
+ */
+uint64_t packedTableDigest(const uint8_t *payload, size_t payloadLen);
 
 std::string dirname(std::string path);
 
@@ -179,8 +346,16 @@ std::string peerName(int fd);
 
 }
 
-std::vector<ScopedFd> connectNetworkTargets(const std::vector<NetworkTarget> &targets);
-std::vector<ScopedFd> bindNetworkTargets(const std::vector<NetworkTarget> &targets);
+/**
+ * Connect streams data connections to each target, in target order.
+ */
+std::vector<ScopedFd> connectNetworkTargets(const std::vector<NetworkTarget> &targets, unsigned streams = 1);
+
+/**
+ * Listen on each target, with an fd per stream, in target order; a
+ * target's fds share its listening socket.
+ */
+std::vector<ScopedFd> bindNetworkTargets(const std::vector<NetworkTarget> &targets, unsigned streams = 1);
 
 }
 
@@ -39,10 +39,28 @@ void to_json(nlohmann::json &j, const FileInfo &info);
 void from_json(const nlohmann::json &j, FileInfo::Status &status);
 void from_json(const nlohmann::json &j, FileInfo &info);
 
-Buffer generateTransferRequestMsg(std::vector<FileInfo> info);
+Buffer generateManifestMsg(const std::vector<FileInfo> &info, bool last);
 
-TransferRequest deserializeTransferRequest(const Buffer &buf);
-TransferRequest deserializeTransferRequest(const std::vector<uint8_t> &buf);
+/**
+ * Deserialize a manifest batch from a message's payload, i.e. the bytes
+ * following its chunk header.
+ */
+ManifestBatch deserializeManifestMsg(const uint8_t *data, size_t len);
+
+Buffer generateResumeMsg(const ResumeInfo &info);
+
+ResumeInfo deserializeResumeMsg(const std::vector<uint8_t> &buf);
+
+/**
+ * The receiver's request for chunks that failed verification; an empty
+ * request ends the transfer.
+ */
+Buffer generateRetransmitMsg(const std::vector<ChunkRange> &chunks);
+
+/**
+ * Deserialize a retransmit request from a message's payload.
+ */
+std::vector<ChunkRange> deserializeRetransmitMsg(const uint8_t *data, size_t len);
 
 }
 
@@ -34,6 +34,7 @@
 
 #include "Hasher.hh"
 #include "Journal.hh"
+#include "Notifier.hh"
 #include "ScopedTempFile.hh"
 #include "TaskPool.hh"
 #include "ThreadExecutor.hh"
@@ -46,7 +47,15 @@ class VerifySession
 public:
     struct Config
     {
+        unsigned readerCount{1};
+        size_t segmentSize{DefaultSegmentSize};
         bool useDirectIO{true};
+
+        /**
+         * Threads hashing what the readers read; 0 sizes the pool from the
+         * reader count and the cpus available.
+         */
+        unsigned hasherCount{ };
     };
 
     explicit VerifySession(Config conf);
@@ -60,6 +69,14 @@ public:
 
     bool runOnce();
 
+    /**
+     * Wait up to tmoMs for the session's workers to make progress.
+     */
+    bool wait(int tmoMs)
+    {
+        return notifier_.wait(tmoMs);
+    }
+
     // once finished, return the diff result.
     std::optional<JournalFileDiff> diff();
     std::optional<Journal> releaseJournal() &&;
@@ -69,16 +86,21 @@ private:
 
     file_info_iter_type nextFile(file_info_iter_type first, file_info_iter_type last);
 
+    void startHashers();
     bool startFile(const FileInfo &info);
     void handleHash(const Hasher::DigestInfo &info);
 
-    WaitQueue<BDesc> hashQueue_;
+    Notifier notifier_;
+    BufQueue hashQueue_;
     std::shared_ptr<BufferPool> pool_;
     TaskPool readExec_;
     std::vector<std::future<int>> readResults_;
     ThreadExecutor hashExec_;
     std::vector<FileInfo> info_;
     std::vector<FileInfo>::const_iterator fileIter_;
+    std::shared_ptr<ScopedFd> segmentFd_;
+    std::vector<Segment> segments_;
+    size_t nextSegment_{ };
     Config conf_;
     util::ScopedTempFile journalFile_;
     Journal journal_;
@@ -27,8 +27,10 @@
 #ifndef __DRAFT_UTIL_WRITER_HH__
 #define __DRAFT_UTIL_WRITER_HH__
 
+#include <memory>
 #include <stop_token>
 
+#include "FileTable.hh"
 #include "Util.hh"
 
 namespace draft::util {
@@ -38,7 +40,7 @@ class Writer
 public:
     using Buffer = BufferPool::Buffer;
 
-    Writer(FdMap fdMap, BufQueue &queue);
+    Writer(std::shared_ptr<FileTable> files, BufQueue &queue);
 
     void setWritesEnabled(bool on = true)
     {
@@ -51,9 +53,10 @@ private:
     int getFd(unsigned id);
 
     size_t write(BDesc desc);
+    size_t writePacked(const BDesc &desc);
 
     BufQueue *queue_{ };
-    FdMap fdMap_{ };
+    std::shared_ptr<FileTable> files_;
     bool writesEnabled_{true};
 };
 
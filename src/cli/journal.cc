@@ -36,6 +36,7 @@
 #include <draft/util/Journal.hh>
 
 #include <draft/util/JournalOperations.hh>
+#include <draft/util/Stats.hh>
 #include <draft/util/VerifySession.hh>
 
 #include "Cmd.hh"
@@ -67,12 +68,22 @@ struct Options
     OutputFormat format{ };
     Operations ops{ };
     std::string rootPath{ };
+    unsigned readerCount{1};
+    unsigned hasherCount{ };
+    size_t segmentSize{util::DefaultSegmentSize};
 };
 
 Options parseOptions(int argc, char **argv)
 {
     using namespace std::string_literals;
 
+    enum LongOnlyOpts
+    {
+        OptReaderThreads = 128,
+        OptHasherThreads,
+        OptSegmentSize
+    };
+
     static constexpr const char *shortOpts = "c:d:Df:hv";
     static constexpr struct option longOpts[] = {
         {"create", required_argument, nullptr, 'c'},
@@ -81,6 +92,9 @@ Options parseOptions(int argc, char **argv)
         {"format", required_argument, nullptr, 'f'},
         {"help", no_argument, nullptr, 'h'},
         {"verify", no_argument, nullptr, 'v'},
+        {"reader-threads", required_argument, nullptr, OptReaderThreads},
+        {"hasher-threads", required_argument, nullptr, OptHasherThreads},
+        {"segment-size", required_argument, nullptr, OptSegmentSize},
         {nullptr, 0, nullptr, 0}
     };
 
@@ -103,7 +117,16 @@ Options parseOptions(int argc, char **argv)
                 "       show this help\n"
                 "   -v | --verify <journal file>\n"
                 "       verify a journal against local filesystem contents.\n"
-                , ::basename(argv[0]));
+                "   --reader-threads <count>\n"
+                "       number of threads reading file segments for create & verify (default: 1).\n"
+                "   --hasher-threads <count>\n"
+                "       number of threads hashing what the readers read, for create & verify.\n"
+                "       0 sizes the pool from the reader count & cpus (default: 0).\n"
+                "   --segment-size <bytes>\n"
+                "       split files into segments of this size, read in parallel by the reader\n"
+                "       threads. 0 reads each file as a single segment (default: {}).\n"
+                , ::basename(argv[0])
+                , util::DefaultSegmentSize);
         };
 
     auto opts = Options{ };
@@ -143,6 +166,20 @@ Options parseOptions(int argc, char **argv)
             case 'v':
                 opts.ops.verify = 1;
                 break;
+            case OptReaderThreads:
+                opts.readerCount = static_cast<unsigned>(util::parseSize(optarg));
+                if (!opts.readerCount)
+                {
+                    std::cerr << "error: reader thread count must be greater than zero\n";
+                    std::exit(1);
+                }
+                break;
+            case OptHasherThreads:
+                opts.hasherCount = static_cast<unsigned>(util::parseSize(optarg));
+                break;
+            case OptSegmentSize:
+                opts.segmentSize = util::parseSize(optarg);
+                break;
             case '?':
                 std::exit(1);
             default:
@@ -266,10 +303,31 @@ void dumpDiff(const util::JournalFileDiff &diff, const Options &opts)
     }
 }
 
+void dumpHashStats()
+{
+    const auto &stats = util::stats();
+
+    const auto busy = static_cast<double>(stats.hashBusyNs);
+    const auto total = busy + static_cast<double>(stats.hashIdleNs);
+
+    spdlog::info(
+        "hashing stats:\n"
+        "  hashed byte count:       {}\n"
+        "  hasher utilization:      {:.1f}%\n"
+        "  queue full count:        {}\n"
+        "   (times readers waited on the hashers)\n"
+        , stats.hashByteCount
+        , total > 0 ? 100.0 * busy / total : 0.0
+        , stats.hashQueueFullCount);
+}
+
 int verifyJournal(const Journal &journal, const Options &opts)
 {
     auto config = util::VerifySession::Config{
-            .useDirectIO = true
+            .readerCount = opts.readerCount,
+            .segmentSize = opts.segmentSize,
+            .useDirectIO = true,
+            .hasherCount = opts.hasherCount
         };
 
     auto diff = util::verifyJournal(journal, std::move(config));
@@ -277,6 +335,8 @@ int verifyJournal(const Journal &journal, const Options &opts)
     if (!diff)
         return 1;
 
+    dumpHashStats();
+
     dumpDiff(*diff, opts);
 
     return 0;
@@ -285,7 +345,10 @@ int verifyJournal(const Journal &journal, const Options &opts)
 int createJournal(const std::string &journalPath, const Options &opts)
 {
     auto config = util::VerifySession::Config{
-            .useDirectIO = true
+            .readerCount = opts.readerCount,
+            .segmentSize = opts.segmentSize,
+            .useDirectIO = true,
+            .hasherCount = opts.hasherCount
         };
 
     auto info = util::getFileInfo(opts.rootPath);
@@ -293,6 +356,8 @@ int createJournal(const std::string &journalPath, const Options &opts)
     if (!util::createJournal(std::move(info), std::move(config), journalPath))
         return 1;
 
+    dumpHashStats();
+
     return 0;
 }
 
@@ -24,13 +24,22 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <thread>
 
 #include <getopt.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 
+#include <draft/util/ChunkCodec.hh>
+#include <draft/util/FileScanner.hh>
 #include <draft/util/InfoReceiver.hh>
 #include <draft/util/ProgressDisplay.hh>
 #include <draft/util/RxSession.hh>
@@ -45,6 +54,9 @@ namespace {
 
 sig_atomic_t done_;
 
+// wakes the session loop, so it notices done_ right away.
+std::atomic<draft::util::Notifier *> wakeup_{ };
+
 void handleSigint(int)
 {
     if (done_)
@@ -54,14 +66,76 @@ void handleSigint(int)
     }
 
     done_ = 1;
+
+    if (auto wakeup = wakeup_.load())
+        wakeup->notify();
 }
 
 void handleSigpipe(int)
 {
     fprintf(stderr, "draft send: sigpipe\n");
     done_ = 1;
+
+    if (auto wakeup = wakeup_.load())
+        wakeup->notify();
+}
+
+/**
+ * End the transfer after a helper thread's error.
+ */
+void abortTransfer(const std::exception &e)
+{
+    // errors from tearing down an interrupted transfer aren't news.
+    if (!done_)
+        spdlog::error("ending transfer: {}", e.what());
+
+    done_ = 1;
+
+    if (auto wakeup = wakeup_.load())
+        wakeup->notify();
 }
 
+/**
+ * Exchanges the manifest over the service connection alongside the
+ * session. Joined on the way out; a transfer that's being abandoned has
+ * the connection shut down first, so the thread can't hold up the exit.
+ */
+class ManifestThread
+{
+public:
+    ManifestThread() = default;
+
+    template <typename Fn>
+    ManifestThread(int fd, Fn &&fn):
+        thread_(std::forward<Fn>(fn)),
+        fd_(fd)
+    {
+    }
+
+    ManifestThread(ManifestThread &&) = default;
+    ManifestThread &operator=(ManifestThread &&) = default;
+
+    ~ManifestThread() noexcept
+    {
+        join();
+    }
+
+    void join() noexcept
+    {
+        if (!thread_.joinable())
+            return;
+
+        if (done_ || std::uncaught_exceptions())
+            ::shutdown(fd_, SHUT_RDWR);
+
+        thread_.join();
+    }
+
+private:
+    std::thread thread_{ };
+    int fd_{-1};
+};
+
 void installSigHandler()
 {
     struct sigaction action{ };
@@ -78,6 +152,8 @@ struct Options
     draft::util::SessionConfig session;
     bool showProgress{ };
     bool doJournal{ };
+    bool resume{ };
+    bool delta{ };
 };
 
 enum class TransferMode { Send, Recv };
@@ -86,9 +162,23 @@ Options parseOptions(int argc, char **argv, TransferMode mode)
 {
     namespace fs = std::filesystem;
 
+    using namespace std::string_literals;
+
     enum LongOnlyOpts
     {
-        OptJournalPath = 128
+        OptJournalPath = 128,
+        OptIoEngine,
+        OptIoDepth,
+        OptZeroCopy,
+        OptReaderThreads,
+        OptSegmentSize,
+        OptHugePages,
+        OptMlock,
+        OptNuma,
+        OptResume,
+        OptDelta,
+        OptCompress,
+        OptStreams
     };
 
     static constexpr const char *shortOpts = "hjJ:nNp:Ps:t:";
@@ -102,6 +192,18 @@ Options parseOptions(int argc, char **argv, TransferMode mode)
         {"service", required_argument, nullptr, 's'},
         {"target", required_argument, nullptr, 't'},
         {"journal-path", required_argument, nullptr, 'J'},
+        {"io-engine", required_argument, nullptr, OptIoEngine},
+        {"io-depth", required_argument, nullptr, OptIoDepth},
+        {"zerocopy", no_argument, nullptr, OptZeroCopy},
+        {"reader-threads", required_argument, nullptr, OptReaderThreads},
+        {"segment-size", required_argument, nullptr, OptSegmentSize},
+        {"hugepages", required_argument, nullptr, OptHugePages},
+        {"mlock", no_argument, nullptr, OptMlock},
+        {"numa", no_argument, nullptr, OptNuma},
+        {"resume", no_argument, nullptr, OptResume},
+        {"delta", no_argument, nullptr, OptDelta},
+        {"compress", required_argument, nullptr, OptCompress},
+        {"streams", required_argument, nullptr, OptStreams},
         {nullptr, 0, nullptr, 0}
     };
 
@@ -126,6 +228,26 @@ Options parseOptions(int argc, char **argv, TransferMode mode)
                 "       and is <transfer path root>_(tx,rx)_journal.draft for single file transfers.\n"
                 "   -J | --journal-path <path>\n"
                 "       enable journal, same as as '-j', but with the specified path.\n"
+                "   --io-engine <sync|uring|splice>\n"
+                "       select the io engine (default: sync).\n"
+                "       send: uring keeps multiple reads in flight per file via io_uring.\n"
+                "             splice is the same as sync.\n"
+                "       recv: uring receives & writes on all targets from one io_uring.\n"
+                "             splice moves payloads from sockets to files in the kernel;\n"
+                "             requires journaling to be off, and doesn't use direct-io.\n"
+                "             chunks are read back from the page cache to verify them.\n"
+                "   --io-depth <count>\n"
+                "       io_uring queue depth (default: 32).\n"
+                "   --hugepages <none|thp|2m|1g>\n"
+                "       back the buffer pool with huge pages (default: none).\n"
+                "       2m & 1g need pages reserved in /proc/sys/vm/nr_hugepages, and\n"
+                "       fall back to transparent huge pages (thp) otherwise.\n"
+                "   --mlock\n"
+                "       lock the buffer pool in memory; subject to RLIMIT_MEMLOCK.\n"
+                "   --numa\n"
+                "       build a separate pipeline per target, with its buffers on the numa node\n"
+                "       of the target's NIC and its threads pinned to that node's cpus.\n"
+                "       --reader-threads applies per pipeline. not supported by uring recv.\n"
                 "   -n | --nodirect\n"
                 "       disable the use of direct-io.\n"
                 "       this enables usage on filesystems that don't support it.\n"
@@ -136,12 +258,35 @@ Options parseOptions(int argc, char **argv, TransferMode mode)
                 "       the target tree is recreated, in full, on the receive side.\n"
                 "   -P | --progress\n"
                 "       enable progress reporting (disables info message output)\n"
+                "   --resume\n"
+                "       (recv only) - resume an interrupted transfer from the receive journal;\n"
+                "       requires journaling. ranges already received, and intact on disk, are\n"
+                "       reported to the sender, which only sends the rest.\n"
+                "   --delta\n"
+                "       (recv only) - only transfer chunks that differ from the existing target\n"
+                "       files. the receiver hashes what's on disk (or reuses the records of the\n"
+                "       journal from an earlier transfer) and the sender skips matching chunks.\n"
                 "   -s | --service <ip>:<port>\n"
                 "       specify the IP & port to bind to for control messages.\n"
                 "   -t | --target <ip>:<port>\n"
                 "       specify a IP & port to bind to for data transfer.\n"
                 "       may specify multiple times to parallelize traffic over multiple routes.\n"
-                , ::basename(argv[0]));
+                "   --streams <count>\n"
+                "       number of data connections per target (default: 1). chunks are striped\n"
+                "       across them; send & recv must use the same count.\n"
+                "   --reader-threads <count>\n"
+                "       (send only) - number of threads reading file segments (default: 1).\n"
+                "   --segment-size <bytes>\n"
+                "       (send only) - split files into segments of this size, read in parallel\n"
+                "       by the reader threads. rounded up to a multiple of the chunk size.\n"
+                "       0 reads each file as a single segment (default: {}).\n"
+                "   --zerocopy\n"
+                "       (send only) - send with MSG_ZEROCOPY, avoiding the copy into socket buffers.\n"
+                "   --compress <level>\n"
+                "       (send only) - compress chunks with blosc2 at level 1 - 9 before sending.\n"
+                "       chunks that look incompressible, or don't shrink, are sent as they are.\n"
+                , ::basename(argv[0])
+                , draft::util::DefaultSegmentSize);
         };
 
     auto opts = Options{ };
@@ -179,6 +324,90 @@ Options parseOptions(int argc, char **argv, TransferMode mode)
             case 't':
                 opts.session.targets.push_back(draft::util::parseTarget(optarg));
                 break;
+            case OptIoEngine:
+                if (optarg == "sync"s)
+                    opts.session.ioEngine = draft::util::IoEngine::Sync;
+                else if (optarg == "uring"s)
+                    opts.session.ioEngine = draft::util::IoEngine::Uring;
+                else if (optarg == "splice"s)
+                    opts.session.ioEngine = draft::util::IoEngine::Splice;
+                else
+                {
+                    spdlog::error("invalid io engine: '{}'", optarg);
+                    std::exit(1);
+                }
+                break;
+            case OptIoDepth:
+                opts.session.ioDepth = static_cast<unsigned>(draft::util::parseSize(optarg));
+                if (!opts.session.ioDepth)
+                {
+                    spdlog::error("io depth must be greater than zero.");
+                    std::exit(1);
+                }
+                break;
+            case OptZeroCopy:
+                opts.session.zeroCopy = true;
+                break;
+            case OptReaderThreads:
+                opts.session.readerCount = static_cast<unsigned>(draft::util::parseSize(optarg));
+                if (!opts.session.readerCount)
+                {
+                    spdlog::error("reader thread count must be greater than zero.");
+                    std::exit(1);
+                }
+                break;
+            case OptSegmentSize:
+                opts.session.segmentSize = draft::util::parseSize(optarg);
+                break;
+            case OptHugePages:
+                if (optarg == "none"s)
+                    opts.session.poolOptions.hugePages = draft::util::HugePages::None;
+                else if (optarg == "thp"s)
+                    opts.session.poolOptions.hugePages = draft::util::HugePages::Transparent;
+                else if (optarg == "2m"s)
+                    opts.session.poolOptions.hugePages = draft::util::HugePages::Huge2M;
+                else if (optarg == "1g"s)
+                    opts.session.poolOptions.hugePages = draft::util::HugePages::Huge1G;
+                else
+                {
+                    spdlog::error("invalid huge page setting: '{}'", optarg);
+                    std::exit(1);
+                }
+                break;
+            case OptMlock:
+                opts.session.poolOptions.lock = true;
+                break;
+            case OptNuma:
+                opts.session.numaPipelines = true;
+                break;
+            case OptResume:
+                opts.resume = true;
+                break;
+            case OptDelta:
+                opts.delta = true;
+                break;
+            case OptCompress:
+                opts.session.compressLevel = static_cast<unsigned>(draft::util::parseSize(optarg));
+                if (!opts.session.compressLevel
+                    || opts.session.compressLevel > draft::util::ChunkCodec::MaxLevel)
+                {
+                    spdlog::error("compression level must be 1 - {}.", draft::util::ChunkCodec::MaxLevel);
+                    std::exit(1);
+                }
+                if (!draft::util::ChunkCodec::supported())
+                {
+                    spdlog::error("draft was built without compression support.");
+                    std::exit(1);
+                }
+                break;
+            case OptStreams:
+                opts.session.streamCount = static_cast<unsigned>(draft::util::parseSize(optarg));
+                if (!opts.session.streamCount)
+                {
+                    spdlog::error("stream count must be greater than zero.");
+                    std::exit(1);
+                }
+                break;
             case '?':
                 usage();
                 std::exit(1);
@@ -205,6 +434,12 @@ Options parseOptions(int argc, char **argv, TransferMode mode)
         std::exit(1);
     }
 
+    if (opts.resume && !opts.doJournal)
+    {
+        spdlog::error("resume requires journaling (-j or -J).");
+        std::exit(1);
+    }
+
     if (opts.doJournal && opts.session.journalPath.empty())
     {
         if (fs::is_directory(opts.session.pathRoot))
@@ -232,6 +467,14 @@ Options parseOptions(int argc, char **argv, TransferMode mode)
 
 void updateFileStats(const std::vector<draft::util::FileInfo> &info)
 {
+    // the per-file stats grow with the manifest, as each batch arrives.
+    auto count = size_t{ };
+
+    for (const auto &item : info)
+        count = std::max(count, size_t{item.id} + 1);
+
+    draft::util::statsMgr().grow(count);
+
     for (const auto &item : info)
     {
         if (S_ISREG(item.status.mode))
@@ -244,31 +487,143 @@ void updateFileStats(const std::vector<draft::util::FileInfo> &info)
     }
 }
 
-std::optional<draft::util::TransferRequest> awaitTransferRequest(draft::util::ScopedFd fd)
+std::optional<draft::util::ManifestBatch> awaitManifestBatch(draft::util::InfoReceiver &rx)
 {
-    auto rx = draft::util::InfoReceiver{std::move(fd)};
+    auto batch = std::optional<draft::util::ManifestBatch>{ };
 
-    while (!done_ && !rx.runOnce())
+    while (!done_ && !(batch = rx.next()))
         ;
 
-    if (done_)
-        return { };
+    if (batch)
+        updateFileStats(batch->info);
 
-    auto info = rx.info();
+    return batch;
+}
 
-    updateFileStats(info.config.fileInfo);
+/**
+ * Read the rest of the manifest into req.
+ */
+bool awaitManifest(draft::util::InfoReceiver &rx, draft::util::TransferRequest &req)
+{
+    auto &info = req.config.fileInfo;
 
-    return info;
+    for (;;)
+    {
+        auto batch = awaitManifestBatch(rx);
+
+        if (!batch)
+            return false;
+
+        info.insert(end(info),
+            std::make_move_iterator(begin(batch->info)),
+            std::make_move_iterator(end(batch->info)));
+
+        if (batch->last)
+            return true;
+    }
+}
+
+/**
+ * Stream the file list to the receiver in batches as the tree is scanned,
+ * handing each batch to the session once it's on its way.
+ */
+void sendManifest(int fd, const std::string &path, draft::util::TxSession &sess)
+{
+    using namespace draft::util;
+
+    auto sendBatch = [fd, &sess](std::vector<FileInfo> info, bool last) {
+        const auto msg = generateManifestMsg(info, last);
+        net::writeAll(fd, msg.data(), msg.size());
+
+        spdlog::debug("sent manifest batch: {} entries, {} bytes", info.size(), msg.size());
+
+        updateFileStats(info);
+        sess.addFiles(std::move(info), last);
+    };
+
+    if (!std::filesystem::is_directory(path))
+    {
+        sendBatch(getFileInfo(path), true);
+        return;
+    }
+
+    auto scanner = FileScanner{path};
+
+    for (auto batch = scanner.next(); !batch.empty(); batch = scanner.next())
+        sendBatch(std::move(batch), false);
+
+    sendBatch({ }, true);
+}
+
+void sendResumeInfo(int fd, const draft::util::ResumeInfo &info)
+{
+    auto msg = draft::util::generateResumeMsg(info);
+    draft::util::net::writeAll(fd, msg.data(), msg.size());
+
+    spdlog::debug("sent resume info: {}", msg.size());
 }
 
-void sendTransferRequest(draft::util::ScopedFd fd, const std::vector<draft::util::FileInfo> &info)
+/**
+ * Wait for the receiver's reply to the manifest: the ranges it already has
+ * if it's resuming, and its chunk digests in delta mode.
+ */
+draft::util::ResumeInfo awaitResumeInfo(const draft::util::ScopedFd &fd)
 {
-    auto request = draft::util::generateTransferRequestMsg(info);
-    draft::util::net::writeAll(fd.get(), request.data(), request.size());
+    auto buf = std::vector<uint8_t>(sizeof(draft::wire::ChunkHeader));
+    auto offset = size_t{ };
+
+    // the header, then the payload it sizes; the connection stays open while
+    // a streaming receiver takes the rest of the manifest.
+    while (offset < buf.size())
+    {
+        const auto len = ::recv(fd.get(), buf.data() + offset, buf.size() - offset, 0);
+
+        if (len < 0 && errno == EINTR && !done_)
+            continue;
+
+        if (len < 0)
+            throw std::system_error(errno, std::system_category(), "recv");
+
+        if (!len)
+            throw std::runtime_error("service connection closed before the receiver replied");
+
+        offset += static_cast<size_t>(len);
+
+        if (offset == sizeof(draft::wire::ChunkHeader))
+        {
+            const auto header = reinterpret_cast<const draft::wire::ChunkHeader *>(buf.data());
+
+            if (header->magic != draft::wire::ChunkHeader::Magic)
+                throw std::runtime_error("invalid resume message magic");
+
+            buf.resize(buf.size() + header->payloadLength);
+        }
+    }
 
-    updateFileStats(info);
+    auto info = draft::util::deserializeResumeMsg(buf);
 
-    spdlog::debug("sent xfer req: {}", request.size());
+    auto skipped = size_t{ };
+
+    for (const auto &[id, ranges] : info.completed)
+    {
+        for (const auto &range : ranges)
+        {
+            skipped += range.len;
+
+            if (auto s = draft::util::stats(id))
+                s->fileByteCount -= range.len;
+        }
+    }
+
+    draft::util::stats().fileByteCount -= skipped;
+
+    if (skipped)
+        spdlog::info("resuming transfer: {} bytes already received.", skipped);
+
+    if (!info.digests.empty())
+        spdlog::info("delta transfer: receiver has digests for {} files.", info.digests.size());
+
+    return info;
 }
 
 void dumpStats(const draft::util::Stats &stats)
@@ -287,6 +642,131 @@ void dumpStats(const draft::util::Stats &stats)
         , stats.netByteCount
         , stats.queuedBlockCount
         , stats.dequeuedBlockCount);
+
+    if (stats.holeByteCount)
+    {
+        spdlog::info(
+            "sparse file stats:\n"
+            "  hole byte count:         {}\n"
+            "   (unallocated ranges that weren't read or sent)\n"
+            , stats.holeByteCount);
+    }
+
+    if (stats.deltaSkipByteCount)
+    {
+        spdlog::info(
+            "delta stats:\n"
+            "  skipped byte count:      {}\n"
+            "   (chunks that matched the receiver's copy)\n"
+            , stats.deltaSkipByteCount);
+    }
+
+    if (stats.compressedByteCount || stats.compressSkipCount)
+    {
+        const auto ratio = stats.compressedByteCount ?
+            static_cast<double>(stats.compressRawByteCount) / static_cast<double>(stats.compressedByteCount) :
+            0.0;
+
+        spdlog::info(
+            "compression stats:\n"
+            "  raw byte count:          {}\n"
+            "  compressed byte count:   {}\n"
+            "  ratio:                   {:.2f}\n"
+            "  skipped chunk count:     {}\n"
+            "   (chunks sent raw - incompressible, or didn't shrink)\n"
+            , stats.compressRawByteCount
+            , stats.compressedByteCount
+            , ratio
+            , stats.compressSkipCount);
+    }
+
+    if (stats.hashByteCount)
+    {
+        const auto busy = static_cast<double>(stats.hashBusyNs);
+        const auto total = busy + static_cast<double>(stats.hashIdleNs);
+
+        spdlog::info(
+            "hashing stats:\n"
+            "  hashed byte count:       {}\n"
+            "  hasher utilization:      {:.1f}%\n"
+            "  queue full count:        {}\n"
+            "   (times readers waited on the hashers)\n"
+            , stats.hashByteCount
+            , total > 0 ? 100.0 * busy / total : 0.0
+            , stats.hashQueueFullCount);
+    }
+
+    if (stats.corruptChunkCount || stats.retransmitByteCount)
+    {
+        spdlog::info(
+            "retransmit stats:\n"
+            "  corrupt chunk count:     {}\n"
+            "   (chunks that failed verification on receipt)\n"
+            "  retransmit byte count:   {}\n"
+            , stats.corruptChunkCount
+            , stats.retransmitByteCount);
+    }
+
+    if (stats.zeroCopySendCount)
+    {
+        spdlog::info(
+            "zero-copy stats:\n"
+            "  send count:              {}\n"
+            "  copied send count:       {}\n"
+            "   (sends the kernel fell back to copying)\n"
+            , stats.zeroCopySendCount
+            , stats.zeroCopyCopiedCount);
+    }
+
+    if (stats.poolHugeTlbByteCount || stats.poolThpByteCount
+        || stats.poolLockedByteCount || stats.poolFallbackCount)
+    {
+        spdlog::info(
+            "buffer pool stats:\n"
+            "  pool byte count:         {}\n"
+            "  hugetlb byte count:      {}\n"
+            "  thp byte count:          {}\n"
+            "  locked byte count:       {}\n"
+            "  fallback count:          {}\n"
+            "   (huge page or mlock requests that weren't honored)\n"
+            , stats.poolByteCount
+            , stats.poolHugeTlbByteCount
+            , stats.poolThpByteCount
+            , stats.poolLockedByteCount
+            , stats.poolFallbackCount);
+    }
+
+    const auto &streams = draft::util::statsMgr().streamStats;
+
+    if (streams.size() > 1)
+    {
+        auto lines = std::string{ };
+
+        for (size_t i = 0; i < streams.size(); ++i)
+        {
+            const auto &stream = streams[i];
+
+            lines += fmt::format(
+                "  stream {:<3} {:>16} bytes {:>10} chunks {:>10.1f} MB/s\n"
+                , i
+                , stream.byteCount.load()
+                , stream.chunkCount.load()
+                , stream.throughput() / 1e6);
+
+            // (tx side only.)
+            if (!stream.cwnd)
+                continue;
+
+            lines += fmt::format(
+                "             rtt {} us, cwnd {}, {} retransmits, passed over for {:.1f} ms\n"
+                , stream.rttUs.load()
+                , stream.cwnd.load()
+                , stream.retransmits.load()
+                , static_cast<double>(stream.passNs) / 1e6);
+        }
+
+        spdlog::info("stream stats:\n{}", lines);
+    }
 }
 
 }
@@ -311,25 +791,93 @@ int recv(int argc, char **argv)
 
     auto sess = draft::util::RxSession(opts.session);
 
-    auto req = awaitTransferRequest(
-        net::bindTcp(service.ip, service.port));
+    auto infoRx = InfoReceiver{net::bindTcp(service.ip, service.port)};
+
+    auto first = awaitManifestBatch(infoRx);
 
-    if (!req)
+    if (!first)
         return 1;
 
-    statsMgr().reallocate(req->config.fileInfo.size());
+    auto req = TransferRequest{ };
+    req.config.fileInfo = std::move(first->info);
 
-    spdlog::info("starting rx session.");
-    sess.start(std::move(*req));
+    // the journal and the replies for resume & delta cover every file, so
+    // those wait for the whole manifest. otherwise, files are created as
+    // the rest of it arrives, while data for the first ones flows.
+    const auto streaming = !first->last
+        && !opts.resume
+        && !opts.delta
+        && opts.session.journalPath.empty();
 
-    auto deadline = Clock::now();
-    while (!done_ && sess.runOnce())
+    auto manifestThread = ManifestThread{ };
+
+    if (streaming)
     {
-        std::this_thread::sleep_until(deadline);
+        auto info = ResumeInfo{ };
+        info.streaming = true;
+
+        sendResumeInfo(infoRx.fd(), info);
+
+        spdlog::info("starting rx session.");
+        sess.start(std::move(req));
+
+        manifestThread = ManifestThread{infoRx.fd(), [&infoRx, &sess] {
+            try
+            {
+                while (auto batch = awaitManifestBatch(infoRx))
+                {
+                    sess.addFiles(std::move(batch->info));
+
+                    if (batch->last)
+                        break;
+                }
+
+                sess.endFiles();
+            }
+            catch (const std::exception &e)
+            {
+                abortTransfer(e);
+            }
+        }};
+    }
+    else
+    {
+        if (!first->last && !awaitManifest(infoRx, req))
+            return 1;
+
+        auto info = ResumeInfo{ };
+
+        if (opts.resume)
+            info.completed = sess.resume(req);
+
+        if (opts.delta)
+            info.digests = sess.delta(req);
 
-        deadline = Clock::now() + 100ms;
+        sendResumeInfo(infoRx.fd(), info);
+
+        spdlog::info("starting rx session.");
+        sess.start(std::move(req));
+        sess.endFiles();
     }
 
+    wakeup_ = &sess.notifier();
+
+    // the session wakes us as its workers make progress; the timeout is
+    // only a backstop.
+    while (!done_ && sess.runOnce())
+        sess.wait(1000);
+
+    wakeup_ = nullptr;
+
+    // files still being created may have data queued for them, so let the
+    // manifest finish - unless we're bailing out.
+    manifestThread.join();
+
+    // chunks that failed verification are sent again over the service
+    // connection; the sender waits for the all clear either way.
+    if (!done_)
+        sess.retransmit(infoRx.fd());
+
     spdlog::info("ending rx session.");
     sess.finish();
 
@@ -346,10 +894,14 @@ void updateDisplay(draft::ui::ProgressDisplay &disp, const std::string &label, d
 
     const auto &stats = statsMgr().get();
 
+    // compressed chunks count for the file bytes they carry.
+    const auto progressBytes = stats.netByteCount
+        + stats.compressRawByteCount - stats.compressedByteCount;
+
     disp.update(label
-        , static_cast<double>(stats.netByteCount) / static_cast<double>(stats.fileByteCount));
+        , static_cast<double>(progressBytes) / static_cast<double>(stats.fileByteCount));
 
-    const auto globalBw = bw.update(stats.netByteCount);
+    const auto globalBw = bw.update(progressBytes);
     disp.updateBandwidth(globalBw);
 
     const auto globalEta = bw.etaSec(stats.fileByteCount);
@@ -371,18 +923,38 @@ int send(int argc, char **argv)
 
     installSigHandler();
 
-    // TODO: figure out if fileinfo / xfer req should be part of session start
-    // this is redundant atm.
-    auto fileInfo = getFileInfo(path);
     auto sess = draft::util::TxSession(opts.session);
 
-    statsMgr().reallocate(fileInfo.size());
-
     auto fd = net::connectTcp(opts.session.service.ip, opts.session.service.port);
-    sendTransferRequest(std::move(fd), fileInfo);
+
+    // the receiver gets the manifest as the tree is scanned.
+    auto manifestThread = ManifestThread{fd.get(), [&fd, &path, &sess] {
+        try
+        {
+            sendManifest(fd.get(), path, sess);
+        }
+        catch (const std::exception &e)
+        {
+            abortTransfer(e);
+
+            // don't leave the receiver, or our wait for its reply, hanging.
+            ::shutdown(fd.get(), SHUT_RDWR);
+        }
+    }};
+
+    // a streaming receiver replies right away; otherwise, once it's seen
+    // the whole manifest.
+    sess.resume(awaitResumeInfo(fd));
+
+    // the journal lists every file up front.
+    if (!opts.session.journalPath.empty())
+        manifestThread.join();
+
+    if (done_)
+        return 1;
 
     spdlog::info("starting tx session.");
-    sess.start(path);
+    sess.start();
 
     auto bwMon = BandwidthMonitor{ };
     auto disp = draft::ui::ProgressDisplay{ };
@@ -392,23 +964,33 @@ int send(int argc, char **argv)
         disp.add("tx progress");
     }
 
-    auto deadline = Clock::now();
+    wakeup_ = &sess.notifier();
+
+    // progress display updates need a regular tick, otherwise the session
+    // wakes us as its workers make progress.
+    const auto tmoMs = opts.showProgress ? 100 : 1000;
+
     while (!done_ && sess.runOnce())
     {
         if (opts.showProgress)
             updateDisplay(disp, GlobalDisplayLabel, bwMon);
 
-        std::this_thread::sleep_until(deadline);
-
-        deadline = Clock::now() + 100ms;
+        sess.wait(tmoMs);
     }
 
+    wakeup_ = nullptr;
+
     if (opts.showProgress)
     {
         updateDisplay(disp, GlobalDisplayLabel, bwMon);
         disp.complete();
     }
 
+    manifestThread.join();
+
+    if (!done_)
+        sess.retransmit(fd.get());
+
     spdlog::info("ending tx session.");
 
     dumpStats(stats());
@@ -25,40 +25,109 @@
  */
 
 #include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <linux/mman.h>
+#include <sys/mman.h>
+
+#include <spdlog/spdlog.h>
 
 #include <draft/util/BufferPool.hh>
+#include <draft/util/Numa.hh>
+#include <draft/util/Stats.hh>
 #include <draft/util/Util.hh>
 
 namespace draft::util {
 
+namespace {
+
+void populatePages(const ScopedMMap &map)
+{
+#ifdef MADV_POPULATE_WRITE
+    if (!::madvise(map.data(), map.size(), MADV_POPULATE_WRITE))
+        return;
+#endif
+
+    auto p = static_cast<volatile uint8_t *>(map.data());
+
+    for (size_t off = 0; off < map.size(); off += 4096)
+        p[off] = 0;
+}
+
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // FreeList
 
-FreeList::FreeList(size_t size)
+FreeList::FreeList(size_t size):
+    next_(std::make_unique<std::atomic<uint32_t>[]>(size)),
+    size_(size)
+{
+    if (size >= Nil)
+        throw std::invalid_argument("FreeList: too many entries");
+
+    for (size_t i = 0; i < size; ++i)
+        next_[i].store(i + 1 < size ? static_cast<uint32_t>(i + 1) : Nil, std::memory_order_relaxed);
+
+    head_.store(pack(0, size ? 0 : Nil), std::memory_order_relaxed);
+}
+
+FreeList::FreeList(FreeList &&o) noexcept
 {
-    list_.resize(size);
-    std::iota(begin(list_), end(list_), 1u);
-    list_.back() = End;
+    *this = std::move(o);
+}
+
+FreeList &FreeList::operator=(FreeList &&o) noexcept
+{
+    next_ = std::move(o.next_);
+    size_ = std::exchange(o.size_, 0);
+    head_.store(o.head_.exchange(pack(0, Nil)));
+
+    return *this;
 }
 
 size_t FreeList::get()
 {
-    auto idx = free_;
+    auto head = head_.load(std::memory_order_acquire);
+
+    for (;;)
+    {
+        const auto idx = static_cast<uint32_t>(head);
 
-    if (free_ == End)
-        return End;
+        if (idx == Nil)
+            return End;
 
-    free_ = list_[free_];
+        const auto tag = static_cast<uint32_t>(head >> 32);
+        const auto next = next_[idx].load(std::memory_order_relaxed);
 
-    return idx;
+        if (head_.compare_exchange_weak(head, pack(tag + 1, next),
+                std::memory_order_acq_rel, std::memory_order_acquire))
+        {
+            return idx;
+        }
+    }
 }
 
 void FreeList::put(size_t idx)
 {
-    if (idx < list_.size())
-        list_[idx] = free_;
+    if (idx >= size_)
+        return;
+
+    auto head = head_.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        const auto tag = static_cast<uint32_t>(head >> 32);
 
-    free_ = idx;
+        next_[idx].store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+
+        if (head_.compare_exchange_weak(head, pack(tag + 1, static_cast<uint32_t>(idx)),
+                std::memory_order_release, std::memory_order_relaxed))
+        {
+            return;
+        }
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -66,8 +135,10 @@ void FreeList::put(size_t idx)
 
 BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&o) noexcept
 {
-    if (pool_)
-        pool_->put(freeIdx_);
+    if (this == &o)
+        return *this;
+
+    reset();
 
     data_ = o.data_;
     o.data_ = nullptr;
@@ -84,7 +155,7 @@ BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&o) noexcept
     return *this;
 }
 
-BufferPool::Buffer::Buffer(const std::shared_ptr<BufferPool> &pool, size_t index, void *data, size_t size):
+BufferPool::Buffer::Buffer(BufferPool *pool, size_t index, void *data, size_t size):
     data_(data),
     size_(size),
     freeIdx_(index),
@@ -92,73 +163,143 @@ BufferPool::Buffer::Buffer(const std::shared_ptr<BufferPool> &pool, size_t index
 {
 }
 
+size_t BufferPool::Buffer::useCount() const noexcept
+{
+    if (!pool_)
+        return 0;
+
+    return pool_->bufferRefs_[freeIdx_].load(std::memory_order_relaxed);
+}
+
+void BufferPool::Buffer::reset() noexcept
+{
+    if (pool_)
+        pool_->release(freeIdx_);
+
+    data_ = nullptr;
+    size_ = 0;
+    freeIdx_ = 0;
+    pool_ = nullptr;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // BufferPool
 
-std::shared_ptr<BufferPool> BufferPool::make(size_t chunkSize, size_t count)
+std::shared_ptr<BufferPool> BufferPool::make(size_t chunkSize, size_t count, const BufferPoolOptions &opts)
 {
-    auto p = std::shared_ptr<BufferPool>(new BufferPool);
-    p->init(chunkSize, count);
-    return p;
+    auto p = std::unique_ptr<BufferPool>(new BufferPool);
+    p->init(chunkSize, count, opts);
+
+    // the pool is deleted once both the shared_ptrs and every outstanding
+    // buffer have let go of it.
+    return std::shared_ptr<BufferPool>(p.release(), [](BufferPool *pool) {
+            pool->unref();
+        });
 }
 
 BufferPool::~BufferPool() noexcept
 {
     done_ = true;
-    cond_.notify_all();
+    available_.wakeAll();
 }
 
 BufferPool::Buffer BufferPool::get()
 {
-    Lock lk(mtx_);
+    return doGet(nullptr);
+}
 
-    size_t idx{ };
+BufferPool::Buffer BufferPool::get(std::chrono::steady_clock::time_point deadline)
+{
+    return doGet(&deadline);
+}
 
-    cond_.wait(lk, [this, &idx] {
+BufferPool::Buffer BufferPool::doGet(const std::chrono::steady_clock::time_point *deadline)
+{
+    for (;;)
+    {
         if (done_)
-            return true;
-        idx = freeList_.get();
-        return idx != FreeList::End;
-    });
+            return { };
+
+        if (auto idx = tryGet(); idx != FreeList::End)
+            return makeBuffer(idx);
 
-    if (done_ || idx == FreeList::End)
-        return { };
+        auto idx = FreeList::End;
+
+        const auto woken = available_.wait(deadline, [this, &idx] {
+                if (done_)
+                    return true;
+
+                idx = tryGet();
+                return idx != FreeList::End;
+            });
+
+        if (idx != FreeList::End)
+            return makeBuffer(idx);
+
+        if (!woken)
+            return { };
+    }
+}
+
+BufferPool::Buffer BufferPool::makeBuffer(size_t index)
+{
+    bufferRefs_[index].store(1, std::memory_order_relaxed);
+    refs_.fetch_add(1, std::memory_order_relaxed);
 
     return {
-        shared_from_this(),
-        idx,
-        mmap_.uint8Data(idx * chunkSize_),
+        this,
+        index,
+        mmap_.uint8Data(index * chunkSize_),
         chunkSize_
     };
 }
 
-BufferPool::Buffer BufferPool::get(std::chrono::steady_clock::time_point deadline)
+size_t BufferPool::tryGet()
 {
-    Lock lk(mtx_, std::defer_lock_t{ });
-    if (!lk.try_lock_until(deadline))
-        return { };
+    const auto pop = [](Magazine &mag) {
+            auto idx = FreeList::End;
 
-    size_t idx{ };
+            if (mag.busy.test_and_set(std::memory_order_acquire))
+                return idx;
 
-    if (!cond_.wait_until(lk, deadline, [this, &idx] {
-        if (done_)
-            return true;
-        idx = freeList_.get();
-        return idx != FreeList::End;
-    }))
+            if (mag.count)
+                idx = mag.slots[--mag.count];
+
+            mag.busy.clear(std::memory_order_release);
+
+            return idx;
+        };
+
+    if (!magazineLimit_)
+        return freeList_.get();
+
+    if (auto idx = pop(magazine()); idx != FreeList::End)
+        return idx;
+
+    if (auto idx = freeList_.get(); idx != FreeList::End)
+        return idx;
+
+    // before giving up, take from other threads' magazines.
+    for (size_t i = 0; i < MagazineCount; ++i)
     {
-        return { };
+        if (auto idx = pop(magazines_[i]); idx != FreeList::End)
+            return idx;
     }
 
-    if (done_ || idx == FreeList::End)
-        return { };
+    return FreeList::End;
+}
 
-    return {
-        shared_from_this(),
-        idx,
-        mmap_.uint8Data(idx * chunkSize_),
-        chunkSize_
-    };
+BufferPool::Magazine &BufferPool::magazine() noexcept
+{
+    static std::atomic<size_t> nextSlot{ };
+    thread_local const size_t slot = nextSlot++;
+
+    return magazines_[slot % MagazineCount];
+}
+
+iovec BufferPool::region() const noexcept
+{
+    return {mmap_.data(), mmap_.size()};
 }
 
 BufferPool::BufferPool(size_t chunkSize, size_t chunkCount):
@@ -168,25 +309,146 @@ BufferPool::BufferPool(size_t chunkSize, size_t chunkCount):
     init();
 }
 
-void BufferPool::init(size_t chunkSize, size_t chunkCount)
+void BufferPool::init(size_t chunkSize, size_t chunkCount, const BufferPoolOptions &opts)
 {
     chunkSize_ = chunkSize;
     chunkCount_ = chunkCount;
+    opts_ = opts;
 
     init();
 }
 
 void BufferPool::init()
 {
+    const auto len = roundBlockSize(chunkSize_ * chunkCount_);
+
+    // pages must be placed before they're faulted in, so hold off on
+    // populating node-bound pools until the policy is set.
+    const auto populate = opts_.numaNode < 0 ? MAP_POPULATE : 0;
+
+    auto populated = populate != 0;
+
+    backing_ = HugePages::None;
+    locked_ = false;
+
+    if (opts_.hugePages == HugePages::Huge2M || opts_.hugePages == HugePages::Huge1G)
+        mapHugeTlb(len, populate);
+
+    if (!mmap_.size() && opts_.hugePages != HugePages::None)
+    {
+        mapTransparent(len);
+        populated = false;
+    }
+
+    if (!mmap_.size())
+    {
+        mmap_ = ScopedMMap::map(
+            nullptr,
+            len,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | populate,
+            -1,
+            0);
+    }
+
+    if (opts_.numaNode >= 0 && !numa::bindMemory(mmap_.data(), mmap_.size(), opts_.numaNode))
+    {
+        spdlog::warn("unable to bind buffer pool to numa node {}: {}."
+            , opts_.numaNode
+            , std::strerror(errno));
+        ++stats().poolFallbackCount;
+    }
+
+    if (!populated)
+        populatePages(mmap_);
+
+    if (opts_.lock)
+    {
+        if (::mlock(mmap_.data(), mmap_.size()))
+        {
+            spdlog::warn("unable to lock {} byte buffer pool: {} (check RLIMIT_MEMLOCK)."
+                , mmap_.size()
+                , std::strerror(errno));
+            ++stats().poolFallbackCount;
+        }
+        else
+        {
+            locked_ = true;
+            stats().poolLockedByteCount += mmap_.size();
+        }
+    }
+
+    stats().poolByteCount += mmap_.size();
+
+    if (backing_ == HugePages::Huge2M || backing_ == HugePages::Huge1G)
+        stats().poolHugeTlbByteCount += mmap_.size();
+    else if (backing_ == HugePages::Transparent)
+        stats().poolThpByteCount += mmap_.size();
+
+    freeList_ = FreeList{chunkCount_};
+    bufferRefs_ = std::make_unique<std::atomic<uint32_t>[]>(chunkCount_);
+
+    // keep most of the pool on the shared list - cached buffers are only
+    // found by other threads once the list runs dry.
+    magazineLimit_ = std::min(MagazineSize, chunkCount_ / (2 * MagazineCount));
+
+    if (magazineLimit_)
+        magazines_ = std::make_unique<Magazine[]>(MagazineCount);
+}
+
+void BufferPool::mapHugeTlb(size_t len, int populate)
+{
+    const auto huge1G = opts_.hugePages == HugePages::Huge1G;
+    const auto pageSize = huge1G ? size_t{1} << 30 : size_t{1} << 21;
+
+    // (the page size flags are unsigned.)
+    const auto hugeFlags = static_cast<int>(huge1G ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+
+    try
+    {
+        mmap_ = ScopedMMap::map(
+            nullptr,
+            (len + pageSize - 1) & ~(pageSize - 1),
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate | hugeFlags,
+            -1,
+            0);
+
+        backing_ = opts_.hugePages;
+    }
+    catch (const std::system_error &e)
+    {
+        spdlog::warn("unable to map {} byte buffer pool with {} huge pages: {} "
+            "- falling back to transparent huge pages."
+            , len
+            , huge1G ? "1GiB" : "2MiB"
+            , e.code().message());
+        ++stats().poolFallbackCount;
+    }
+}
+
+void BufferPool::mapTransparent(size_t len)
+{
+    // no MAP_POPULATE: faulting pages in before the advice would settle
+    // the mapping on base pages.
     mmap_ = ScopedMMap::map(
         nullptr,
-        roundBlockSize(chunkSize_ * chunkCount_),
+        len,
         PROT_READ | PROT_WRITE,
-        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
         -1,
         0);
 
-    freeList_ = FreeList{chunkCount_};
+    if (::madvise(mmap_.data(), len, MADV_HUGEPAGE))
+    {
+        spdlog::warn("unable to use transparent huge pages for buffer pool: {}."
+            , std::strerror(errno));
+        ++stats().poolFallbackCount;
+    }
+    else
+    {
+        backing_ = HugePages::Transparent;
+    }
 }
 
 void BufferPool::put(size_t index)
@@ -194,12 +456,48 @@ void BufferPool::put(size_t index)
     if (done_)
         return;
 
+    auto cached = false;
+
+    if (magazineLimit_)
     {
-        Lock lk(mtx_);
-        freeList_.put(index);
+        auto &mag = magazine();
+
+        if (!mag.busy.test_and_set(std::memory_order_acquire))
+        {
+            if (mag.count < magazineLimit_)
+            {
+                mag.slots[mag.count++] = index;
+                cached = true;
+            }
+
+            mag.busy.clear(std::memory_order_release);
+        }
     }
 
-    cond_.notify_one();
+    if (!cached)
+        freeList_.put(index);
+
+    available_.wake();
+}
+
+void BufferPool::retain(size_t index) noexcept
+{
+    bufferRefs_[index].fetch_add(1, std::memory_order_relaxed);
+}
+
+void BufferPool::release(size_t index) noexcept
+{
+    if (bufferRefs_[index].fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    put(index);
+    unref();
+}
+
+void BufferPool::unref() noexcept
+{
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
 }
 
 }
@@ -0,0 +1,267 @@
+/**
+ * @file ChunkCodec.cc
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+#ifdef DRAFT_HAVE_COMPRESS
+extern "C" {
+#include <blosc2.h>
+}
+#endif
+
+#include <draft/util/ChunkCodec.hh>
+#include <draft/util/Protocol.hh>
+#include <draft/util/Stats.hh>
+
+namespace draft::util {
+
+namespace {
+
+// sample 16 slices of 256 bytes; a 4 KiB sample of random bytes measures
+// around 7.95 bits/byte, so anything above 7.8 isn't worth the cpu.
+constexpr size_t SampleCount = 16;
+constexpr size_t SampleSize = 256;
+constexpr double MaxEntropy = 7.8;
+
+#ifdef DRAFT_HAVE_COMPRESS
+// shuffle at 8 byte granularity; it costs little on plain bytes and helps a
+// lot on arrays of numbers.
+constexpr int32_t TypeSize = 8;
+#endif
+
+}
+
+bool compressible(const uint8_t *data, size_t len)
+{
+    // too small to judge - just try it.
+    if (len < SampleCount * SampleSize)
+        return true;
+
+    auto counts = std::array<uint32_t, 256>{ };
+    const auto stride = (len - SampleSize) / (SampleCount - 1);
+
+    for (size_t i = 0; i < SampleCount; ++i)
+    {
+        const auto *sample = data + i * stride;
+
+        for (size_t j = 0; j < SampleSize; ++j)
+            ++counts[sample[j]];
+    }
+
+    const auto total = static_cast<double>(SampleCount * SampleSize);
+    auto entropy = 0.0;
+
+    for (auto count : counts)
+    {
+        if (!count)
+            continue;
+
+        const auto p = count / total;
+        entropy -= p * std::log2(p);
+    }
+
+    return entropy < MaxEntropy;
+}
+
+#ifdef DRAFT_HAVE_COMPRESS
+
+bool ChunkCodec::supported() noexcept
+{
+    return true;
+}
+
+ChunkCodec &ChunkCodec::local()
+{
+    static auto initFlag = std::once_flag{ };
+    std::call_once(initFlag, [] { blosc2_init(); });
+
+    thread_local auto codec = ChunkCodec{ };
+    return codec;
+}
+
+ChunkCodec::ChunkCodec()
+{
+    auto dparams = BLOSC2_DPARAMS_DEFAULTS;
+    dparams.nthreads = 1;
+
+    if (dctx_ = blosc2_create_dctx(dparams); !dctx_)
+        throw std::runtime_error("ChunkCodec: unable to create blosc2 context.");
+}
+
+ChunkCodec::~ChunkCodec() noexcept
+{
+    if (cctx_)
+        blosc2_free_ctx(cctx_);
+
+    if (dctx_)
+        blosc2_free_ctx(dctx_);
+}
+
+size_t ChunkCodec::compress(uint8_t *data, size_t len, unsigned level)
+{
+    if (!compressible(data, len))
+    {
+        ++stats().compressSkipCount;
+        return 0;
+    }
+
+    if (!cctx_ || level != level_)
+    {
+        if (cctx_)
+            blosc2_free_ctx(std::exchange(cctx_, nullptr));
+
+        auto cparams = BLOSC2_CPARAMS_DEFAULTS;
+        cparams.compcode = BLOSC_LZ4;
+        cparams.clevel = static_cast<uint8_t>(std::min(level, MaxLevel));
+        cparams.typesize = TypeSize;
+        cparams.nthreads = 1;
+
+        if (cctx_ = blosc2_create_cctx(cparams); !cctx_)
+            throw std::runtime_error("ChunkCodec: unable to create blosc2 context.");
+
+        level_ = level;
+    }
+
+    if (scratch_.size() < len)
+        scratch_.resize(len);
+
+    // not worth decompressing unless it saves at least an eighth.
+    const auto limit = len - len / 8;
+    const auto clen = blosc2_compress_ctx(
+        cctx_, data, static_cast<int32_t>(len), scratch_.data(), static_cast<int32_t>(limit));
+
+    if (clen < 0)
+        throw std::runtime_error(fmt::format("blosc2_compress_ctx: {}", clen));
+
+    if (!clen)
+    {
+        ++stats().compressSkipCount;
+        return 0;
+    }
+
+    std::memcpy(data, scratch_.data(), static_cast<size_t>(clen));
+
+    stats().compressRawByteCount += len;
+    stats().compressedByteCount += static_cast<size_t>(clen);
+
+    return static_cast<size_t>(clen);
+}
+
+void ChunkCodec::decompress(uint8_t *data, size_t len, size_t rawLen, size_t capacity)
+{
+    if (rawLen > capacity)
+    {
+        throw std::runtime_error(fmt::format(
+            "ChunkCodec: decompressed chunk size {} exceeds buffer size {}.", rawLen, capacity));
+    }
+
+    if (scratch_.size() < rawLen)
+        scratch_.resize(rawLen);
+
+    const auto dlen = blosc2_decompress_ctx(
+        dctx_, data, static_cast<int32_t>(len), scratch_.data(), static_cast<int32_t>(rawLen));
+
+    if (dlen < 0 || static_cast<size_t>(dlen) != rawLen)
+    {
+        throw std::runtime_error(fmt::format(
+            "blosc2_decompress_ctx: {} (expected {} bytes).", dlen, rawLen));
+    }
+
+    std::memcpy(data, scratch_.data(), rawLen);
+
+    stats().compressRawByteCount += rawLen;
+    stats().compressedByteCount += len;
+}
+
+#else
+
+bool ChunkCodec::supported() noexcept
+{
+    return false;
+}
+
+ChunkCodec &ChunkCodec::local()
+{
+    throw std::runtime_error("ChunkCodec: draft was built without compression support.");
+}
+
+ChunkCodec::ChunkCodec() = default;
+
+ChunkCodec::~ChunkCodec() noexcept = default;
+
+size_t ChunkCodec::compress(uint8_t *, size_t, unsigned)
+{
+    return 0;
+}
+
+void ChunkCodec::decompress(uint8_t *, size_t, size_t, size_t)
+{
+    throw std::runtime_error("ChunkCodec: draft was built without compression support.");
+}
+
+#endif
+
+void compress(BDesc &desc, unsigned level)
+{
+    if (!level)
+        return;
+
+    const auto len = ChunkCodec::local().compress(desc.buf.uint8Data(), desc.len, level);
+
+    if (!len)
+        return;
+
+    desc.codec = wire::ChunkHeader::Blosc2;
+    desc.rawLen = static_cast<uint32_t>(desc.len);
+    desc.len = len;
+}
+
+bool decompress(BDesc &desc)
+{
+    if (desc.codec == wire::ChunkHeader::Raw)
+        return false;
+
+    if (desc.codec != wire::ChunkHeader::Blosc2)
+        throw std::runtime_error(fmt::format("unknown chunk codec {}.", desc.codec));
+
+    ChunkCodec::local().decompress(desc.buf.uint8Data(), desc.len, desc.rawLen, desc.buf.size());
+
+    desc.len = desc.rawLen;
+    desc.codec = wire::ChunkHeader::Raw;
+    desc.rawLen = 0;
+
+    return true;
+}
+
+}
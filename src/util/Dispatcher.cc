@@ -0,0 +1,288 @@
+/**
+ * @file Dispatcher.cc
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <draft/util/Dispatcher.hh>
+#include <draft/util/Stats.hh>
+#include <draft/util/Util.hh>
+
+namespace draft::util {
+
+namespace {
+
+constexpr auto Inf = std::numeric_limits<double>::infinity();
+
+// shortest interval a rate sample is taken over, & the weight it's given.
+constexpr uint64_t RateIntervalNs = 20'000'000;
+constexpr double RateWeight = .25;
+
+// a stream that hasn't sampled its socket for this long is stuck in a
+// send, or gone, and isn't counted on to take chunks.
+constexpr uint64_t StaleNs = 1'000'000'000;
+
+// slack in a link's horizon, for its sender to wake up & take a chunk.
+constexpr double HorizonSlack = .010;
+
+uint64_t nowNs() noexcept
+{
+    using namespace std::chrono;
+
+    return static_cast<uint64_t>(
+        duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+}
+
+}
+
+double Dispatcher::finishTime(const LinkEstimate &link, size_t len) noexcept
+{
+    if (link.rate <= 0)
+        return Inf;
+
+    return static_cast<double>(link.backlog + len) / link.rate + link.rtt;
+}
+
+double Dispatcher::horizon(const LinkEstimate &link) noexcept
+{
+    // a round trip's worth in flight, and another queued behind it.
+    return 2 * link.rtt + HorizonSlack;
+}
+
+bool Dispatcher::shouldTake(
+    const LinkEstimate &link,
+    const std::vector<LinkEstimate> &others,
+    size_t len,
+    size_t remaining) noexcept
+{
+    if (link.rate <= 0)
+        return true;
+
+    if (static_cast<double>(link.backlog) / link.rate > horizon(link))
+        return false;
+
+    if (remaining == Unknown)
+        return true;
+
+    auto soonest = Inf;
+    auto backlog = 0.0;
+    auto rate = 0.0;
+    auto rtt = Inf;
+
+    for (const auto &other : others)
+    {
+        if (other.rate <= 0)
+            continue;
+
+        soonest = std::min(soonest, finishTime(other, len));
+        backlog += static_cast<double>(other.backlog);
+        rate += other.rate;
+        rtt = std::min(rtt, other.rtt);
+    }
+
+    const auto mine = finishTime(link, len);
+
+    if (mine <= soonest)
+        return true;
+
+    // time for the others to deliver everything that's left between them.
+    const auto drain = (backlog + static_cast<double>(remaining)) / rate + rtt;
+
+    return mine <= drain;
+}
+
+unsigned Dispatcher::add(int fd, unsigned streamId)
+{
+    auto slot = std::make_unique<Slot>();
+    slot->fd = fd;
+    slot->streamId = streamId;
+
+    slots_.push_back(std::move(slot));
+
+    return static_cast<unsigned>(slots_.size() - 1);
+}
+
+bool Dispatcher::admit(unsigned slot, size_t count, bool draining)
+{
+    auto &self = *slots_[slot];
+
+    self.changes = changes_;
+    self.retryNs = 0;
+
+    sample(self);
+
+    if (slots_.size() == 1)
+        return true;
+
+    const auto sentCount = sentCount_.load();
+    const auto len = sentCount ? sentBytes_ / sentCount : BufSize;
+
+    // a draining queue holds all that's left for its streams. otherwise
+    // go by the session's progress - with numa pipelines, that's shared
+    // with the other pipelines' streams.
+    auto remaining = Unknown;
+
+    if (draining)
+    {
+        remaining = count * len;
+    }
+    else if (haveAllFiles_)
+    {
+        const auto &st = stats();
+        const auto total = st.fileByteCount.load();
+        const auto sent = st.netByteCount + st.compressRawByteCount - st.compressedByteCount;
+
+        remaining = std::max(count * len, total > sent ? total - sent : 0);
+    }
+
+    const auto now = nowNs();
+
+    auto others = std::vector<LinkEstimate>{ };
+
+    for (unsigned i = 0; i < slots_.size(); ++i)
+    {
+        if (i != slot && now - slots_[i]->sampleNs < StaleNs)
+            others.push_back(estimate(i));
+    }
+
+    const auto mine = estimate(slot);
+
+    if (shouldTake(mine, others, len, remaining))
+    {
+        // the queue's about to change under the waiting streams.
+        ++changes_;
+        waiters_.wakeAll();
+
+        return true;
+    }
+
+    // past its horizon, the stream can take a chunk once enough of its
+    // backlog is delivered. otherwise it's waiting on the other streams.
+    const auto backlogTime = static_cast<double>(mine.backlog) / mine.rate;
+
+    if (backlogTime > horizon(mine))
+        self.retryNs = now + static_cast<uint64_t>((backlogTime - horizon(mine)) * 1e9);
+
+    return false;
+}
+
+void Dispatcher::wait(unsigned slot, Clock::time_point deadline)
+{
+    const auto &self = *slots_[slot];
+
+    if (self.retryNs)
+    {
+        const auto retry = Clock::time_point{std::chrono::nanoseconds{self.retryNs}};
+        deadline = std::min(deadline, retry);
+    }
+
+    waiters_.wait(&deadline, [this, &self] { return changes_ != self.changes; });
+}
+
+void Dispatcher::wakeAll() noexcept
+{
+    ++changes_;
+    waiters_.wakeAll();
+}
+
+void Dispatcher::sent(size_t len) noexcept
+{
+    sentBytes_ += len;
+    ++sentCount_;
+
+    // a stream's backlog grew, and what's left to send shrank.
+    ++changes_;
+    waiters_.wakeAll();
+}
+
+Dispatcher::LinkEstimate Dispatcher::estimate(unsigned slot) const noexcept
+{
+    const auto &s = *slots_[slot];
+
+    return {s.rate, s.backlog, s.rtt};
+}
+
+void Dispatcher::sample(Slot &slot)
+{
+    auto info = tcp_info{ };
+    auto infoLen = socklen_t{sizeof(info)};
+
+    // (not a tcp socket - the stream's rate stays unknown.)
+    if (::getsockopt(slot.fd, IPPROTO_TCP, TCP_INFO, &info, &infoLen))
+        return;
+
+    const auto now = nowNs();
+    const auto backlog = size_t{info.tcpi_notsent_bytes}
+        + size_t{info.tcpi_unacked} * info.tcpi_snd_mss;
+
+    if (!slot.prevNs)
+    {
+        slot.prevNs = now;
+        slot.prevAcked = info.tcpi_bytes_acked;
+        slot.prevBacklog = backlog;
+    }
+    else if (now - slot.prevNs >= RateIntervalNs)
+    {
+        // only an interval the link spent with data to send says anything
+        // about its rate. (acks slow down on a lossy or congested path, so
+        // this also accounts for retransmits.)
+        if (slot.prevBacklog && backlog)
+        {
+            const auto sample = static_cast<double>(info.tcpi_bytes_acked - slot.prevAcked)
+                * 1e9 / static_cast<double>(now - slot.prevNs);
+
+            slot.measuredRate = slot.measuredRate > 0 ?
+                (1 - RateWeight) * slot.measuredRate + RateWeight * sample :
+                sample;
+        }
+
+        slot.prevNs = now;
+        slot.prevAcked = info.tcpi_bytes_acked;
+        slot.prevBacklog = backlog;
+    }
+
+    // until there's a sample of its own, go with the kernel's estimate.
+    slot.rate = slot.measuredRate > 0 ?
+        slot.measuredRate :
+        static_cast<double>(info.tcpi_delivery_rate);
+    slot.backlog = backlog;
+    slot.rtt = info.tcpi_rtt * 1e-6;
+    slot.sampleNs = now;
+
+    if (auto s = streamStats(slot.streamId))
+    {
+        s->rttUs = info.tcpi_rtt;
+        s->cwnd = info.tcpi_snd_cwnd;
+        s->retransmits = info.tcpi_total_retrans;
+    }
+}
+
+}
@@ -0,0 +1,335 @@
+/**
+ * @file FileScanner.cc
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include <draft/util/FileScanner.hh>
+
+namespace draft::util {
+
+namespace {
+
+// the kernel's record layout; glibc only wraps getdents64 from 2.30.
+struct LinuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+constexpr auto DirentBufSize = size_t{1u << 16};
+
+// what FileInfo::Status needs, leaving out timestamps & such, which some
+// distributed filesystems are slow to produce.
+constexpr auto StatxMask =
+    STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_SIZE | STATX_BLOCKS;
+
+bool isDotOrDotDot(const char *name) noexcept
+{
+    return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+}
+
+FileScanner::FileScanner(std::string root, unsigned threadCount):
+    root_{std::make_unique<Dir>(Dir{std::move(root)})}
+{
+    threadCount = std::max(threadCount, 1u);
+
+    for (unsigned i = 0; i < threadCount; ++i)
+        workers_.push_back(std::make_unique<Worker>());
+
+    walk_.push_back({root_.get(), 0});
+
+    push(root_.get(), 0);
+
+    for (unsigned i = 0; i < threadCount; ++i)
+        threads_.emplace_back([this, i] { run(i); });
+}
+
+FileScanner::~FileScanner() noexcept
+{
+    {
+        auto lock = std::lock_guard{idleMutex_};
+        stop_ = true;
+    }
+
+    idleCv_.notify_all();
+
+    for (auto &thread : threads_)
+        thread.join();
+}
+
+std::vector<FileInfo> FileScanner::next(size_t maxCount)
+{
+    namespace fs = std::filesystem;
+
+    auto batch = std::vector<FileInfo>{ };
+
+    while (batch.size() < maxCount && !walk_.empty())
+    {
+        auto &[dir, index] = walk_.back();
+
+        if (!index)
+        {
+            auto lock = std::unique_lock{scannedMutex_};
+            scannedCv_.wait(lock, [this, dir = dir] { return dir->scanned || error_; });
+
+            if (error_)
+                std::rethrow_exception(error_);
+        }
+
+        if (index == dir->entries.size())
+        {
+            // done with this subtree.
+            dir->entries = std::vector<Entry>{ };
+            walk_.pop_back();
+            continue;
+        }
+
+        const auto &entry = dir->entries[index++];
+
+        auto info = FileInfo{ };
+        info.path = (fs::path{dir->path} / entry.name).string();
+        info.status = entry.status;
+
+        if (!S_ISDIR(entry.status.mode))
+        {
+            // ids go on the wire as 16 bits - running out would send
+            // chunks to the wrong files.
+            if (nextId_ == std::numeric_limits<decltype(info.id)>::max())
+            {
+                throw std::runtime_error(fmt::format(
+                    "file scanner: '{}' has more than {} files - too many for one transfer."
+                    , root_->path
+                    , nextId_));
+            }
+
+            info.id = static_cast<uint16_t>(++nextId_);
+        }
+
+        batch.push_back(std::move(info));
+
+        if (entry.dir)
+            walk_.push_back({entry.dir.get(), 0});
+    }
+
+    return batch;
+}
+
+void FileScanner::run(size_t index)
+{
+    try
+    {
+        while (waitForWork())
+        {
+            if (auto dir = pop(index))
+            {
+                scan(*dir, index);
+
+                // the last directory out wakes the idle workers to exit.
+                if (--pending_ == 0)
+                {
+                    auto lock = std::lock_guard{idleMutex_};
+                    idleCv_.notify_all();
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        {
+            auto lock = std::lock_guard{scannedMutex_};
+
+            if (!error_)
+                error_ = std::current_exception();
+        }
+
+        scannedCv_.notify_all();
+
+        {
+            auto lock = std::lock_guard{idleMutex_};
+            stop_ = true;
+        }
+
+        idleCv_.notify_all();
+    }
+}
+
+void FileScanner::scan(Dir &dir, size_t index)
+{
+    const auto fd = ScopedFd{::open(dir.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+
+    // removed since it was listed - leave it empty.
+    if (fd.get() < 0 && errno != ENOENT)
+        throw std::system_error(errno, std::system_category(), "FileScanner: open " + dir.path);
+
+    auto buf = std::vector<uint8_t>(DirentBufSize);
+    auto subdirs = std::vector<Dir *>{ };
+
+    while (fd.get() >= 0)
+    {
+        const auto len = ::syscall(SYS_getdents64, fd.get(), buf.data(), buf.size());
+
+        if (len < 0)
+            throw std::system_error(errno, std::system_category(), "FileScanner: getdents64 " + dir.path);
+
+        if (!len)
+            break;
+
+        for (long offset = 0; offset < len; )
+        {
+            const auto dent = reinterpret_cast<const LinuxDirent64 *>(buf.data() + offset);
+            offset += dent->d_reclen;
+
+            if (isDotOrDotDot(dent->d_name))
+                continue;
+
+            struct statx stx{ };
+
+            if (::statx(fd.get(), dent->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, StatxMask, &stx))
+            {
+                // removed since it was listed.
+                if (errno == ENOENT)
+                    continue;
+
+                throw std::system_error(errno, std::system_category(),
+                    "FileScanner: statx " + dir.path + "/" + dent->d_name);
+            }
+
+            auto &entry = dir.entries.emplace_back();
+            entry.name = dent->d_name;
+            entry.status.mode = stx.stx_mode;
+            entry.status.uid = stx.stx_uid;
+            entry.status.gid = stx.stx_gid;
+            entry.status.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            entry.status.blkSize = stx.stx_blksize;
+            entry.status.blkCount = static_cast<blkcnt_t>(stx.stx_blocks);
+            entry.status.size = stx.stx_size;
+
+            if (S_ISDIR(stx.stx_mode))
+            {
+                entry.dir = std::make_unique<Dir>(Dir{
+                    (std::filesystem::path{dir.path} / entry.name).string()});
+
+                subdirs.push_back(entry.dir.get());
+            }
+        }
+    }
+
+    std::sort(begin(dir.entries), end(dir.entries),
+        [](const auto &a, const auto &b) { return a.name < b.name; });
+
+    // share out the subdirectories once this one's entries are settled.
+    for (auto subdir : subdirs)
+        push(subdir, index);
+
+    {
+        auto lock = std::lock_guard{scannedMutex_};
+        dir.scanned = true;
+    }
+
+    scannedCv_.notify_all();
+}
+
+void FileScanner::push(Dir *dir, size_t index)
+{
+    ++pending_;
+
+    {
+        auto &worker = *workers_[index];
+        auto lock = std::lock_guard{worker.mutex};
+        worker.dirs.push_back(dir);
+    }
+
+    {
+        auto lock = std::lock_guard{idleMutex_};
+        ++queued_;
+    }
+
+    idleCv_.notify_one();
+}
+
+FileScanner::Dir *FileScanner::pop(size_t index)
+{
+    // newest first from our own queue, for locality...
+    {
+        auto &worker = *workers_[index];
+        auto lock = std::lock_guard{worker.mutex};
+
+        if (!worker.dirs.empty())
+        {
+            auto dir = worker.dirs.back();
+            worker.dirs.pop_back();
+            --queued_;
+
+            return dir;
+        }
+    }
+
+    // ...otherwise steal the oldest - likely the biggest subtree - from
+    // someone else.
+    for (size_t i = 1; i < workers_.size(); ++i)
+    {
+        auto &worker = *workers_[(index + i) % workers_.size()];
+        auto lock = std::lock_guard{worker.mutex};
+
+        if (!worker.dirs.empty())
+        {
+            auto dir = worker.dirs.front();
+            worker.dirs.pop_front();
+            --queued_;
+
+            return dir;
+        }
+    }
+
+    return nullptr;
+}
+
+bool FileScanner::waitForWork()
+{
+    auto lock = std::unique_lock{idleMutex_};
+
+    idleCv_.wait(lock, [this] { return stop_ || queued_ || !pending_; });
+
+    return !stop_ && pending_;
+}
+
+}
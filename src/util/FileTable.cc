@@ -0,0 +1,80 @@
+/**
+ * @file FileTable.cc
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <draft/util/FileTable.hh>
+
+namespace draft::util {
+
+void FileTable::add(unsigned id, int fd)
+{
+    {
+        auto lk = std::lock_guard{mutex_};
+        fds_[id] = fd;
+    }
+
+    cv_.notify_all();
+}
+
+void FileTable::close()
+{
+    {
+        auto lk = std::lock_guard{mutex_};
+        closed_ = true;
+    }
+
+    cv_.notify_all();
+}
+
+int FileTable::fd(unsigned id)
+{
+    auto lk = std::unique_lock{mutex_};
+
+    for (;;)
+    {
+        if (auto iter = fds_.find(id); iter != end(fds_))
+            return iter->second;
+
+        if (closed_)
+            return -1;
+
+        cv_.wait(lk);
+    }
+}
+
+std::optional<int> FileTable::tryFd(unsigned id)
+{
+    auto lk = std::lock_guard{mutex_};
+
+    if (auto iter = fds_.find(id); iter != end(fds_))
+        return iter->second;
+
+    if (closed_)
+        return -1;
+
+    return { };
+}
+
+}
@@ -52,9 +52,24 @@ bool Hasher::runOnce(std::stop_token stopToken)
     using namespace std::chrono_literals;
 
     using Clock = std::chrono::steady_clock;
+    using Nanoseconds = std::chrono::nanoseconds;
 
-    while (auto desc = queue_->get(Clock::now() + 1ms))
+    // time spent waiting for work vs. hashing gives the hashers' utilization.
+    auto idleSince = Clock::now();
+
+    const auto countIdle = [&idleSince] {
+            const auto now = Clock::now();
+
+            stats().hashIdleNs += static_cast<uint64_t>(
+                std::chrono::duration_cast<Nanoseconds>(now - idleSince).count());
+
+            idleSince = now;
+        };
+
+    while (auto desc = queue_->get(Clock::now() + 100ms, stopToken))
     {
+        countIdle();
+
         // TODO: maybe this for hashes?
         //if (auto s = stats(desc->fileId))
         //    ++s->dequeuedBlockCount;
@@ -66,6 +81,9 @@ bool Hasher::runOnce(std::stop_token stopToken)
 
         {
             auto timer = util::ScopedTimer{[&desc](double sec) {
+                    stats().hashBusyNs += static_cast<uint64_t>(sec * 1e9);
+                    stats().hashByteCount += desc->len;
+
                     spdlog::trace("{}: xx3 file {} offset {} len {} - {:.06f} sec"
                         , gettid()
                         , desc->fileId
@@ -90,8 +108,12 @@ bool Hasher::runOnce(std::stop_token stopToken)
         }
 
         spdlog::trace("hash: {:#x}", digest);
+
+        idleSince = Clock::now();
     }
 
+    countIdle();
+
     return !stopToken.stop_requested();
 }
 
@@ -100,7 +122,7 @@ uint64_t Hasher::hash(const BDesc &desc)
     if (!desc.buf)
         return 0;
 
-    return XXH3_64bits(desc.buf->data(), desc.len);
+    return XXH3_64bits(desc.buf.data(), desc.len);
 }
 
 }
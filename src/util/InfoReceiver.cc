@@ -24,6 +24,8 @@
  * SOFTWARE.
  */
 
+#include <cerrno>
+
 #include <sys/socket.h>
 
 #include <spdlog/spdlog.h>
@@ -38,57 +40,68 @@ InfoReceiver::InfoReceiver(ScopedFd fd):
 {
 }
 
-bool InfoReceiver::runOnce()
+std::optional<ManifestBatch> InfoReceiver::next()
 {
     if (fd_.get() < 0)
     {
         fd_ = util::net::accept(srvFd_.get());
 
         if (fd_.get() < 0)
-            return false;
+            return { };
 
         spdlog::info("accepted service connection @ fd {}", fd_.get());
     }
 
-    if (buf_.size() - offset_ < 4096)
-        buf_.resize(buf_.size() + 4096);
-
-    auto data = buf_.data() + offset_;
-    auto sz = buf_.size() - offset_;
+    // the header, then exactly the payload it sizes.
+    if (!fill(sizeof(wire::ChunkHeader)))
+        return { };
 
-    auto len = ::recv(fd_.get(), data, sz, 0);
-    spdlog::debug("rx'd {} for info", len);
+    const auto header = *reinterpret_cast<const wire::ChunkHeader *>(buf_.data());
 
-    if (len < 0)
-        throw std::system_error(errno, std::system_category(), "recv");
-
-    offset_ += static_cast<size_t>(len);
+    if (header.magic != wire::ChunkHeader::Magic)
+        throw std::runtime_error("invalid chunk magic");
 
-    if (!len)
+    if (header.payloadLength > MaxMessageSize)
     {
-        buf_.resize(offset_);
-        haveInfo_ = true;
-        return true;
+        throw std::runtime_error(
+            "invalid payload length: " + std::to_string(header.payloadLength));
     }
 
-    return false;
+    if (!fill(sizeof(header) + header.payloadLength))
+        return { };
+
+    offset_ = 0;
+
+    auto batch = deserializeManifestMsg(buf_.data() + sizeof(header), header.payloadLength);
+
+    spdlog::debug("rx'd manifest batch: {} entries, {} bytes", batch.info.size(), header.payloadLength);
+
+    return batch;
 }
 
-TransferRequest InfoReceiver::info() const
+bool InfoReceiver::fill(size_t len)
 {
-    auto header = reinterpret_cast<const wire::ChunkHeader *>(buf_.data());
-
-    if (header->magic != wire::ChunkHeader::Magic)
-        throw std::runtime_error("invalid chunk magic");
+    // the buffer only grows to fit the largest message seen.
+    if (buf_.size() < len)
+        buf_.resize(len);
 
-    if (sizeof(*header) + header->payloadLength > buf_.size())
+    while (offset_ < len)
     {
-        throw std::runtime_error(
-            "invalid payload length: " + std::to_string(header->payloadLength));
+        const auto n = ::recv(fd_.get(), buf_.data() + offset_, len - offset_, 0);
+
+        if (n < 0 && errno == EINTR)
+            return false;
+
+        if (n < 0)
+            throw std::system_error(errno, std::system_category(), "recv");
+
+        if (!n)
+            throw std::runtime_error("service connection closed before the end of the manifest");
+
+        offset_ += static_cast<size_t>(n);
     }
 
-    return deserializeTransferRequest(
-        Buffer{buf_.data() + sizeof(*header), header->payloadLength});
+    return true;
 }
 
 }
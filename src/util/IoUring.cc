@@ -0,0 +1,377 @@
+/**
+ * @file IoUring.cc
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <csignal>
+#include <cstring>
+#include <system_error>
+
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include <draft/util/IoUring.hh>
+
+namespace draft::util {
+
+namespace {
+
+template <typename T>
+T *ringPtr(const ScopedMMap &map, unsigned offset) noexcept
+{
+    return reinterpret_cast<T *>(map.uint8Data(offset));
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// IoUring
+
+IoUring::IoUring(unsigned entries)
+{
+    auto params = io_uring_params{ };
+
+    fd_ = ScopedFd{static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params))};
+
+    if (fd_.get() < 0)
+        throw std::system_error(errno, std::system_category(), "io_uring_setup");
+
+    features_ = params.features;
+    sqEntries_ = params.sq_entries;
+
+    auto sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    auto cqSize = params.cq_off.cqes + params.cq_entries * sizeof(Cqe);
+
+    if (features_ & IORING_FEAT_SINGLE_MMAP)
+        sqSize = cqSize = std::max(sqSize, cqSize);
+
+    sqRing_ = ScopedMMap::map(
+        nullptr, sqSize,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd_.get(), IORING_OFF_SQ_RING);
+
+    if (!(features_ & IORING_FEAT_SINGLE_MMAP))
+    {
+        cqRing_ = ScopedMMap::map(
+            nullptr, cqSize,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd_.get(), IORING_OFF_CQ_RING);
+    }
+
+    const auto &cqMap = cqRing_.data() ? cqRing_ : sqRing_;
+
+    sqeMap_ = ScopedMMap::map(
+        nullptr, params.sq_entries * sizeof(Sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd_.get(), IORING_OFF_SQES);
+
+    sqHead_ = ringPtr<unsigned>(sqRing_, params.sq_off.head);
+    sqTail_ = ringPtr<unsigned>(sqRing_, params.sq_off.tail);
+    sqMask_ = ringPtr<unsigned>(sqRing_, params.sq_off.ring_mask);
+    cqHead_ = ringPtr<unsigned>(cqMap, params.cq_off.head);
+    cqTail_ = ringPtr<unsigned>(cqMap, params.cq_off.tail);
+    cqMask_ = ringPtr<unsigned>(cqMap, params.cq_off.ring_mask);
+    cqes_ = ringPtr<Cqe>(cqMap, params.cq_off.cqes);
+    sqes_ = reinterpret_cast<Sqe *>(sqeMap_.data());
+
+    // sqes are always filled in ring order, so the index array is an identity
+    // mapping that never needs to change.
+    auto array = ringPtr<unsigned>(sqRing_, params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; ++i)
+        array[i] = i;
+
+    sqeTail_ = *sqTail_;
+}
+
+bool IoUring::supported() noexcept
+{
+    try {
+        return IoUring{1}.valid();
+    } catch (const std::exception &e) {
+        spdlog::debug("io_uring unavailable: {}", e.what());
+    }
+
+    return false;
+}
+
+IoUring::Sqe *IoUring::getSqe() noexcept
+{
+    const auto head = std::atomic_ref<unsigned>(*sqHead_).load(std::memory_order_acquire);
+
+    if (sqeTail_ - head >= sqEntries_)
+        return nullptr;
+
+    auto sqe = &sqes_[sqeTail_ & *sqMask_];
+    ++sqeTail_;
+
+    std::memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+unsigned IoUring::sqSpace() const noexcept
+{
+    const auto head = std::atomic_ref<unsigned>(*sqHead_).load(std::memory_order_acquire);
+
+    return sqEntries_ - (sqeTail_ - head);
+}
+
+unsigned IoUring::submit()
+{
+    return submitAndWait(0u);
+}
+
+unsigned IoUring::submitAndWait(unsigned waitCount)
+{
+    const auto count = flush();
+
+    if (!count && !waitCount)
+        return 0;
+
+    const auto flags = waitCount ? IORING_ENTER_GETEVENTS : 0u;
+
+    return static_cast<unsigned>(enter(count, waitCount, flags, nullptr, 0));
+}
+
+bool IoUring::submitAndWait(std::chrono::nanoseconds tmo)
+{
+    using namespace std::chrono;
+
+    // older kernels can't time-out of io_uring_enter, so just block.
+    if (!(features_ & IORING_FEAT_EXT_ARG))
+    {
+        submitAndWait(1u);
+        return true;
+    }
+
+    const auto count = flush();
+
+    const auto sec = duration_cast<seconds>(tmo);
+    auto ts = __kernel_timespec{
+        sec.count(),
+        duration_cast<nanoseconds>(tmo - sec).count()
+    };
+
+    auto arg = io_uring_getevents_arg{ };
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+    return enter(
+        count, 1,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+        &arg, sizeof(arg)) >= 0;
+}
+
+void IoUring::registerBuffers(const iovec *iovs, unsigned count)
+{
+    if (::syscall(__NR_io_uring_register, fd_.get(), IORING_REGISTER_BUFFERS, iovs, count) < 0)
+        throw std::system_error(errno, std::system_category(), "io_uring_register buffers");
+
+    bufferCount_ = count;
+}
+
+void IoUring::registerFiles(const int *fds, unsigned count)
+{
+    if (::syscall(__NR_io_uring_register, fd_.get(), IORING_REGISTER_FILES, fds, count) < 0)
+        throw std::system_error(errno, std::system_category(), "io_uring_register files");
+
+    fileCount_ = count;
+}
+
+void IoUring::updateFile(unsigned index, int fd)
+{
+    auto update = io_uring_files_update{ };
+    update.offset = index;
+    update.fds = reinterpret_cast<uint64_t>(&fd);
+
+    if (::syscall(__NR_io_uring_register, fd_.get(), IORING_REGISTER_FILES_UPDATE, &update, 1) < 0)
+        throw std::system_error(errno, std::system_category(), "io_uring_register files update");
+}
+
+void IoUring::prepRead(Sqe *sqe, int fd, void *buf, size_t len, size_t offset) noexcept
+{
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = static_cast<uint32_t>(len);
+    sqe->off = offset;
+}
+
+void IoUring::prepReadFixed(Sqe *sqe, int fd, void *buf, size_t len, size_t offset, unsigned bufIndex) noexcept
+{
+    prepRead(sqe, fd, buf, len, offset);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = static_cast<uint16_t>(bufIndex);
+}
+
+void IoUring::prepWrite(Sqe *sqe, int fd, const void *buf, size_t len, size_t offset) noexcept
+{
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = static_cast<uint32_t>(len);
+    sqe->off = offset;
+}
+
+void IoUring::prepWriteFixed(Sqe *sqe, int fd, const void *buf, size_t len, size_t offset, unsigned bufIndex) noexcept
+{
+    prepWrite(sqe, fd, buf, len, offset);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->buf_index = static_cast<uint16_t>(bufIndex);
+}
+
+void IoUring::prepRecv(Sqe *sqe, int fd, void *buf, size_t len, unsigned flags) noexcept
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = static_cast<uint32_t>(len);
+    sqe->msg_flags = flags;
+}
+
+void IoUring::prepAccept(Sqe *sqe, int fd) noexcept
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+int IoUring::enter(unsigned submitCount, unsigned waitCount, unsigned flags, const void *arg, size_t argSize)
+{
+    for (;;)
+    {
+        const auto stat = ::syscall(
+            __NR_io_uring_enter, fd_.get(), submitCount, waitCount, flags, arg, argSize);
+
+        if (stat >= 0)
+            return static_cast<int>(stat);
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno == ETIME)
+            return -1;
+
+        throw std::system_error(errno, std::system_category(), "io_uring_enter");
+    }
+}
+
+unsigned IoUring::flush() noexcept
+{
+    auto tail = std::atomic_ref<unsigned>(*sqTail_);
+    const auto count = sqeTail_ - tail.load(std::memory_order_relaxed);
+
+    tail.store(sqeTail_, std::memory_order_release);
+
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// IoUringPool
+
+IoUringPool::IoUringPool(BufferPoolPtr pool, unsigned depth):
+    pool_(std::move(pool)),
+    depth_(depth)
+{
+}
+
+IoUringPool::Lease IoUringPool::acquire()
+{
+    {
+        std::lock_guard lk(mtx_);
+
+        if (!rings_.empty())
+        {
+            auto ring = std::move(rings_.back());
+            rings_.pop_back();
+
+            return {this, std::move(ring)};
+        }
+    }
+
+    return {this, makeRing()};
+}
+
+IoUringPool::RingPtr IoUringPool::makeRing()
+{
+    auto ring = std::make_unique<IoUring>(depth_);
+
+    // registration failures aren't fatal - reads just take the slower,
+    // unregistered path. these commonly fail due to RLIMIT_MEMLOCK on older
+    // kernels, or pools larger than the 1GiB fixed buffer limit.
+    if (pool_ && tryFixedBuffers_)
+    {
+        const auto region = pool_->region();
+
+        try {
+            ring->registerBuffers(&region, 1);
+        } catch (const std::system_error &e) {
+            spdlog::warn("io_uring: unable to register buffer pool ({}) - using unregistered buffers."
+                , e.what());
+
+            tryFixedBuffers_ = false;
+        }
+    }
+
+    if (tryFixedFiles_)
+    {
+        const int fd = -1;
+
+        try {
+            ring->registerFiles(&fd, 1);
+        } catch (const std::system_error &e) {
+            spdlog::warn("io_uring: unable to register file table ({}) - using unregistered files."
+                , e.what());
+
+            tryFixedFiles_ = false;
+        }
+    }
+
+    return ring;
+}
+
+void IoUringPool::release(RingPtr ring) noexcept
+{
+    // drop the fixed file reference so the underlying file can be closed.
+    if (ring->registeredFileCount())
+    {
+        try {
+            ring->updateFile(0, -1);
+        } catch (const std::exception &e) {
+            spdlog::warn("io_uring: unable to clear fixed file: {}", e.what());
+            return;
+        }
+    }
+
+    try {
+        std::lock_guard lk(mtx_);
+        rings_.push_back(std::move(ring));
+    } catch (...) {
+    }
+}
+
+}
@@ -133,18 +133,16 @@ JournalFileDiff diffJournals(const Journal &journalA, const Journal &journalB)
 
 std::optional<JournalFileDiff> verifyJournal(const Journal &journal, VerifySession::Config config)
 {
-    using namespace std::chrono_literals;
-
     auto session = VerifySession{std::move(config)};
 
     session.start(journal);
 
     while (session.runOnce())
-        std::this_thread::sleep_for(50ms);
+        session.wait(1000);
 
     session.finish();
     while (!session.finished())
-        std::this_thread::sleep_for(50ms);
+        session.wait(1000);
 
     auto diff = session.diff();
 
@@ -159,18 +157,16 @@ std::optional<JournalFileDiff> verifyJournal(const Journal &journal, VerifySessi
 
 std::optional<Journal> createJournal(std::vector<FileInfo> info, VerifySession::Config config, const std::string &path)
 {
-    using namespace std::chrono_literals;
-
     auto session = VerifySession{std::move(config)};
 
     session.start(std::move(info));
 
     while (session.runOnce())
-        std::this_thread::sleep_for(50ms);
+        session.wait(1000);
 
     session.finish();
     while (!session.finished())
-        std::this_thread::sleep_for(50ms);
+        session.wait(1000);
 
     auto journal = std::move(session).releaseJournal();
 
@@ -0,0 +1,76 @@
+/**
+ * @file Notifier.cc
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <draft/util/Notifier.hh>
+
+namespace draft::util {
+
+Notifier::Notifier():
+    fd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    if (fd_.get() < 0)
+        throw std::system_error(errno, std::system_category(), "eventfd");
+}
+
+void Notifier::notify() noexcept
+{
+    const auto saved = errno;
+    const auto one = uint64_t{1};
+
+    // only fails if the counter would overflow, in which case the waiter
+    // is already due to wake.
+    [[maybe_unused]] auto stat = ::write(fd_.get(), &one, sizeof(one));
+
+    errno = saved;
+}
+
+bool Notifier::wait(int tmoMs)
+{
+    auto pfd = pollfd{fd_.get(), POLLIN, 0};
+
+    const auto stat = ::poll(&pfd, 1, tmoMs);
+
+    if (stat < 0 && errno != EINTR)
+        throw std::system_error(errno, std::system_category(), "Notifier::wait");
+
+    if (stat <= 0)
+        return false;
+
+    auto count = uint64_t{ };
+    [[maybe_unused]] auto readStat = ::read(fd_.get(), &count, sizeof(count));
+
+    return true;
+}
+
+}
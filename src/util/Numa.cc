@@ -0,0 +1,219 @@
+/**
+ * @file Numa.cc
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstring>
+#include <fstream>
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <linux/mempolicy.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <draft/util/Numa.hh>
+
+namespace draft::util::numa {
+
+namespace {
+
+bool sameAddress(const sockaddr *a, const sockaddr_storage &b)
+{
+    if (!a || a->sa_family != b.ss_family)
+        return false;
+
+    if (a->sa_family == AF_INET)
+    {
+        const auto &a4 = *reinterpret_cast<const sockaddr_in *>(a);
+        const auto &b4 = reinterpret_cast<const sockaddr_in &>(b);
+
+        return a4.sin_addr.s_addr == b4.sin_addr.s_addr;
+    }
+
+    if (a->sa_family == AF_INET6)
+    {
+        const auto &a6 = *reinterpret_cast<const sockaddr_in6 *>(a);
+        const auto &b6 = reinterpret_cast<const sockaddr_in6 &>(b);
+
+        return !std::memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(a6.sin6_addr));
+    }
+
+    return false;
+}
+
+bool isWildcard(const sockaddr_storage &addr)
+{
+    if (addr.ss_family == AF_INET)
+        return reinterpret_cast<const sockaddr_in &>(addr).sin_addr.s_addr == htonl(INADDR_ANY);
+
+    if (addr.ss_family == AF_INET6)
+        return IN6_IS_ADDR_UNSPECIFIED(&reinterpret_cast<const sockaddr_in6 &>(addr).sin6_addr);
+
+    return true;
+}
+
+}
+
+int socketNode(int fd)
+{
+    auto addr = sockaddr_storage{ };
+    auto addrlen = static_cast<socklen_t>(sizeof(addr));
+
+    if (::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &addrlen) || isWildcard(addr))
+        return -1;
+
+    ifaddrs *ifs{ };
+
+    if (::getifaddrs(&ifs))
+        return -1;
+
+    auto node = -1;
+
+    for (auto ifa = ifs; ifa; ifa = ifa->ifa_next)
+    {
+        if (sameAddress(ifa->ifa_addr, addr))
+        {
+            node = interfaceNode(ifa->ifa_name);
+            break;
+        }
+    }
+
+    ::freeifaddrs(ifs);
+
+    return node;
+}
+
+int interfaceNode(const std::string &ifname)
+{
+    auto in = std::ifstream("/sys/class/net/" + ifname + "/device/numa_node");
+    auto node = -1;
+
+    if (!(in >> node))
+        return -1;
+
+    return node;
+}
+
+std::vector<unsigned> nodeCpus(int node)
+{
+    if (node < 0)
+        return { };
+
+    auto in = std::ifstream("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    auto str = std::string{ };
+
+    if (!std::getline(in, str))
+        return { };
+
+    return parseCpuList(str);
+}
+
+std::vector<unsigned> parseCpuList(const std::string &str)
+{
+    auto cpus = std::vector<unsigned>{ };
+    auto pos = size_t{0};
+
+    while (pos < str.size())
+    {
+        auto end = str.find(',', pos);
+
+        if (end == std::string::npos)
+            end = str.size();
+
+        const auto range = str.substr(pos, end - pos);
+        const auto dash = range.find('-');
+
+        try
+        {
+            const auto first = static_cast<unsigned>(std::stoul(range.substr(0, dash)));
+            const auto last = dash == std::string::npos
+                ? first
+                : static_cast<unsigned>(std::stoul(range.substr(dash + 1)));
+
+            for (auto cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        }
+        catch (const std::logic_error &)
+        {
+            // skip empty or malformed entries (e.g. trailing newlines).
+        }
+
+        pos = end + 1;
+    }
+
+    return cpus;
+}
+
+bool pinThread(const std::vector<unsigned> &cpus, pthread_t thread)
+{
+    if (cpus.empty())
+        return true;
+
+    auto set = cpu_set_t{ };
+    CPU_ZERO(&set);
+
+    for (auto cpu : cpus)
+    {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+
+    if (auto err = ::pthread_setaffinity_np(thread, sizeof(set), &set))
+    {
+        errno = err;
+        return false;
+    }
+
+    return true;
+}
+
+bool bindMemory(void *addr, size_t len, int node)
+{
+    constexpr auto MaskBits = sizeof(unsigned long) * 8;
+
+    if (node < 0 || static_cast<size_t>(node) >= MaskBits * 16)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    unsigned long mask[16]{ };
+    mask[static_cast<size_t>(node) / MaskBits] = 1ul << (static_cast<size_t>(node) % MaskBits);
+
+    return !::syscall(
+        SYS_mbind,
+        addr,
+        len,
+        MPOL_PREFERRED,
+        mask,
+        MaskBits * 16,
+        MPOL_MF_MOVE);
+}
+
+}
@@ -0,0 +1,180 @@
+/**
+ * @file PackedReader.cc
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <chrono>
+
+#include <fcntl.h>
+
+#include <spdlog/spdlog.h>
+
+#include <draft/util/ChunkCodec.hh>
+#include <draft/util/PackedReader.hh>
+#include <draft/util/Stats.hh>
+
+#include "xxhash.h"
+
+namespace draft::util {
+
+PackedReader::PackedReader(std::vector<Item> items, const BufferPoolPtr &pool, BufQueue *queue):
+    items_{std::move(items)},
+    pool_{pool},
+    queue_{queue}
+{
+}
+
+int PackedReader::operator()(std::stop_token stopToken)
+{
+    using namespace std::chrono_literals;
+    using Clock = std::chrono::steady_clock;
+
+    auto buf = BufferPtr{ };
+
+    while (!buf && !stopToken.stop_requested())
+        buf = pool_->get(Clock::now() + 100ms);
+
+    if (!buf)
+        return 0;
+
+    const auto payload = buf.uint8Data();
+    const auto table = reinterpret_cast<wire::PackedTable *>(payload);
+    const auto entries = reinterpret_cast<wire::PackedEntry *>(table + 1);
+
+    auto digests = hashing_ ?
+        std::make_shared<std::vector<PackedDigest>>() :
+        nullptr;
+
+    auto count = uint32_t{ };
+    auto payloadOffset = packedPayloadSize(items_.size(), 0);
+    auto payloadLen = payloadOffset;
+
+    for (const auto &item : items_)
+    {
+        if (stopToken.stop_requested())
+            return 0;
+
+        const auto len = read(item, payload + payloadOffset);
+
+        stats().diskByteCount += len;
+
+        if (auto s = stats(item.fileId))
+            s->diskByteCount += len;
+
+        const auto digest = hashing_ || digests_ ?
+            XXH3_64bits(payload + payloadOffset, len) :
+            uint64_t{ };
+
+        if (matchesReceiver(item.fileId, digest))
+        {
+            stats().deltaSkipByteCount += len;
+            stats().fileByteCount -= len;
+
+            if (auto s = stats(item.fileId))
+            {
+                s->deltaSkipByteCount += len;
+                s->fileByteCount -= len;
+            }
+
+            continue;
+        }
+
+        entries[count++] = {
+            static_cast<uint32_t>(payloadOffset),
+            static_cast<uint32_t>(len),
+            static_cast<uint16_t>(item.fileId),
+            { },
+            digest};
+
+        if (digests)
+            digests->push_back({item.fileId, len, digest});
+
+        payloadLen = payloadOffset + len;
+        payloadOffset += roundBlockSize(len);
+    }
+
+    if (!count)
+        return 0;
+
+    *table = {count};
+
+    auto desc = BDesc{buf, PackedFileId, 0, payloadLen, wire::ChunkHeader::Packed};
+    desc.packedDigests = std::move(digests);
+
+    // the files are covered by their entries' digests, and those by the
+    // table's.
+    if (hashing_)
+    {
+        desc.digest = packedTableDigest(payload, payloadLen);
+        desc.hashed = true;
+    }
+
+    compress(desc, compressLevel_);
+
+    while (!stopToken.stop_requested() &&
+        !queue_->put(desc, 100ms))
+    {
+    }
+
+    ++stats().queuedBlockCount;
+
+    return 0;
+}
+
+size_t PackedReader::read(const Item &item, uint8_t *data)
+{
+    auto flags = O_RDONLY | O_CLOEXEC;
+
+    if (directIO_)
+        flags |= O_DIRECT;
+
+    const auto fd = ScopedFd{::open(item.path.c_str(), flags)};
+
+    if (fd.get() < 0)
+        throw std::system_error(errno, std::system_category(), "open " + item.path);
+
+    spdlog::trace("packed reader file {}: {} bytes", item.fileId, item.size);
+
+    // the file may have grown since it was listed; it's sent at that size.
+    const auto len = readChunk(fd.get(), data, roundBlockSize(item.size), 0);
+
+    return std::min(len, item.size);
+}
+
+bool PackedReader::matchesReceiver(unsigned fileId, uint64_t digest) const
+{
+    if (!digests_)
+        return false;
+
+    const auto file = digests_->find(fileId);
+
+    if (file == end(*digests_))
+        return false;
+
+    const auto chunk = file->second.find(0);
+
+    return chunk != end(file->second) && digest == chunk->second;
+}
+
+}
@@ -24,13 +24,20 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
 #include <chrono>
+#include <new>
+#include <tuple>
 
 #include <spdlog/spdlog.h>
 
+#include <draft/util/ChunkCodec.hh>
+#include <draft/util/IoUring.hh>
 #include <draft/util/Reader.hh>
 #include <draft/util/Stats.hh>
 
+#include "xxhash.h"
+
 namespace draft::util {
 
 Reader::Reader(const std::shared_ptr<ScopedFd> &fd, unsigned fileId, Segment segment, const BufferPoolPtr &pool, BufQueue *queue):
@@ -43,68 +50,302 @@ Reader::Reader(const std::shared_ptr<ScopedFd> &fd, unsigned fileId, Segment seg
 }
 
 int Reader::operator()(std::stop_token stopToken)
+{
+    if (rings_)
+        return readUring(stopToken);
+
+    return readSync(stopToken);
+}
+
+int Reader::readSync(std::stop_token stopToken)
 {
     using namespace std::chrono_literals;
     using Clock = std::chrono::steady_clock;
 
     while (!stopToken.stop_requested())
     {
-        auto buf = std::make_shared<Buffer>(pool_->get(Clock::now() + 100ms));
+        auto buf = pool_->get(Clock::now() + 100ms);
 
-        if (!buf || !buf->valid())
+        if (!buf)
         {
             spdlog::trace("Reader: timed-out waiting for buffer.");
             continue;
         }
 
-        auto len = read(*buf);
+        auto len = size_t{ };
+        auto digest = std::optional<uint64_t>{ };
+
+        if (hashing_)
+            std::tie(len, digest) = readHashed(buf);
+        else
+            len = read(buf);
 
         if (!len)
             return 0;
 
-        stats().diskByteCount += len;
+        enqueue(buf, segment_.offset, len, digest, stopToken);
 
-        if (auto s = stats(fileId_))
-            s->diskByteCount += len;
-
-        // keep trying to push this buffer onto the queue.
-        //
-        // if the queue is pushing back, we don't want to stack-up more
-        // work.
-        while (queue_ &&
-            !stopToken.stop_requested() &&
-            !queue_->put({buf, fileId_, segment_.offset, len}, 100ms))
+        segment_.offset += len;
+        segment_.len -= std::min(len, segment_.len);
+    }
+
+    return 0;
+}
+
+int Reader::readUring(std::stop_token stopToken)
+{
+    using namespace std::chrono_literals;
+    using Clock = std::chrono::steady_clock;
+
+    struct Pending
+    {
+        BufferPtr buf{ };
+        size_t offset{ };
+        size_t len{ };
+    };
+
+    auto ring = rings_->acquire();
+
+    const auto fixedFile = ring->registeredFileCount() > 0;
+    const auto fixedBuffer = ring->registeredBufferCount() > 0;
+    const auto fd = fixedFile ? 0 : fd_->get();
+
+    if (fixedFile)
+        ring->updateFile(0, fd_->get());
+
+    auto pending = std::vector<Pending>(rings_->depth());
+    auto inFlight = size_t{ };
+    auto error = std::exception_ptr{ };
+
+    auto next = segment_.offset;
+    const auto segmentEnd = segment_.offset + segment_.len;
+
+    const auto submitMore = [&] {
+            return !error && next < segmentEnd && !stopToken.stop_requested();
+        };
+
+    // keep going until we've drained everything we've submitted, even if
+    // we're stopping - the kernel owns those buffers until they complete.
+    while (inFlight || submitMore())
+    {
+        while (inFlight < pending.size() && submitMore())
         {
+            // only block on the pool if there's nothing else to wait for.
+            auto buf = pool_->get(Clock::now() + (inFlight ? 0ms : 100ms));
+
+            if (!buf)
+                break;
+
+            auto slot = std::find_if(begin(pending), end(pending),
+                [](const auto &p) { return !p.buf; });
+
+            auto sqe = ring->getSqe();
+
+            const auto len = std::min(roundBlockSize(segmentEnd - next), buf.size());
+
+            if (fixedBuffer)
+                IoUring::prepReadFixed(sqe, fd, buf.data(), len, next, 0);
+            else
+                IoUring::prepRead(sqe, fd, buf.data(), len, next);
+
+            if (fixedFile)
+                sqe->flags |= IOSQE_FIXED_FILE;
+
+            sqe->user_data = static_cast<uint64_t>(slot - begin(pending));
+
+            *slot = {std::move(buf), next, len};
+
+            next += len;
+            ++inFlight;
         }
 
-        if (hashQueue_ && !hashQueue_->put({buf, fileId_, segment_.offset, len}, 1ms))
+        if (!inFlight)
         {
-            spdlog::warn("reader: unable to enqueue file {} offset {} len {} for hashing (queue full)."
-                , fileId_, segment_.offset, len);
+            spdlog::trace("Reader: timed-out waiting for buffer.");
+            continue;
         }
 
-        ++stats().queuedBlockCount;
+        ring->submitAndWait(1u);
 
-        if (auto s = stats(fileId_))
-            ++s->queuedBlockCount;
+        ring->forEachCompletion([&](const IoUring::Cqe &cqe) {
+                auto p = std::exchange(pending[cqe.user_data], { });
+                --inFlight;
 
-        segment_.offset += len;
+                if (error)
+                    return;
+
+                if (cqe.res < 0)
+                {
+                    error = std::make_exception_ptr(std::system_error(
+                        -cqe.res, std::system_category(), "io_uring read"));
+
+                    return;
+                }
+
+                // anything thrown from here is held until the reads still in
+                // flight have drained, like a failed read.
+                try
+                {
+                    auto len = static_cast<size_t>(cqe.res);
+
+                    // a short read that isn't at eof is finished synchronously.
+                    if (len && len < p.len)
+                    {
+                        len += readChunk(
+                            fd_->get(),
+                            p.buf.uint8Data() + len,
+                            p.len - len,
+                            p.offset + len);
+                    }
+
+                    if (len)
+                        enqueue(p.buf, p.offset, len, std::nullopt, stopToken);
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+            });
     }
 
+    if (error)
+        std::rethrow_exception(error);
+
     return 0;
 }
 
+void Reader::enqueue(const BufferPtr &buf, size_t offset, size_t len, std::optional<uint64_t> digest, std::stop_token stopToken)
+{
+    using namespace std::chrono_literals;
+
+    stats().diskByteCount += len;
+
+    if (auto s = stats(fileId_))
+        s->diskByteCount += len;
+
+    auto desc = BDesc{buf, fileId_, offset, len};
+
+    if (hashing_)
+    {
+        desc.digest = digest ? *digest : XXH3_64bits(buf.data(), len);
+        desc.hashed = true;
+    }
+
+    const auto skip = matchesReceiver(desc);
+
+    if (skip)
+    {
+        stats().deltaSkipByteCount += len;
+        stats().fileByteCount -= len;
+
+        if (auto s = stats(fileId_))
+        {
+            s->deltaSkipByteCount += len;
+            s->fileByteCount -= len;
+        }
+    }
+    else
+    {
+        compress(desc, compressLevel_);
+    }
+
+    // keep trying to push this buffer onto the queue.
+    //
+    // if the queue is pushing back, we don't want to stack-up more
+    // work.
+    while (queue_ && !skip &&
+        !stopToken.stop_requested() &&
+        !queue_->put(desc, 100ms))
+    {
+    }
+
+    // every chunk must be hashed - if the hashers are behind, wait for
+    // them.
+    if (hashQueue_)
+    {
+        const auto hashDesc = BDesc{buf, fileId_, offset, len};
+
+        if (!hashQueue_->put(hashDesc, 0ms))
+        {
+            ++stats().hashQueueFullCount;
+
+            while (!stopToken.stop_requested() && !hashQueue_->put(hashDesc, 100ms))
+            {
+            }
+        }
+    }
+
+    if (skip)
+        return;
+
+    ++stats().queuedBlockCount;
+
+    if (auto s = stats(fileId_))
+        ++s->queuedBlockCount;
+}
+
+bool Reader::matchesReceiver(const BDesc &desc) const
+{
+    if (!digests_)
+        return false;
+
+    const auto file = digests_->find(fileId_);
+
+    if (file == end(*digests_))
+        return false;
+
+    const auto chunk = file->second.find(desc.offset);
+
+    if (chunk == end(file->second))
+        return false;
+
+    const auto digest = desc.hashed ? desc.digest : XXH3_64bits(desc.buf.data(), desc.len);
+
+    return digest == chunk->second;
+}
+
 size_t Reader::read(Buffer &buf)
 {
-    spdlog::debug("reader segment progress: {}/{} ({:.1f})"
+    spdlog::debug("reader file {} segment offset {}, {} remaining"
+        , fileId_
         , segment_.offset
-        , segment_.len
-        , static_cast<double>(segment_.offset) / segment_.len * 100);
+        , segment_.len);
 
-    auto len = roundBlockSize(segment_.len - segment_.offset);
+    auto len = roundBlockSize(segment_.len);
     len = std::min(len, buf.size());
 
     return readChunk(fd_->get(), buf.data(), len, segment_.offset);
 }
 
+std::pair<size_t, uint64_t> Reader::readHashed(Buffer &buf)
+{
+    using StatePtr = std::unique_ptr<XXH3_state_t, decltype(&XXH3_freeState)>;
+
+    auto state = StatePtr{XXH3_createState(), &XXH3_freeState};
+
+    if (!state)
+        throw std::bad_alloc{ };
+
+    XXH3_64bits_reset(state.get());
+
+    const auto len = std::min(roundBlockSize(segment_.len), buf.size());
+    auto total = size_t{ };
+
+    while (total < len)
+    {
+        const auto sliceLen = std::min(HashSliceSize, len - total);
+        const auto sliceData = buf.uint8Data() + total;
+
+        const auto got = readChunk(fd_->get(), sliceData, sliceLen, segment_.offset + total);
+
+        XXH3_64bits_update(state.get(), sliceData, got);
+        total += got;
+
+        if (got < sliceLen)
+            break;
+    }
+
+    return {total, XXH3_64bits_digest(state.get())};
+}
+
 }
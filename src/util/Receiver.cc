@@ -24,10 +24,14 @@
  * SOFTWARE.
  */
 
+#include <fcntl.h>
 #include <poll.h>
 
+#include <new>
+
 #include <spdlog/spdlog.h>
 
+#include <draft/util/ChunkCodec.hh>
 #include <draft/util/Receiver.hh>
 #include <draft/util/Stats.hh>
 
@@ -35,12 +39,45 @@
 
 namespace draft::util {
 
+namespace {
+
+// block size for reading spliced chunks back to verify them.
+constexpr size_t ReadBackSize = 256 * 1024;
+
+}
+
 Receiver::Receiver(ScopedFd fd, BufQueue &queue, BufQueue *hashQueue):
     queue_(&queue),
     hashQueue_(hashQueue),
     svcFd_(std::move(fd))
 {
-    pool_ = BufferPool::make(BufSize, 35);
+}
+
+void Receiver::useSplice(std::shared_ptr<FileTable> files)
+{
+    int fds[2] = { };
+
+    if (::pipe2(fds, O_CLOEXEC))
+        throw std::system_error(errno, std::system_category(), "pipe2");
+
+    pipeRead_ = ScopedFd{fds[0]};
+    pipeWrite_ = ScopedFd{fds[1]};
+
+    // a pipe the size of a chunk lets most payloads move in one splice.
+    if (::fcntl(pipeWrite_.get(), F_SETPIPE_SZ, static_cast<int>(BufSize)) < 0)
+    {
+        spdlog::debug("receiver: unable to resize splice pipe: {}"
+            , std::strerror(errno));
+    }
+
+    // payloads for unmapped files are discarded here.
+    nullFd_ = ScopedFd{::open("/dev/null", O_WRONLY | O_CLOEXEC)};
+
+    if (nullFd_.get() < 0)
+        throw std::system_error(errno, std::system_category(), "open /dev/null");
+
+    files_ = std::move(files);
+    splice_ = true;
 }
 
 bool Receiver::runOnce(std::stop_token stopToken)
@@ -71,6 +108,11 @@ int Receiver::waitConnect()
 
     fd_ = util::net::accept(svcFd_.get());
 
+    // a receiver sharing the listening socket (another stream of the same
+    // target) took the connection.
+    if (fd_.get() < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+
     if (fd_.get() < 0)
     {
         spdlog::error("accept on fd {}: {}", svcFd_.get(), std::strerror(errno));
@@ -91,10 +133,51 @@ bool Receiver::waitData(std::stop_token stopToken)
         if (auto stat = readHeader(); stat <= 0)
             return stat == EOF ? false : true;
 
-        buf_ = pool_->get();
+        // packed & compressed chunks are always received into a buffer.
+        if (!spliced())
+        {
+            if (!pool_)
+                pool_ = BufferPool::make(BufSize, 35, poolOptions_);
+
+            buf_ = pool_->get();
+        }
 
         haveHeader_ = true;
         offset_ = 0;
+
+        // spliced chunks are hashed once they're on disk.
+        if (!spliced())
+            startHash();
+    }
+
+    if (spliced())
+    {
+        const auto spliceStat = spliceRead();
+
+        if (spliceStat < 0)
+            return false;
+
+        if (spliceStat > 0)
+        {
+            verifySpliced();
+
+            if (auto s = streamStats(streamId_))
+                s->addChunk(header_.payloadLength);
+
+            ++stats().queuedBlockCount;
+            ++stats().dequeuedBlockCount;
+
+            if (auto s = stats(header_.fileId))
+            {
+                ++s->queuedBlockCount;
+                ++s->dequeuedBlockCount;
+            }
+
+            haveHeader_ = false;
+            offset_ = 0;
+        }
+
+        return true;
     }
 
     const auto readStat = read();
@@ -108,35 +191,68 @@ bool Receiver::waitData(std::stop_token stopToken)
             , header_.payloadLength
             , header_.fileId);
 
-        auto buf = std::make_shared<Buffer>(std::move(buf_));
+        if (auto s = streamStats(streamId_))
+            s->addChunk(header_.payloadLength);
+
+        auto desc = BDesc{
+            std::move(buf_),
+            fileId(),
+            header_.fileOffset,
+            header_.payloadLength,
+            header_.flags,
+            header_.codec,
+            header_.rawLength
+        };
+
+        if (hashing_)
+        {
+            desc.digest = XXH3_64bits_digest(hashState_.get());
+            desc.hashed = true;
+            hashing_ = false;
+        }
+
+        // a corrupt chunk is dropped, to be sent again; so are a packed
+        // chunk's corrupt files, though the chunk is written whole.
+        const auto corrupt = verify(desc);
+
+        if (!corrupt.empty() && !packed())
+        {
+            haveHeader_ = false;
+            offset_ = 0;
+
+            return true;
+        }
+
+        logHash(desc, corrupt);
 
-        if (hashLog_)
+        // there are no writers behind splice receivers.
+        if (splice_)
         {
-            const auto digest = XXH3_64bits(buf->data(), header_.payloadLength);
+            writeBuffered(desc);
+            haveHeader_ = false;
+            offset_ = 0;
 
-            hashLog_->writeHash(
-                header_.fileId, header_.fileOffset, header_.payloadLength, digest);
+            return true;
         }
 
-        while (!stopToken.stop_requested() &&
-            !queue_->put({
-                buf,
-                header_.fileId,
-                header_.fileOffset,
-                header_.payloadLength
-            }, 100ms))
+        while (!stopToken.stop_requested() && !queue_->put(desc, 100ms))
         {
         }
 
         ++stats().queuedBlockCount;
 
-        if (auto s = stats(header_.fileId))
+        if (auto s = stats(desc.fileId))
             ++s->queuedBlockCount;
 
-        if (hashQueue_ && !hashQueue_->put({buf, header_.fileId, header_.fileOffset, header_.payloadLength}, 1ms))
+        // every chunk must be hashed - if the hashers are behind, wait for
+        // them.
+        if (hashQueue_ && !hashQueue_->put(desc, 0ms))
         {
-            spdlog::warn("receiver: unable to enqueue file {} offset {} len {} for hashing (queue full)."
-                , header_.fileId, header_.fileOffset, header_.payloadLength);
+            ++stats().hashQueueFullCount;
+
+            while (!stopToken.stop_requested() && !hashQueue_->put(desc, 100ms))
+            {
+            }
         }
 
         haveHeader_ = false;
@@ -202,9 +318,13 @@ int Receiver::read()
 
     stats().netByteCount += static_cast<size_t>(len);
 
-    if (auto s = stats(header_.fileId))
+    if (auto s = stats(fileId()))
         s->netByteCount += static_cast<size_t>(len);
 
+    // hash what just arrived while it's still in cache.
+    if (hashing_)
+        XXH3_64bits_update(hashState_.get(), buf_.uint8Data() + offset_, static_cast<size_t>(len));
+
     offset_ += static_cast<size_t>(len);
 
     if (offset_ >= header_.payloadLength)
@@ -213,4 +333,266 @@ int Receiver::read()
     return 0;
 }
 
+void Receiver::HashStateDeleter::operator()(XXH3_state_s *state) const noexcept
+{
+    XXH3_freeState(state);
+}
+
+void Receiver::startHash()
+{
+    // plain chunks are hashed as they arrive; packed files are hashed one
+    // by one, and compressed chunks once they're decompressed.
+    hashing_ = (hashLog_ || digested()) && !packed() && !compressed();
+
+    if (!hashing_)
+        return;
+
+    if (!hashState_)
+    {
+        hashState_.reset(XXH3_createState());
+
+        if (!hashState_)
+            throw std::bad_alloc{ };
+    }
+
+    XXH3_64bits_reset(hashState_.get());
+}
+
+std::vector<ChunkRange> Receiver::verify(BDesc &desc)
+{
+    auto corrupt = std::vector<ChunkRange>{ };
+
+    try
+    {
+        decompress(desc);
+        corrupt = verifyChunk(desc, header_.digest);
+    }
+    catch (const std::runtime_error &e)
+    {
+        // a plain chunk that won't decompress is sent again like any other.
+        if (!digested() || packed())
+            throw;
+
+        spdlog::warn("receiver: {}", e.what());
+
+        corrupt = {{header_.fileId, header_.fileOffset, header_.rawLength}};
+    }
+
+    if (!corrupt.empty())
+        requestAgain(corrupt);
+
+    return corrupt;
+}
+
+void Receiver::verifySpliced()
+{
+    const auto fd = files_->fd(header_.fileId);
+
+    if (!digested() || fd < 0)
+        return;
+
+    // spliced payloads never pass through user space, so read the chunk
+    // back - from the page cache, since splice receives aren't direct.
+    if (readBack_.empty())
+        readBack_.resize(ReadBackSize);
+
+    startHash();
+
+    for (size_t offset = 0; offset < header_.payloadLength; )
+    {
+        const auto want = std::min(readBack_.size(), header_.payloadLength - offset);
+        const auto len = readChunk(fd, readBack_.data(), want, header_.fileOffset + offset);
+
+        if (!len)
+            break;
+
+        XXH3_64bits_update(hashState_.get(), readBack_.data(), len);
+        offset += len;
+    }
+
+    hashing_ = false;
+
+    if (XXH3_64bits_digest(hashState_.get()) != header_.digest)
+        requestAgain({{header_.fileId, header_.fileOffset, header_.payloadLength}});
+}
+
+void Receiver::requestAgain(const std::vector<ChunkRange> &corrupt)
+{
+    if (!retransmits_)
+    {
+        throw std::runtime_error(fmt::format(
+            "chunk digest mismatch: file id {} offset {}"
+            , corrupt.front().fileId
+            , corrupt.front().offset));
+    }
+
+    retransmits_->add(corrupt);
+}
+
+void Receiver::logHash(const BDesc &desc, const std::vector<ChunkRange> &corrupt)
+{
+    if (!hashLog_)
+        return;
+
+    // packed files are journaled as if each was sent in its own chunk, with
+    // the digests they were verified against, if any.
+    if (desc.flags & wire::ChunkHeader::Packed)
+    {
+        const auto verified = (desc.flags & wire::ChunkHeader::Digest) != 0;
+
+        forEachPacked(desc.buf.uint8Data(), desc.len,
+            [this, verified, &corrupt](unsigned fileId, const uint8_t *data, size_t len, uint64_t digest) {
+                if (isCorrupt(corrupt, fileId))
+                    return;
+
+                hashLog_->writeHash(fileId, 0, len, verified ? digest : XXH3_64bits(data, len));
+            });
+
+        return;
+    }
+
+    const auto digest = desc.hashed ?
+        desc.digest :
+        XXH3_64bits(desc.buf.data(), desc.len);
+
+    hashLog_->writeHash(
+        desc.fileId, desc.offset, desc.len, digest);
+}
+
+void Receiver::writeBuffered(const BDesc &desc)
+{
+    ++stats().queuedBlockCount;
+    ++stats().dequeuedBlockCount;
+
+    if (!(desc.flags & wire::ChunkHeader::Packed))
+    {
+        const auto fd = files_->fd(desc.fileId);
+
+        if (fd < 0)
+        {
+            spdlog::error("no mapped fd for file id {}"
+                , desc.fileId);
+
+            return;
+        }
+
+        auto iov = iovec{const_cast<void *>(desc.buf.data()), roundBlockSize(desc.len)};
+
+        const auto written = writeChunk(fd, &iov, 1, desc.offset);
+
+        stats().diskByteCount += written;
+
+        if (auto s = stats(desc.fileId))
+        {
+            ++s->queuedBlockCount;
+            ++s->dequeuedBlockCount;
+            s->diskByteCount += written;
+        }
+
+        return;
+    }
+
+    forEachPacked(desc.buf.uint8Data(), desc.len,
+        [this](unsigned fileId, const uint8_t *data, size_t len) {
+            const auto fd = files_->fd(fileId);
+
+            if (fd < 0)
+            {
+                spdlog::error("no mapped fd for file id {}"
+                    , fileId);
+
+                return;
+            }
+
+            auto iov = iovec{const_cast<uint8_t *>(data), roundBlockSize(len)};
+
+            const auto written = writeChunk(fd, &iov, 1, 0);
+
+            stats().diskByteCount += written;
+
+            if (auto s = stats(fileId))
+                s->diskByteCount += written;
+        });
+}
+
+int Receiver::spliceRead()
+{
+    if (offset_ >= header_.payloadLength)
+        return 1;
+
+    auto len = ::splice(
+        fd_.get(), nullptr,
+        pipeWrite_.get(), nullptr,
+        header_.payloadLength - offset_,
+        SPLICE_F_MOVE | SPLICE_F_MORE);
+
+    if (len < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+
+        throw std::system_error(errno, std::system_category(), "splice");
+    }
+
+    if (!len)
+        return EOF;
+
+    const auto ulen = static_cast<size_t>(len);
+
+    stats().netByteCount += ulen;
+
+    if (auto s = stats(header_.fileId))
+        s->netByteCount += ulen;
+
+    auto fd = nullFd_.get();
+    auto fileOffset = static_cast<loff_t>(header_.fileOffset + offset_);
+    auto offsetPtr = static_cast<loff_t *>(nullptr);
+
+    if (auto fileFd = files_->fd(header_.fileId); fileFd >= 0)
+    {
+        fd = fileFd;
+        offsetPtr = &fileOffset;
+    }
+    else
+    {
+        spdlog::error("no mapped fd for file id {}"
+            , header_.fileId);
+    }
+
+    // always empty the pipe, so the next splice from the socket has room.
+    for (auto remaining = ulen; remaining; )
+    {
+        const auto written = ::splice(
+            pipeRead_.get(), nullptr,
+            fd, offsetPtr,
+            remaining,
+            SPLICE_F_MOVE);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            throw std::system_error(errno, std::system_category(), "splice");
+        }
+
+        remaining -= static_cast<size_t>(written);
+    }
+
+    if (offsetPtr)
+    {
+        stats().diskByteCount += ulen;
+
+        if (auto s = stats(header_.fileId))
+            s->diskByteCount += ulen;
+    }
+
+    offset_ += ulen;
+
+    if (offset_ >= header_.payloadLength)
+        return 1;
+
+    return 0;
+}
+
 }
@@ -0,0 +1,97 @@
+/**
+ * @file Retransmit.cc
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <iterator>
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+#include <draft/util/Retransmit.hh>
+#include <draft/util/Stats.hh>
+
+#include "xxhash.h"
+
+namespace draft::util {
+
+void RetransmitList::add(std::vector<ChunkRange> chunks)
+{
+    for (const auto &chunk : chunks)
+    {
+        spdlog::warn("chunk digest mismatch: file id {} offset {} len {} - requesting it again."
+            , chunk.fileId
+            , chunk.offset
+            , chunk.len);
+    }
+
+    stats().corruptChunkCount += chunks.size();
+
+    auto lk = std::lock_guard{mutex_};
+
+    chunks_.insert(end(chunks_), begin(chunks), end(chunks));
+}
+
+std::vector<ChunkRange> RetransmitList::take()
+{
+    auto lk = std::lock_guard{mutex_};
+
+    return std::exchange(chunks_, { });
+}
+
+std::vector<ChunkRange> verifyChunk(BDesc &desc, uint64_t digest)
+{
+    if (!(desc.flags & wire::ChunkHeader::Digest))
+        return { };
+
+    if (!(desc.flags & wire::ChunkHeader::Packed))
+    {
+        if (!desc.hashed)
+        {
+            desc.digest = XXH3_64bits(desc.buf.data(), desc.len);
+            desc.hashed = true;
+        }
+
+        if (desc.digest == digest)
+            return { };
+
+        return {{desc.fileId, desc.offset, desc.len}};
+    }
+
+    if (packedTableDigest(desc.buf.uint8Data(), desc.len) != digest)
+        throw std::runtime_error("packed chunk: corrupt table");
+
+    // packed files are sent again on their own.
+    auto corrupt = std::vector<ChunkRange>{ };
+
+    forEachPacked(desc.buf.uint8Data(), desc.len,
+        [&corrupt](unsigned fileId, const uint8_t *data, size_t len, uint64_t fileDigest) {
+            if (XXH3_64bits(data, len) != fileDigest)
+                corrupt.push_back({fileId, 0, len});
+        });
+
+    return corrupt;
+}
+
+}
@@ -24,25 +24,131 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
 #include <filesystem>
 #include <iterator>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include <spdlog/spdlog.h>
 
+#include <draft/util/FileTable.hh>
+#include <draft/util/IoUring.hh>
 #include <draft/util/Journal.hh>
+#include <draft/util/Numa.hh>
 #include <draft/util/Receiver.hh>
+#include <draft/util/Retransmit.hh>
 #include <draft/util/RxSession.hh>
+#include <draft/util/Stats.hh>
+#include <draft/util/UringReceiver.hh>
+#include <draft/util/UtilJson.hh>
+#include <draft/util/VerifySession.hh>
 #include <draft/util/Writer.hh>
 
+#include "xxhash.h"
+
 namespace draft::util {
 
+namespace {
+
+/**
+ * Reserve a file's extents without changing its size or writing anything.
+ * Filesystems without native fallocate are left to allocate as data lands,
+ * rather than having posix_fallocate write zeros over the whole file.
+ */
+void preallocate(int fd, const util::FileInfo &info)
+{
+    if (!info.status.size)
+        return;
+
+    // leave the holes of sparse files unallocated - only their data
+    // extents are sent.
+    if (isSparse(info.status))
+    {
+        if (::ftruncate(fd, static_cast<off_t>(info.status.size)))
+            throw std::system_error(errno, std::system_category(), "ftruncate");
+
+        return;
+    }
+
+    if (!::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(info.status.size)))
+        return;
+
+    if (errno == EOPNOTSUPP || errno == ENOSYS)
+        return;
+
+    throw std::system_error(errno, std::system_category(),
+        fmt::format("fallocate '{}'", info.path));
+}
+
+bool sameFiles(const std::vector<util::FileInfo> &a, const std::vector<util::FileInfo> &b)
+{
+    return std::equal(
+        begin(a), end(a),
+        begin(b), end(b),
+        [](const auto &x, const auto &y) {
+            return x.id == y.id && x.path == y.path && x.status.size == y.status.size;
+        });
+}
+
+}
+
 RxSession::RxSession(SessionConfig conf):
     conf_(std::move(conf))
 {
-    pool_ = BufferPool::make(BufSize, 35);
-    targetFds_ = bindNetworkTargets(conf_.targets);
+    retransmits_ = std::make_shared<RetransmitList>();
+
+    recvExec_.setNotifier(&notifier_);
+    writeExec_.setNotifier(&notifier_);
+
+    conf_.streamCount = std::max(conf_.streamCount, 1u);
+
+    targetFds_ = bindNetworkTargets(conf_.targets, conf_.streamCount);
+
+    statsMgr().reallocateStreams(targetFds_.size());
+
+    if (conf_.ioEngine == IoEngine::Uring && !IoUring::supported())
+    {
+        spdlog::warn("io_uring is not available - falling back to receiver & writer threads.");
+        conf_.ioEngine = IoEngine::Sync;
+    }
+
+    if (conf_.ioEngine == IoEngine::Splice && (!conf_.journalPath.empty() || conf_.noWrite))
+    {
+        spdlog::warn("splice receive requires journaling off & writes enabled - falling back to receiver & writer threads.");
+        conf_.ioEngine = IoEngine::Sync;
+    }
+
+    if (conf_.ioEngine == IoEngine::Uring && conf_.numaPipelines)
+    {
+        spdlog::warn("numa pipelines aren't supported by the io_uring receiver - ignoring.");
+        conf_.numaPipelines = false;
+    }
+
+    // the uring receiver brings its own pool.
+    if (conf_.ioEngine != IoEngine::Uring)
+        pool_ = BufferPool::make(BufSize, 35, conf_.poolOptions);
+
+    if (!conf_.numaPipelines)
+    {
+        links_.push_back(std::make_unique<Link>());
+        return;
+    }
+
+    // a target's streams share its pipeline.
+    for (size_t i = 0; i < targetFds_.size(); i += conf_.streamCount)
+    {
+        const auto fd = targetFds_[i].get();
+
+        auto link = std::make_unique<Link>();
+        link->numaNode = numa::socketNode(fd);
+        link->cpus = numa::nodeCpus(link->numaNode);
+
+        spdlog::info("rx pipeline for fd {}: numa node {}.", fd, link->numaNode);
+
+        links_.push_back(std::move(link));
+    }
 }
 
 RxSession::~RxSession() noexcept
@@ -50,49 +156,572 @@ RxSession::~RxSession() noexcept
     finish();
 }
 
-void RxSession::start(util::TransferRequest req)
+CompletedRanges RxSession::resume(const util::TransferRequest &req)
 {
     namespace fs = std::filesystem;
 
-    if (!conf_.noWrite)
-        createTargetFiles(conf_.pathRoot, req.config.fileInfo);
+    if (conf_.journalPath.empty() || conf_.noWrite)
+    {
+        spdlog::warn("resume requires journaling & writes enabled - starting from scratch.");
+        return { };
+    }
 
-    if (!conf_.journalPath.empty())
-        journal_ = std::make_unique<Journal>(conf_.journalPath, req.config.fileInfo);
+    if (!fs::exists(conf_.journalPath))
+    {
+        spdlog::info("no journal at '{}' - starting from scratch.", conf_.journalPath);
+        return { };
+    }
+
+    auto records = std::vector<Journal::HashRecord>{ };
+
+    {
+        const auto prev = Journal{conf_.journalPath};
+
+        if (!sameFiles(prev.fileInfo(), req.config.fileInfo))
+        {
+            throw std::runtime_error(fmt::format(
+                "journal '{}' is for a different transfer - unable to resume."
+                , conf_.journalPath));
+        }
 
-    auto [fileMap, fileInfo] = createFiles(req);
+        for (const auto &record : prev)
+            records.push_back(record);
+    }
 
-    const auto view = std::views::transform(
-        targetFds_, [this](auto &&fd){
-            return Receiver{std::move(fd), queue_};
+    // order by chunk, letting the latest record for a chunk win.
+    std::stable_sort(begin(records), end(records),
+        [](const auto &a, const auto &b) {
+            return std::tie(a.fileId, a.offset) < std::tie(b.fileId, b.offset);
         });
 
-    auto receivers = std::vector<Receiver>{
-        std::make_move_iterator(begin(view)),
-        std::make_move_iterator(end(view))};
+    // (unique over the reversed range keeps the last of each run, packed
+    // at the back.)
+    records.erase(
+        begin(records),
+        std::unique(rbegin(records), rend(records),
+            [](const auto &a, const auto &b) {
+                return a.fileId == b.fileId && a.offset == b.offset;
+            }).base());
 
-    if (journal_)
+    auto sizes = std::unordered_map<unsigned, size_t>{ };
+    auto paths = std::unordered_map<unsigned, fs::path>{ };
+
+    for (const auto &item : req.config.fileInfo)
+    {
+        sizes[item.id] = item.status.size;
+        paths[item.id] = rootedPath(conf_.pathRoot, item.path, item.targetSuffix);
+    }
+
+    // a whole chunk, at a chunk offset, as the senders would send it.
+    const auto wellFormed = [&sizes](const Journal::HashRecord &r) {
+            const auto size = sizes.find(r.fileId);
+
+            return size != end(sizes)
+                && r.offset % BufSize == 0
+                && r.offset < size->second
+                && r.size == std::min(BufSize, size->second - r.offset);
+        };
+
+    auto fds = std::unordered_map<unsigned, ScopedFd>{ };
+    auto buf = std::vector<uint8_t>(BufSize);
+
+    // re-hash a chunk from disk; a chunk at the edge of a range may have been
+    // journaled without making it out of the page cache.
+    const auto intact = [&](const Journal::HashRecord &r) {
+            auto &fd = fds[r.fileId];
+
+            if (fd.get() < 0)
+                fd = ScopedFd{::open(paths[r.fileId].c_str(), O_RDONLY | O_CLOEXEC)};
+
+            const auto len = ::pread(fd.get(), buf.data(), r.size, static_cast<off_t>(r.offset));
+
+            return len == static_cast<ssize_t>(r.size)
+                && XXH3_64bits(buf.data(), r.size) == r.hash;
+        };
+
+    auto completed = CompletedRanges{ };
+    auto kept = std::vector<Journal::HashRecord>{ };
+
+    for (auto iter = begin(records); iter != end(records); )
+    {
+        if (!wellFormed(*iter))
+        {
+            ++iter;
+            continue;
+        }
+
+        // find the run of contiguous chunks starting here.
+        auto runEnd = std::next(iter);
+
+        while (runEnd != end(records)
+            && runEnd->fileId == iter->fileId
+            && runEnd->offset == std::prev(runEnd)->offset + std::prev(runEnd)->size
+            && wellFormed(*runEnd))
+        {
+            ++runEnd;
+        }
+
+        auto first = iter;
+        auto last = runEnd;
+
+        while (first != last && !intact(*first))
+            ++first;
+
+        while (last != first && !intact(*std::prev(last)))
+            --last;
+
+        if (first != last)
+        {
+            completed[first->fileId].push_back({
+                first->offset,
+                std::prev(last)->offset + std::prev(last)->size - first->offset});
+
+            kept.insert(end(kept), first, last);
+        }
+
+        iter = runEnd;
+    }
+
+    // carry the verified records over to a fresh journal for this session.
+    const auto prevPath = conf_.journalPath + ".resume";
+
+    fs::rename(conf_.journalPath, prevPath);
+
+    journal_ = std::make_shared<Journal>(conf_.journalPath, req.config.fileInfo);
+
+    for (const auto &record : kept)
+        journal_->writeHash(record);
+
+    journal_->sync();
+
+    fs::remove(prevPath);
+
+    spdlog::info("resuming: {} of {} journaled chunks intact, in {} files."
+        , kept.size()
+        , records.size()
+        , completed.size());
+
+    return completed;
+}
+
+ChunkDigests RxSession::delta(const util::TransferRequest &req)
+{
+    namespace fs = std::filesystem;
+
+    if (conf_.noWrite)
+    {
+        spdlog::warn("delta mode requires writes enabled - sending everything.");
+        return { };
+    }
+
+    // the target files that already exist, as they are on disk.
+    auto existing = std::vector<util::FileInfo>{ };
+
+    for (const auto &item : req.config.fileInfo)
+    {
+        if (!S_ISREG(item.status.mode))
+            continue;
+
+        auto ec = std::error_code{ };
+        auto path = rootedPath(conf_.pathRoot, item.path, item.targetSuffix);
+        const auto size = fs::file_size(path, ec);
+
+        if (ec || !size)
+            continue;
+
+        auto target = item;
+        target.path = path.string();
+        target.targetSuffix.clear();
+        target.status.size = size;
+
+        existing.push_back(std::move(target));
+    }
+
+    auto digests = ChunkDigests{ };
+    auto journaled = size_t{ };
+
+    // resume() may have already taken over the journal.
+    if (!conf_.journalPath.empty() && !journal_ && fs::exists(conf_.journalPath))
+    {
+        {
+            const auto prev = Journal{conf_.journalPath};
+
+            auto journaledFiles = std::unordered_map<unsigned, util::FileInfo>{ };
+
+            for (const auto &item : prev.fileInfo())
+                journaledFiles[item.id] = item;
+
+            const auto sameAsJournaled = [&](const util::FileInfo &target) {
+                    const auto file = journaledFiles.find(target.id);
+
+                    return file != end(journaledFiles)
+                        && rootedPath(conf_.pathRoot, file->second.path, file->second.targetSuffix) == target.path
+                        && file->second.status.size == target.status.size;
+                };
+
+            // trust the journal for files that haven't changed size since.
+            auto trusted = std::unordered_map<unsigned, bool>{ };
+
+            for (const auto &target : existing)
+                trusted[target.id] = sameAsJournaled(target);
+
+            for (const auto &record : prev)
+            {
+                if (trusted[record.fileId])
+                {
+                    digests[record.fileId][record.offset] = record.hash;
+                    ++journaled;
+                }
+            }
+
+            std::erase_if(existing, [&](const auto &target) { return trusted[target.id]; });
+        }
+
+        fs::rename(conf_.journalPath, conf_.journalPath + ".prev");
+    }
+
+    auto hashed = size_t{ };
+
+    if (!existing.empty())
     {
-        for (auto &receiver : receivers)
+        auto session = VerifySession{{conf_.readerCount, conf_.segmentSize, conf_.useDirectIO}};
+
+        session.start(std::move(existing));
+
+        while (session.runOnce())
+            session.wait(1000);
+
+        session.finish();
+        while (!session.finished())
+            session.wait(1000);
+
+        if (auto journal = std::move(session).releaseJournal())
+        {
+            for (const auto &record : *journal)
+            {
+                digests[record.fileId][record.offset] = record.hash;
+                ++hashed;
+            }
+
+            fs::remove(journal->path());
+        }
+    }
+
+    spdlog::info("delta: {} chunk digests from the journal, {} hashed from disk, in {} files."
+        , journaled
+        , hashed
+        , digests.size());
+
+    return digests;
+}
+
+void RxSession::start(util::TransferRequest req)
+{
+    // resume() may have already opened the journal.
+    if (!conf_.journalPath.empty() && !journal_)
+        journal_ = std::make_unique<Journal>(conf_.journalPath, req.config.fileInfo);
+
+    files_ = std::make_shared<FileTable>();
+
+    if (conf_.ioEngine == IoEngine::Uring)
+    {
+        auto receiver = UringReceiver{std::move(targetFds_), files_, conf_.ioDepth, conf_.poolOptions};
+        receiver.setWritesEnabled(!conf_.noWrite);
+
+        if (journal_)
+            receiver.useHashLog(journal_);
+
+        receiver.useRetransmits(retransmits_);
+
+        targetFds_ = std::vector<ScopedFd>{ };
+
+        spdlog::debug("starting uring receiver.");
+
+        recvExec_.add(std::move(receiver));
+
+        addFiles(std::move(req.config.fileInfo));
+
+        return;
+    }
+
+    spdlog::debug("starting {}receivers.", conf_.ioEngine == IoEngine::Splice ? "splice " : "");
+
+    for (size_t i = 0; i < targetFds_.size(); ++i)
+    {
+        auto &link = linkFor(i);
+
+        auto poolOptions = conf_.poolOptions;
+        poolOptions.numaNode = link.numaNode;
+
+        // a target's receivers take turns accepting from its listening
+        // socket, so none can be left blocked in accept.
+        if (conf_.streamCount > 1)
+            net::setNonBlocking(targetFds_[i].get(), true);
+
+        auto receiver = Receiver{std::move(targetFds_[i]), link.queue};
+        receiver.setPoolOptions(poolOptions);
+        receiver.setStreamId(static_cast<unsigned>(i));
+
+        if (journal_)
             receiver.useHashLog(journal_);
+
+        receiver.useRetransmits(retransmits_);
+
+        if (conf_.ioEngine == IoEngine::Splice)
+            receiver.useSplice(files_);
+
+        if (link.cpus.empty())
+            recvExec_.add(std::move(receiver));
+        else
+            recvExec_.add(Pinned{std::move(receiver), link.cpus});
     }
 
     targetFds_ = std::vector<ScopedFd>{ };
 
-    spdlog::debug("starting receivers.");
+    // splice receivers write straight to the files.
+    if (conf_.ioEngine != IoEngine::Splice)
+    {
+        for (auto &link : links_)
+        {
+            auto writer = Writer(files_, link->queue);
+            writer.setWritesEnabled(!conf_.noWrite);
+
+            if (link->cpus.empty())
+                writeExec_.add(std::move(writer), ThreadExecutor::Options::DoFinalize);
+            else
+                writeExec_.add(Pinned{std::move(writer), link->cpus}, ThreadExecutor::Options::DoFinalize);
+        }
+    }
+
+    addFiles(std::move(req.config.fileInfo));
+}
+
+void RxSession::addFiles(std::vector<util::FileInfo> info)
+{
+    namespace fs = std::filesystem;
+
+    if (conf_.noWrite)
+        return;
 
-    recvExec_.add(std::move(receivers));
+    auto items = std::vector<SetupItem>{ };
+    auto prevDir = std::string{ };
 
-    auto writer = Writer(std::move(fileMap), queue_);
-    writer.setWritesEnabled(!conf_.noWrite);
+    for (auto &item : info)
+    {
+        if (!S_ISREG(item.status.mode))
+            continue;
+
+        if (const auto max = static_cast<size_t>(std::numeric_limits<off_t>::max());
+            item.status.size > max)
+        {
+            throw std::runtime_error(fmt::format(
+                "file '{}' is too large for off_t (limit: {})"
+                , item.path
+                , max));
+        }
+
+        auto path = rootedPath(conf_.pathRoot, item.path, item.targetSuffix);
+
+        // directories are created up front, in order; a file's siblings
+        // are usually next to it in the manifest.
+        if (auto dir = util::dirname(path); dir != prevDir)
+        {
+            fs::create_directories(dir);
+            prevDir = std::move(dir);
+        }
+
+        items.push_back({std::move(path), std::move(item)});
+    }
+
+    // open & preallocate in parallel; each file is usable as soon as it's
+    // open.
+    for (size_t first = 0; first < items.size(); first += SetupBatchSize)
+    {
+        const auto last = std::min(items.size(), first + SetupBatchSize);
+
+        auto batch = std::vector<SetupItem>(
+            std::make_move_iterator(begin(items) + static_cast<std::ptrdiff_t>(first)),
+            std::make_move_iterator(begin(items) + static_cast<std::ptrdiff_t>(last)));
+
+        auto future = setupExec_.launch(
+            [this, batch = std::move(batch)](std::stop_token stopToken) {
+                return setupFiles(batch, stopToken);
+            });
+
+        if (!future)
+            throw std::runtime_error("rx session: file setup cancelled");
+
+        auto lk = std::lock_guard{fileMutex_};
+        setupResults_.push_back(std::move(*future));
+    }
+}
+
+int RxSession::setupFiles(const std::vector<SetupItem> &items, std::stop_token stopToken)
+{
+    auto flags = O_CREAT;
+
+    // spliced chunks are read back to verify them, from the page cache -
+    // splicing doesn't work with O_DIRECT's alignment rules.
+    if (conf_.ioEngine == IoEngine::Splice)
+        flags |= O_RDWR;
+    else
+        flags |= O_WRONLY | (conf_.useDirectIO ? O_DIRECT : 0);
+
+    for (const auto &[path, item] : items)
+    {
+        if (stopToken.stop_requested())
+            break;
+
+        spdlog::debug("rx setup file {}: '{}'", item.id, path.native());
+
+        auto fd = ScopedFd{::open(path.c_str(), flags, item.status.mode & 0777)};
 
-    writeExec_.add(std::move(writer), ThreadExecutor::Options::DoFinalize);
+        if (fd.get() < 0)
+        {
+            throw std::system_error(errno, std::system_category(),
+                fmt::format("open '{}'", path.native()));
+        }
+
+        const auto rawFd = fd.get();
+
+        {
+            auto lk = std::lock_guard{fileMutex_};
+
+            fileInfo_.push_back({
+                path,
+                std::move(fd),
+                item.status.size,
+                item.status.mode,
+                item.id
+            });
+        }
+
+        // writes may start while the extents are reserved.
+        files_->add(item.id, rawFd);
+
+        preallocate(rawFd, item);
+    }
 
-    fileInfo_ = std::move(fileInfo);
+    return 0;
+}
+
+void RxSession::endFiles()
+{
+    auto results = std::vector<std::future<int>>{ };
+
+    {
+        auto lk = std::lock_guard{fileMutex_};
+        results = std::exchange(setupResults_, { });
+    }
+
+    // wait for the files still being set up; errors are the caller's.
+    for (auto &r : results)
+        r.get();
+
+    if (files_)
+        files_->close();
+}
+
+void RxSession::retransmit(int fd)
+{
+    // everything queued goes to disk first, so nothing lands over the
+    // chunks sent again.
+    recvExec_.cancel();
+    writeExec_.cancel();
+    writeExec_.waitFinished();
+
+    // retransmits are received one at a time.
+    if (!pool_)
+        pool_ = BufferPool::make(BufSize, 1, conf_.poolOptions);
+
+    for (unsigned round = 0; ; ++round)
+    {
+        const auto chunks = retransmits_->take();
+
+        if (!chunks.empty() && round == MaxRetransmitRounds)
+        {
+            throw std::runtime_error(fmt::format(
+                "{} chunks still corrupt after {} rounds of retransmits."
+                , chunks.size()
+                , MaxRetransmitRounds));
+        }
+
+        const auto msg = generateRetransmitMsg(chunks);
+        net::writeAll(fd, msg.data(), msg.size());
+
+        if (chunks.empty())
+            return;
+
+        spdlog::info("retransmit: requested {} corrupt chunks again.", chunks.size());
+
+        for (size_t i = 0; i < chunks.size(); ++i)
+            receiveRetransmit(fd);
+    }
+}
+
+void RxSession::receiveRetransmit(int fd)
+{
+    auto header = wire::ChunkHeader{ };
+    net::readAll(fd, &header, sizeof(header));
+
+    // retransmits are always plain, raw chunks.
+    if (header.magic != wire::ChunkHeader::Magic
+        || header.payloadLength > BufSize
+        || !(header.flags & wire::ChunkHeader::Digest)
+        || (header.flags & wire::ChunkHeader::Packed)
+        || header.codec != wire::ChunkHeader::Raw)
+    {
+        throw std::runtime_error("retransmit: invalid chunk header");
+    }
+
+    auto desc = BDesc{
+        pool_->get(),
+        header.fileId,
+        header.fileOffset,
+        header.payloadLength,
+        header.flags
+    };
+
+    net::readAll(fd, desc.buf.data(), desc.len);
+
+    stats().netByteCount += desc.len;
+    stats().retransmitByteCount += desc.len;
+
+    if (auto corrupt = verifyChunk(desc, header.digest); !corrupt.empty())
+    {
+        retransmits_->add(std::move(corrupt));
+        return;
+    }
+
+    if (!conf_.noWrite)
+    {
+        auto lk = std::lock_guard{fileMutex_};
+
+        const auto file = std::find_if(
+            begin(fileInfo_), end(fileInfo_),
+            [&desc](const auto &info) { return info.id == desc.fileId; });
+
+        if (file == end(fileInfo_))
+            throw std::runtime_error(fmt::format("retransmit: unknown file id {}", desc.fileId));
+
+        auto iov = iovec{desc.buf.data(), roundBlockSize(desc.len)};
+
+        stats().diskByteCount += writeChunk(file->fd.get(), &iov, 1, desc.offset);
+    }
+
+    if (journal_)
+        journal_->writeHash(desc.fileId, desc.offset, desc.len, desc.digest);
 }
 
 void RxSession::finish() noexcept
 {
+    // setup that hasn't started is dropped, and writers waiting on files
+    // that never arrived give up.
+    setupExec_.cancel();
+
+    if (files_)
+        files_->close();
+
     recvExec_.cancel();
     writeExec_.cancel();
     writeExec_.waitFinished();
@@ -107,6 +736,8 @@ void RxSession::finish() noexcept
 
 void RxSession::truncateFiles()
 {
+    auto lk = std::lock_guard{fileMutex_};
+
     for (const auto &info : fileInfo_)
     {
         if (!S_ISREG(info.mode))
@@ -144,54 +775,9 @@ bool RxSession::runOnce()
     return false;
 }
 
-std::pair<FdMap, std::vector<RxSession::FileInfo>> RxSession::createFiles(
-    const util::TransferRequest &req)
+RxSession::Link &RxSession::linkFor(size_t stream)
 {
-    auto fileMap = FdMap{ };
-    auto fileInfo = std::vector<FileInfo>{ };
-
-    for (const auto &item : req.config.fileInfo)
-    {
-        if (!S_ISREG(item.status.mode))
-            continue;
-
-        auto path = rootedPath(
-            conf_.pathRoot,
-            item.path,
-            item.targetSuffix);
-
-        auto flags = O_WRONLY;
-
-        if (conf_.useDirectIO)
-            flags |= O_DIRECT;
-
-        auto fd = ScopedFd{ };
-
-        if (!conf_.noWrite)
-            fd = ScopedFd{::open(path.c_str(), flags)};
-
-        auto rawFd = fd.get();
-
-        if (rawFd < 0)
-        {
-            spdlog::error("unable to open file '{}': {}"
-                , path.native()
-                , std::strerror(errno));
-
-            continue;
-        }
-
-        fileInfo.push_back({
-            path,
-            std::move(fd),
-            item.status.size,
-            item.status.mode
-        });
-
-        fileMap.insert({item.id, rawFd});
-    }
-
-    return {std::move(fileMap), std::move(fileInfo)};
+    return *links_[links_.size() == 1 ? 0 : stream / conf_.streamCount];
 }
 
 }
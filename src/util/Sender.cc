@@ -24,6 +24,17 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
+
+#include <time.h>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <spdlog/spdlog.h>
+
 #include <draft/util/Journal.hh>
 #include <draft/util/Sender.hh>
 #include <draft/util/Stats.hh>
@@ -38,13 +49,25 @@ Sender::Sender(ScopedFd fd, BufQueue &queue):
 {
 }
 
-bool Sender::runOnce(std::stop_token stopToken)
+bool Sender::useZeroCopy(size_t maxPending)
 {
-    using namespace std::chrono_literals;
+    const int enable = 1;
 
-    using Clock = std::chrono::steady_clock;
+    if (::setsockopt(fd_.get(), SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)))
+    {
+        spdlog::warn("sender: zero-copy unavailable: {}", std::strerror(errno));
+        return false;
+    }
+
+    zeroCopy_ = true;
+    zcMaxPending_ = std::max<size_t>(maxPending, 1);
+
+    return true;
+}
 
-    while (auto desc = queue_->get(Clock::now() + 1ms))
+bool Sender::runOnce(std::stop_token stopToken)
+{
+    while (auto desc = take(stopToken))
     {
         ++stats().dequeuedBlockCount;
 
@@ -57,33 +80,340 @@ bool Sender::runOnce(std::stop_token stopToken)
 
         if (auto s = stats(desc->fileId))
             s->netByteCount += len;
+
+        if (auto s = streamStats(streamId_))
+            s->addChunk(len);
+
+        if (dispatcher_)
+            dispatcher_->sent(len);
+    }
+
+    if (!zeroCopy_)
+        return !stopToken.stop_requested();
+
+    if (stopToken.stop_requested())
+    {
+        drainCompletions();
+        return false;
+    }
+
+    reapCompletions(0);
+
+    return true;
+}
+
+std::optional<BDesc> Sender::take(std::stop_token stopToken)
+{
+    using namespace std::chrono_literals;
+
+    using Clock = std::chrono::steady_clock;
+
+    const auto start = Clock::now();
+    const auto deadline = start + 100ms;
+
+    const auto admit = [&] {
+            return !dispatcher_
+                || dispatcher_->admit(slot_, queue_->size(), stopToken.stop_requested());
+        };
+
+    auto admitted = admit();
+
+    if (admitted)
+        return queue_->get(deadline, stopToken);
+
+    // a stream passed over for chunks waits for the dispatcher to change
+    // its mind - once the session stops, that's until the queue is empty,
+    // since there are no more chunks coming.
+    std::stop_callback wakeOnStop(stopToken, [this]{ dispatcher_->wakeAll(); });
+
+    while (!admitted
+        && (stopToken.stop_requested() ? queue_->size() : Clock::now() < deadline))
+    {
+        dispatcher_->wait(slot_,
+            stopToken.stop_requested() ? Clock::now() + 100ms : deadline);
+
+        admitted = admit();
+    }
+
+    if (auto s = streamStats(streamId_))
+    {
+        s->passNs += static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
     }
 
-    return !stopToken.stop_requested();
+    if (!admitted)
+        return { };
+
+    return queue_->get(deadline, stopToken);
 }
 
 size_t Sender::write(BDesc desc)
 {
+    if (zeroCopy_)
+        return writeZeroCopy(std::move(desc));
+
     auto header = wire::ChunkHeader{ };
     header.magic = wire::ChunkHeader::Magic;
     header.fileOffset = desc.offset;
     header.payloadLength = desc.len;
     header.fileId = desc.fileId;
+    header.flags = desc.flags;
+    header.codec = desc.codec;
+    header.rawLength = desc.rawLen;
+
+    if (desc.hashed)
+    {
+        header.flags |= wire::ChunkHeader::Digest;
+        header.digest = desc.digest;
+    }
 
     iovec iov[2] = {
         {&header, sizeof(header)},
-        {desc.buf->data(), desc.len}
+        {desc.buf.data(), desc.len}
     };
 
-    if (hashLog_)
+    logHash(desc);
+
+    return writeChunk(fd_.get(), iov, 2);
+}
+
+size_t Sender::writeZeroCopy(BDesc desc)
+{
+    // the header and buffer must outlive the send, so they're owned by the
+    // pending list until the kernel reports completion.
+    auto &zc = zcPending_.emplace_back();
+
+    zc.header.magic = wire::ChunkHeader::Magic;
+    zc.header.fileOffset = desc.offset;
+    zc.header.payloadLength = desc.len;
+    zc.header.fileId = desc.fileId;
+    zc.header.flags = desc.flags;
+    zc.header.codec = desc.codec;
+    zc.header.rawLength = desc.rawLen;
+
+    if (desc.hashed)
+    {
+        zc.header.flags |= wire::ChunkHeader::Digest;
+        zc.header.digest = desc.digest;
+    }
+    zc.buf = desc.buf;
+
+    iovec iov[2] = {
+        {&zc.header, sizeof(zc.header)},
+        {desc.buf.data(), desc.len}
+    };
+
+    logHash(desc);
+
+    auto msg = msghdr{ };
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    auto written = size_t{ };
+
+    const auto firstSeq = zcSeq_;
+
+    try
     {
-        const auto digest = XXH3_64bits(desc.buf->data(), desc.len);
+        while (msg.msg_iovlen)
+        {
+            const auto len = ::sendmsg(fd_.get(), &msg, MSG_ZEROCOPY);
 
-        hashLog_->writeHash(
-            desc.fileId, desc.offset, desc.len, digest);
+            if (len < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                // out of socket option memory for pinned pages - wait for the
+                // kernel to release some before trying again.
+                if (errno == ENOBUFS)
+                {
+                    reapCompletions(10);
+                    continue;
+                }
+
+                throw std::system_error(errno, std::system_category(), "sendmsg");
+            }
+
+            // every successful MSG_ZEROCOPY send consumes a completion id.
+            ++zcSeq_;
+
+            if (!len)
+                break;
+
+            auto ulen = static_cast<size_t>(len);
+
+            written += ulen;
+
+            while (ulen && msg.msg_iovlen)
+            {
+                const auto adv = std::min(msg.msg_iov->iov_len, ulen);
+                msg.msg_iov->iov_base = reinterpret_cast<uint8_t *>(msg.msg_iov->iov_base) + adv;
+                msg.msg_iov->iov_len -= adv;
+
+                ulen -= adv;
+
+                if (!msg.msg_iov->iov_len)
+                {
+                    ++msg.msg_iov;
+                    --msg.msg_iovlen;
+                }
+            }
+        }
     }
+    catch (...)
+    {
+        // an entry left unsent would hold up the release of everything
+        // after it - drop it if the kernel never saw it, or else wait for
+        // what it did see, like any other send.
+        if (zcSeq_ == firstSeq)
+        {
+            zcPending_.pop_back();
+        }
+        else
+        {
+            zc.lastSeq = zcSeq_ - 1;
+            zc.sent = true;
+        }
 
-    return writeChunk(fd_.get(), iov, 2);
+        throw;
+    }
+
+    zc.lastSeq = zcSeq_ - 1;
+    zc.sent = true;
+
+    ++stats().zeroCopySendCount;
+
+    // hand back whatever the kernel is done with now, rather than once the
+    // queue runs dry - by then, the held buffers may be what's keeping the
+    // readers from filling it.
+    reapCompletions(0);
+
+    while (zcPending_.size() > zcMaxPending_)
+        reapCompletions(10);
+
+    return written;
+}
+
+void Sender::logHash(const BDesc &desc)
+{
+    if (!hashLog_)
+        return;
+
+    // chunks hashed by their reader (which they must be, if compressed) just
+    // have their digests recorded; the rest are hashed here.
+    //
+    // packed files are journaled as if each was sent in its own chunk.
+    if (desc.flags & wire::ChunkHeader::Packed)
+    {
+        if (desc.packedDigests)
+        {
+            for (const auto &file : *desc.packedDigests)
+                hashLog_->writeHash(file.fileId, 0, file.len, file.digest);
+
+            return;
+        }
+
+        forEachPacked(desc.buf.uint8Data(), desc.len,
+            [this](unsigned fileId, const uint8_t *data, size_t len) {
+                hashLog_->writeHash(fileId, 0, len, XXH3_64bits(data, len));
+            });
+
+        return;
+    }
+
+    const auto digest = desc.hashed ?
+        desc.digest :
+        XXH3_64bits(desc.buf.data(), desc.len);
+
+    hashLog_->writeHash(
+        desc.fileId, desc.offset, desc.len, digest);
+}
+
+void Sender::reapCompletions(int tmoMs)
+{
+    if (tmoMs)
+    {
+        // error queue events are always reported as POLLERR.
+        auto pfd = pollfd{fd_.get(), 0, 0};
+        ::poll(&pfd, 1, tmoMs);
+    }
+
+    for (;;)
+    {
+        alignas(cmsghdr) char control[128];
+
+        auto msg = msghdr{ };
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (::recvmsg(fd_.get(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            throw std::system_error(errno, std::system_category(), "recvmsg errqueue");
+        }
+
+        for (auto cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            const bool isRecvErr =
+                (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+
+            if (!isRecvErr)
+                continue;
+
+            auto err = sock_extended_err{ };
+            std::memcpy(&err, CMSG_DATA(cm), sizeof(err));
+
+            if (err.ee_errno || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // [ee_info, ee_data] is the range of completed send ids.
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                stats().zeroCopyCopiedCount += err.ee_data - err.ee_info + 1;
+
+            zcCompletedSeq_ = err.ee_data + 1;
+        }
+    }
+
+    // completions are reported in order on a tcp socket, so release
+    // everything up to the last completed id.
+    while (!zcPending_.empty() && zcPending_.front().sent &&
+        static_cast<int32_t>(zcPending_.front().lastSeq - zcCompletedSeq_) < 0)
+    {
+        zcPending_.pop_front();
+    }
+}
+
+void Sender::drainCompletions()
+{
+    using namespace std::chrono_literals;
+
+    using Clock = std::chrono::steady_clock;
+
+    const auto deadline = Clock::now() + 5s;
+
+    while (!zcPending_.empty() && Clock::now() < deadline)
+        reapCompletions(100);
+
+    if (!zcPending_.empty())
+    {
+        spdlog::warn("sender: abandoning {} buffers with incomplete zero-copy sends."
+            , zcPending_.size());
+
+        // the socket may still be sending from these pages, so they mustn't
+        // go back to the pool to be refilled - leak them, and the pool they
+        // keep alive, and stop the connection.
+        static_cast<void>(new std::deque<ZeroCopySend>(std::move(zcPending_)));
+        zcPending_.clear();
+
+        ::shutdown(fd_.get(), SHUT_RDWR);
+    }
 }
 
 }
@@ -24,6 +24,11 @@
  * SOFTWARE.
  */
 
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#include <draft/util/Numa.hh>
 #include <draft/util/TaskPool.hh>
 
 namespace draft::util {
@@ -64,7 +69,21 @@ void TaskPool::resize(size_t newSize)
     threads_.resize(newSize);
 
     for (auto i = prevSize; i < newSize; ++i)
+    {
         threads_[i] = std::jthread([this](std::stop_token token){ stealWork(token); });
+        numa::pinThread(cpus_, threads_[i].native_handle());
+    }
+}
+
+void TaskPool::setAffinity(std::vector<unsigned> cpus)
+{
+    cpus_ = std::move(cpus);
+
+    for (auto &thd : threads_)
+    {
+        if (!numa::pinThread(cpus_, thd.native_handle()))
+            spdlog::warn("unable to set task pool cpu affinity: {}", std::strerror(errno));
+    }
 }
 
 void TaskPool::stealWork(std::stop_token token)
@@ -72,7 +91,12 @@ void TaskPool::stealWork(std::stop_token token)
     while (!token.stop_requested() && !q_.done())
     {
         if (auto work = q_.get(); work && *work)
+        {
+            if (notifier_)
+                notifier_->notify();
+
             (*work)(token);
+        }
     }
 }
 
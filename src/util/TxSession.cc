@@ -29,27 +29,64 @@
 
 #include <sys/stat.h>
 
+#include <draft/util/ChunkCodec.hh>
+#include <draft/util/IoUring.hh>
 #include <draft/util/Journal.hh>
+#include <draft/util/Numa.hh>
+#include <draft/util/PackedReader.hh>
 #include <draft/util/Reader.hh>
 #include <draft/util/ScopedTimer.hh>
 #include <draft/util/Sender.hh>
+#include <draft/util/Stats.hh>
 #include <draft/util/ThreadExecutor.hh>
 #include <draft/util/TxSession.hh>
+#include <draft/util/UtilJson.hh>
+
+#include "xxhash.h"
 
 namespace draft::util {
 
 TxSession::TxSession(SessionConfig conf):
     conf_(std::move(conf))
 {
-    readExec_.resize(1);
-    readExec_.setQueueSizeLimit(10);
+    if (conf_.ioEngine == IoEngine::Uring && !IoUring::supported())
+    {
+        spdlog::warn("io_uring is not available - falling back to synchronous reads.");
+        conf_.ioEngine = IoEngine::Sync;
+    }
+
+    if (conf_.compressLevel && !ChunkCodec::supported())
+    {
+        spdlog::warn("draft was built without compression support - sending uncompressed.");
+        conf_.compressLevel = 0;
+    }
+
+    sendExec_.setNotifier(&notifier_);
+
+    conf_.streamCount = std::max(conf_.streamCount, 1u);
+
+    targetFds_ = connectNetworkTargets(conf_.targets, conf_.streamCount);
 
-    queue_.setSizeLimit(100);
+    statsMgr().reallocateStreams(targetFds_.size());
 
-    pool_ = BufferPool::make(BufSize, 35);
-    targetFds_ = connectNetworkTargets(conf_.targets);
+    spdlog::info("connected tx targets: {} streams each.", conf_.streamCount);
 
-    spdlog::info("connected tx targets.");
+    if (!conf_.numaPipelines)
+    {
+        links_.push_back(makeLink(-1));
+        return;
+    }
+
+    // a target's streams share its pipeline.
+    for (size_t i = 0; i < targetFds_.size(); i += conf_.streamCount)
+    {
+        const auto fd = targetFds_[i].get();
+        const auto node = numa::socketNode(fd);
+
+        spdlog::info("tx pipeline for fd {}: numa node {}.", fd, node);
+
+        links_.push_back(makeLink(node));
+    }
 }
 
 TxSession::~TxSession() noexcept
@@ -57,43 +94,142 @@ TxSession::~TxSession() noexcept
     finish();
 }
 
-void TxSession::start(const std::string &path)
+void TxSession::addFiles(std::vector<FileInfo> info, bool last)
 {
-    namespace fs = std::filesystem;
+    {
+        auto lk = std::lock_guard{addMutex_};
 
-    // TODO: should we also own the rx service connection, and send xfer
-    // request here?
+        added_.insert(end(added_),
+            std::make_move_iterator(begin(info)),
+            std::make_move_iterator(end(info)));
 
-    const auto view = std::views::transform(
-        targetFds_, [this](auto &&fd){ return Sender{std::move(fd), queue_}; });
+        addedLast_ = last;
+    }
 
-    auto senders = std::vector<Sender>{
-        std::make_move_iterator(begin(view)),
-        std::make_move_iterator(end(view))};
+    notifier_.notify();
+}
 
-    info_ = getFileInfo(path);
+void TxSession::start()
+{
+    // TODO: should we also own the rx service connection, and send xfer
+    // request here?
+
+    takeFiles();
 
     if (!conf_.journalPath.empty())
     {
+        if (!haveAllFiles_)
+            throw std::logic_error("TxSession: journaling requires the whole file list at start");
+
         journal_ = std::make_unique<Journal>(conf_.journalPath, info_);
+    }
 
-        for (auto &sender : senders)
+    const auto linkStreams = links_.size() == 1 ? targetFds_.size() : size_t{conf_.streamCount};
+
+    for (size_t i = 0; i < targetFds_.size(); ++i)
+    {
+        auto &link = linkFor(i);
+        auto sender = Sender{std::move(targetFds_[i]), link.queue};
+        sender.setStreamId(static_cast<unsigned>(i));
+        sender.useDispatcher(link.dispatcher);
+
+        // a link's streams share its pool; each holds at most half of
+        // its share awaiting zero-copy completions.
+        if (conf_.zeroCopy)
+            sender.useZeroCopy(link.pool->count() / (2 * linkStreams));
+
+        if (journal_)
             sender.useHashLog(journal_);
+
+        if (link.cpus.empty())
+            sendExec_.add(std::move(sender), ThreadExecutor::Options::DoFinalize);
+        else
+            sendExec_.add(Pinned{std::move(sender), link.cpus}, ThreadExecutor::Options::DoFinalize);
     }
 
     // clear targets since we've moved them into senders.
     targetFds_ = std::vector<ScopedFd>{ };
 
-    sendExec_.add(std::move(senders), ThreadExecutor::Options::DoFinalize);
+    nextFile_ = nextFile(0);
+}
+
+void TxSession::retransmit(int fd)
+{
+    for (;;)
+    {
+        auto header = wire::ChunkHeader{ };
+        net::readAll(fd, &header, sizeof(header));
+
+        if (header.magic != wire::ChunkHeader::Magic)
+            throw std::runtime_error("invalid retransmit message magic");
+
+        auto payload = std::vector<uint8_t>(header.payloadLength);
+        net::readAll(fd, payload.data(), payload.size());
+
+        const auto chunks = deserializeRetransmitMsg(payload.data(), payload.size());
+
+        if (chunks.empty())
+            return;
 
-    fileIter_ = nextFile(begin(info_), end(info_));
+        spdlog::warn("retransmit: receiver requested {} corrupt chunks again.", chunks.size());
+
+        for (const auto &chunk : chunks)
+            resend(fd, chunk);
+    }
+}
+
+void TxSession::resend(int fd, const ChunkRange &chunk)
+{
+    const auto info = std::find_if(
+        begin(info_), end(info_),
+        [&chunk](const auto &i) { return i.id == chunk.fileId; });
+
+    if (info == end(info_) || chunk.len > BufSize)
+    {
+        throw std::runtime_error(fmt::format(
+            "retransmit: invalid request for file id {} offset {} len {}"
+            , chunk.fileId
+            , chunk.offset
+            , chunk.len));
+    }
+
+    const auto file = ScopedFd{::open(info->path.c_str(), O_RDONLY | O_CLOEXEC)};
+
+    if (file.get() < 0)
+        throw std::system_error(errno, std::system_category(), "open " + info->path);
+
+    auto buf = std::vector<uint8_t>(chunk.len);
+    const auto len = readChunk(file.get(), buf.data(), buf.size(), chunk.offset);
+
+    // always sent raw, as a plain chunk - packed files are sent on their
+    // own.
+    auto header = wire::ChunkHeader{ };
+    header.magic = wire::ChunkHeader::Magic;
+    header.fileOffset = chunk.offset;
+    header.payloadLength = len;
+    header.fileId = static_cast<uint16_t>(chunk.fileId);
+    header.flags = wire::ChunkHeader::Digest;
+    header.rawLength = static_cast<uint32_t>(len);
+    header.digest = XXH3_64bits(buf.data(), len);
+
+    iovec iov[2] = {
+        {&header, sizeof(header)},
+        {buf.data(), len}
+    };
+
+    net::writeAll(fd, iov, 2);
+
+    stats().netByteCount += len;
+    stats().retransmitByteCount += len;
 }
 
 void TxSession::finish() noexcept
 {
     spdlog::debug("txsession: cancelling read & send tasks.");
 
-    readExec_.cancel();
+    for (auto &link : links_)
+        link->readExec.cancel();
+
     sendExec_.cancel();
 
     if (journal_)
@@ -125,13 +261,33 @@ bool TxSession::runOnce()
 
     sendExec_.clearFinished();
 
+    takeFiles();
+
+    if (haveAllFiles_)
+    {
+        for (auto &link : links_)
+            link->dispatcher->haveAllFiles();
+    }
+
     // if there are more files to read, try to submit reads for them.
     // if our reader queue is full, we'll time-out and try again later.
-    while (fileIter_ != end(info_) && startFile(*fileIter_))
+    while ((nextFile_ = nextFile(nextFile_)) < info_.size())
     {
-        // advance file iterator, skipping things we don't want to send,
-        // like directories, and on to the next regular file.
-        fileIter_ = nextFile(++fileIter_, end(info_));
+        // runs of small files are packed into shared chunks.
+        if (packable(info_[nextFile_]))
+        {
+            if (!startPacked())
+                break;
+
+            continue;
+        }
+
+        if (!startFile(info_[nextFile_]))
+            break;
+
+        // move on to the next file; things we don't want to send, like
+        // directories, are skipped above.
+        ++nextFile_;
     }
 
     // once we've finished submitting reads for all of our files, start
@@ -140,7 +296,7 @@ bool TxSession::runOnce()
     // TODO: use info list, resubmit failed submissions.
     // TODO: check for resubmission requirement, flush only when we're
     // done reading.
-    if (fileIter_ == end(info_) && readResults_.empty())
+    if (haveAllFiles_ && nextFile_ == info_.size() && readResults_.empty())
     {
         spdlog::trace("waiting on xfer completion.");
 
@@ -151,55 +307,226 @@ bool TxSession::runOnce()
     return true;
 }
 
-TxSession::file_info_iter_type TxSession::nextFile(file_info_iter_type first, file_info_iter_type last)
+void TxSession::takeFiles()
 {
-    while (first != last && (!S_ISREG(first->status.mode) || !first->status.size))
-        ++first;
+    auto lk = std::lock_guard{addMutex_};
+
+    info_.insert(end(info_),
+        std::make_move_iterator(begin(added_)),
+        std::make_move_iterator(end(added_)));
 
-    return first;
+    added_.clear();
+    haveAllFiles_ = addedLast_;
 }
 
-bool TxSession::startFile(const FileInfo &info)
+size_t TxSession::nextFile(size_t index) const
 {
-    using namespace std::chrono_literals;
+    while (index < info_.size() && (!S_ISREG(info_[index].status.mode) || !info_[index].status.size))
+        ++index;
 
-    using Clock = std::chrono::steady_clock;
+    return index;
+}
 
+bool TxSession::startFile(const FileInfo &info)
+{
     const auto &filename = info.path;
     auto flags = O_RDONLY;
 
     if (conf_.useDirectIO)
         flags |= O_DIRECT;
 
-    auto fd = std::make_shared<ScopedFd>(
-        ScopedFd{::open(filename.c_str(), flags)});
+    // a file may take several calls to submit all of its segments, so
+    // hold on to its fd & remaining segments between calls.
+    if (!segmentFd_)
+    {
+        segmentFd_ = std::make_shared<ScopedFd>(
+            ScopedFd{::open(filename.c_str(), flags)});
+
+        spdlog::debug("tx opened file id {}: {} @ fd {}", info.id, filename, segmentFd_->get());
 
-    spdlog::debug("tx opened file id {}: {} @ fd {}", info.id, filename, fd->get());
+        const auto fileSz = std::filesystem::file_size(filename);
 
-    auto fileSz = std::filesystem::file_size(filename);
+        segments_ = splitSegments(fileSz, conf_.segmentSize);
+        nextSegment_ = 0;
 
-    // try for a while to submit this reader.
-    // we may time-out here if the network is bottlenecking things.
-    const auto deadline = Clock::now() + 50ms;
-    while (!readExec_.cancelled() && Clock::now() < deadline)
+        if (auto done = completed_.find(info.id); done != end(completed_))
+            segments_ = subtractSegments(segments_, done->second);
+
+        // only send the data extents of sparse files - unless the receiver
+        // has a copy of its own (delta mode), which may hold data where
+        // this file has holes.
+        if (isSparse(info.status) && !(digests_ && digests_->contains(info.id)))
+            skipHoles(info.id, fileSz);
+    }
+
+    // submit readers for the remaining segments until the read queue fills
+    // up - the network may be bottlenecking things. reader progress wakes
+    // the session to submit the rest.
+    while (!links_[nextLink_]->readExec.cancelled())
     {
-        const auto rateDeadline = Clock::now() + 1ms;
+        if (nextSegment_ == segments_.size())
+        {
+            segmentFd_.reset();
+            return true;
+        }
 
-        auto diskRead = Reader(fd, info.id, {0, fileSz}, pool_, &queue_);
+        // spread segments over the pipelines, so each link's readers fill
+        // its sender's queue from node-local buffers.
+        auto &link = *links_[nextLink_];
 
-        if (auto future = readExec_.launch(std::move(diskRead)))
+        auto diskRead = Reader(segmentFd_, info.id, segments_[nextSegment_], link.pool, &link.queue);
+
+        if (link.rings)
+            diskRead.useRings(link.rings);
+
+        if (digests_)
+            diskRead.skipMatching(digests_);
+
+        // every chunk carries its digest, for the receiver to verify.
+        diskRead.computeDigests();
+        diskRead.setCompressLevel(conf_.compressLevel);
+
+        if (auto future = link.readExec.launch(std::move(diskRead)))
         {
             readResults_.push_back(std::move(*future));
-            return true;
+            ++nextSegment_;
+            nextLink_ = (nextLink_ + 1) % links_.size();
+            continue;
         }
 
-        std::this_thread::sleep_until(rateDeadline);
+        break;
     }
 
-    spdlog::debug("start file {}: timed-out, will resubmit later on."
+    spdlog::trace("start file {}: read queue full, will resubmit later on."
         , filename);
 
     return false;
 }
 
+bool TxSession::packable(const FileInfo &info) const
+{
+    // (a file partway through startFile is finished that way.)
+    return !segmentFd_ && info.status.size <= PackedReader::MaxFileSize;
+}
+
+bool TxSession::startPacked()
+{
+    auto items = std::vector<PackedReader::Item>{ };
+    auto dataLen = size_t{ };
+
+    auto index = nextFile_;
+
+    for (; index < info_.size() && packable(info_[index]); index = nextFile(index + 1))
+    {
+        const auto &info = info_[index];
+
+        // skip files the receiver already has.
+        if (auto done = completed_.find(info.id); done != end(completed_)
+            && subtractSegments({{0, info.status.size}}, done->second).empty())
+        {
+            continue;
+        }
+
+        const auto len = dataLen + roundBlockSize(info.status.size);
+
+        if (packedPayloadSize(items.size() + 1, len) > BufSize)
+            break;
+
+        items.push_back({info.path, info.status.size, info.id});
+        dataLen = len;
+    }
+
+    if (!items.empty())
+    {
+        auto &link = *links_[nextLink_];
+
+        auto diskRead = PackedReader(std::move(items), link.pool, &link.queue);
+        diskRead.setDirectIO(conf_.useDirectIO);
+        diskRead.computeDigests();
+        diskRead.setCompressLevel(conf_.compressLevel);
+
+        if (digests_)
+            diskRead.skipMatching(digests_);
+
+        auto future = link.readExec.launch(std::move(diskRead));
+
+        if (!future)
+        {
+            spdlog::trace("start packed files: read queue full, will resubmit later on.");
+            return false;
+        }
+
+        readResults_.push_back(std::move(*future));
+        nextLink_ = (nextLink_ + 1) % links_.size();
+    }
+
+    nextFile_ = index;
+
+    return true;
+}
+
+void TxSession::skipHoles(unsigned fileId, size_t fileSize)
+{
+    const auto holes = findHoles(segmentFd_->get(), fileSize);
+
+    auto skipped = size_t{ };
+
+    for (const auto &hole : holes)
+        skipped += hole.len;
+
+    if (!skipped)
+        return;
+
+    segments_ = subtractSegments(segments_, holes);
+
+    stats().holeByteCount += skipped;
+    stats().fileByteCount -= skipped;
+
+    if (auto s = stats(fileId))
+    {
+        s->holeByteCount += skipped;
+        s->fileByteCount -= skipped;
+    }
+
+    spdlog::debug("tx file id {}: skipping {} bytes of holes in {} ranges."
+        , fileId
+        , skipped
+        , holes.size());
+}
+
+std::unique_ptr<TxSession::Link> TxSession::makeLink(int numaNode)
+{
+    auto link = std::make_unique<Link>();
+
+    auto poolOptions = conf_.poolOptions;
+    poolOptions.numaNode = numaNode;
+
+    link->cpus = numa::nodeCpus(numaNode);
+    link->readExec.setAffinity(link->cpus);
+    link->readExec.resize(std::max(conf_.readerCount, 1u));
+    link->readExec.setQueueSizeLimit(10);
+    link->readExec.setNotifier(&notifier_);
+    link->queue.setSizeLimit(100);
+    link->dispatcher = std::make_shared<Dispatcher>();
+
+    if (conf_.ioEngine == IoEngine::Uring)
+    {
+        // leave enough buffers for the senders to work on while a full
+        // queue depth of reads is in flight.
+        link->pool = BufferPool::make(BufSize, std::max<size_t>(35, 2 * conf_.ioDepth), poolOptions);
+        link->rings = std::make_shared<IoUringPool>(link->pool, conf_.ioDepth);
+    }
+    else
+    {
+        link->pool = BufferPool::make(BufSize, 35, poolOptions);
+    }
+
+    return link;
+}
+
+TxSession::Link &TxSession::linkFor(size_t stream)
+{
+    return *links_[links_.size() == 1 ? 0 : stream / conf_.streamCount];
+}
+
 }
@@ -0,0 +1,648 @@
+/**
+ * @file UringReceiver.cc
+ *
+ * Licensed under the MIT License <https://opensource.org/licenses/MIT>.
+ * SPDX-License-Identifier: MIT
+ * Copyright (c) 2022 Zachary Parker
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+
+#include <sys/socket.h>
+
+#include <spdlog/spdlog.h>
+
+#include <draft/util/ChunkCodec.hh>
+#include <draft/util/Stats.hh>
+#include <draft/util/UringReceiver.hh>
+
+#include "xxhash.h"
+
+namespace draft::util {
+
+namespace {
+
+constexpr auto PoolBufferCount = size_t{35};
+
+}
+
+UringReceiver::UringReceiver(std::vector<ScopedFd> listenFds, std::shared_ptr<FileTable> files, unsigned depth, const BufferPoolOptions &poolOptions):
+    files_(std::move(files))
+{
+    pool_ = BufferPool::make(BufSize, PoolBufferCount, poolOptions);
+
+    conns_.resize(listenFds.size());
+
+    for (size_t i = 0; i < listenFds.size(); ++i)
+        conns_[i].listenFd = std::move(listenFds[i]);
+
+    writes_.resize(PoolBufferCount);
+
+    // each connection has at most a payload recv and its linked write waiting
+    // for submission at once.
+    const auto entries = std::max(depth, static_cast<unsigned>(2 * conns_.size() + 2));
+    ring_ = std::make_unique<IoUring>(entries);
+
+    const auto region = pool_->region();
+
+    try {
+        ring_->registerBuffers(&region, 1);
+    } catch (const std::system_error &e) {
+        spdlog::warn("uring receiver: unable to register buffer pool ({}) - using unregistered buffers."
+            , e.what());
+    }
+}
+
+bool UringReceiver::runOnce(std::stop_token stopToken)
+{
+    using namespace std::chrono_literals;
+
+    // accepts are posted here, rather than in the constructor, so that the
+    // connection state has reached its final address before the kernel is
+    // given pointers into it.
+    if (!started_)
+    {
+        for (size_t i = 0; i < conns_.size(); ++i)
+            postAccept(conns_[i], i);
+
+        started_ = true;
+    }
+
+    // retry connections that stalled on an empty pool - completed writes may
+    // have returned buffers since.
+    for (size_t i = 0; i < conns_.size(); ++i)
+    {
+        if (conns_[i].state == Connection::State::AwaitBuffer)
+            postPayload(conns_[i], i);
+    }
+
+    // likewise, writes waiting for their files to be opened.
+    for (size_t i = 0; i < writes_.size(); ++i)
+    {
+        auto &write = writes_[i];
+
+        if (!write.awaitFile)
+            continue;
+
+        postWrites(write, i);
+
+        // every file was missing from a closed table.
+        if (!write.awaitFile && !write.pending)
+            release(write);
+    }
+
+    ring_->submitAndWait(100ms);
+    ring_->forEachCompletion([this](const auto &cqe) { handle(cqe); });
+
+    const auto open = std::any_of(
+        begin(conns_), end(conns_),
+        [](const auto &c) { return c.state != Connection::State::Closed; });
+
+    return !stopToken.stop_requested() && (open || activeWrites_);
+}
+
+void UringReceiver::handle(const IoUring::Cqe &cqe)
+{
+    const auto index = static_cast<size_t>(cqe.user_data >> 8);
+
+    switch (static_cast<Op>(cqe.user_data & 0xff))
+    {
+        case Op::Accept:
+            handleAccept(conns_[index], index, cqe.res);
+            break;
+        case Op::Header:
+            handleHeader(conns_[index], index, cqe.res);
+            break;
+        case Op::Payload:
+            handlePayload(conns_[index], index, cqe.res);
+            break;
+        case Op::Write:
+            handleWrite(index & 0xffff, index >> 16, cqe.res);
+            break;
+    }
+}
+
+void UringReceiver::handleAccept(Connection &conn, size_t index, int res)
+{
+    if (res < 0)
+    {
+        spdlog::error("accept on fd {}: {}", conn.listenFd.get(), std::strerror(-res));
+        conn.state = Connection::State::Closed;
+        return;
+    }
+
+    conn.fd = ScopedFd{res};
+    conn.offset = 0;
+
+    spdlog::info("accepted connection on fd {}", conn.fd.get());
+
+    postHeader(conn, index);
+}
+
+void UringReceiver::handleHeader(Connection &conn, size_t index, int res)
+{
+    if (res < 0)
+        throw std::system_error(-res, std::system_category(), "recv");
+
+    if (!res)
+    {
+        conn.fd = ScopedFd{ };
+        conn.state = Connection::State::Closed;
+        return;
+    }
+
+    conn.offset += static_cast<size_t>(res);
+
+    if (conn.offset < sizeof(conn.header))
+    {
+        postHeader(conn, index);
+        return;
+    }
+
+    if (conn.header.magic != wire::ChunkHeader::Magic)
+    {
+        spdlog::error(
+            "invalid header magic: {:x} - client fd {} - closing connection."
+            , conn.header.magic
+            , conn.fd.get());
+
+        conn.fd = ScopedFd{ };
+        postAccept(conn, index);
+
+        return;
+    }
+
+    if (conn.header.payloadLength > BufSize)
+    {
+        throw std::runtime_error(fmt::format(
+            "uring receiver: payload length {} exceeds buffer size"
+            , conn.header.payloadLength));
+    }
+
+    conn.offset = 0;
+
+    postPayload(conn, index);
+}
+
+void UringReceiver::handlePayload(Connection &conn, size_t index, int res)
+{
+    auto &write = writes_[conn.writeSlot];
+
+    if (res < 0)
+        throw std::system_error(-res, std::system_category(), "recv");
+
+    if (!res)
+    {
+        spdlog::warn("uring receiver: connection fd {} closed mid-chunk (file {} offset {})."
+            , conn.fd.get()
+            , write.fileId
+            , write.offset);
+
+        conn.fd = ScopedFd{ };
+        conn.state = Connection::State::Closed;
+
+        // any linked write was cancelled along with this recv.
+        write.abandoned = true;
+        if (!write.pending)
+            release(write);
+
+        return;
+    }
+
+    const auto len = static_cast<size_t>(res);
+
+    stats().netByteCount += len;
+
+    if (auto s = stats(write.fileId))
+        s->netByteCount += len;
+
+    conn.offset += len;
+
+    // a short recv cancels the linked write, so re-post the remainder along
+    // with a fresh write of the whole chunk.
+    if (conn.offset < write.len)
+    {
+        postPayload(conn, index);
+        return;
+    }
+
+    if (auto s = streamStats(static_cast<unsigned>(index)))
+        s->addChunk(write.len);
+
+    // compressed chunks aren't linked to a write - they're decompressed,
+    // then written, unless they're corrupt; nor are chunks whose files
+    // weren't open yet. a corrupt plain chunk has already gone to its
+    // linked write, and a packed chunk is written whole; their retransmits
+    // overwrite them.
+    const auto packed = (write.flags & wire::ChunkHeader::Packed) != 0;
+    const auto corrupt = verify(write);
+
+    completeChunk(write, corrupt);
+
+    write.received = true;
+
+    if (writesEnabled_ && (packed || (!write.linked && corrupt.empty())))
+        postWrites(write, conn.writeSlot);
+
+    if (!write.pending && !write.awaitFile)
+    {
+        // nothing was linked (writes are disabled or there's no file), or
+        // the write has already completed.
+        if (!writesEnabled_)
+            finishWrite(write, write.len);
+
+        release(write);
+    }
+
+    conn.offset = 0;
+
+    postHeader(conn, index);
+}
+
+void UringReceiver::handleWrite(size_t slot, size_t segment, int res)
+{
+    auto &write = writes_[slot];
+    auto &seg = write.segments[segment];
+
+    --write.pending;
+
+    if (res == -ECANCELED)
+    {
+        if (write.abandoned && !write.pending)
+            release(write);
+
+        return;
+    }
+
+    if (res < 0)
+        throw std::system_error(-res, std::system_category(), "pwrite");
+
+    if (!res)
+    {
+        throw std::runtime_error(fmt::format(
+            "uring receiver: no progress writing file id {} offset {}"
+            , write.fileId
+            , seg.fileOffset + seg.done));
+    }
+
+    seg.done += static_cast<size_t>(res);
+
+    // a short write is posted again from where it stopped.
+    if (seg.done < seg.len)
+    {
+        postSegment(getSqe(), write, slot, segment);
+        return;
+    }
+
+    finishWrite(write, seg.len);
+
+    if (write.received && !write.pending)
+        release(write);
+}
+
+void UringReceiver::postWrites(PendingWrite &write, size_t slot)
+{
+    if (write.flags & wire::ChunkHeader::Packed)
+        postPackedWrites(write, slot);
+    else
+        postWrite(write, slot);
+}
+
+void UringReceiver::postPackedWrites(PendingWrite &write, size_t slot)
+{
+    // files are opened in the background, and this thread mustn't wait for
+    // them - the whole chunk waits until all of its files are open.
+    write.awaitFile = false;
+
+    forEachPacked(write.buf.uint8Data(), write.len,
+        [&](unsigned fileId, const uint8_t *, size_t) {
+            write.awaitFile = write.awaitFile || !getFd(fileId);
+        });
+
+    if (write.awaitFile)
+        return;
+
+    // one write per file, all in the same submission.
+    forEachPacked(write.buf.uint8Data(), write.len,
+        [&](unsigned fileId, const uint8_t *data, size_t len) {
+            const auto fd = *getFd(fileId);
+
+            if (fd < 0)
+            {
+                spdlog::error("no mapped fd for file id {}"
+                    , fileId);
+
+                return;
+            }
+
+            write.segments.push_back({
+                fd,
+                static_cast<size_t>(data - write.buf.uint8Data()),
+                roundBlockSize(len),
+                0});
+
+            postSegment(getSqe(), write, slot, write.segments.size() - 1);
+        });
+}
+
+void UringReceiver::postWrite(PendingWrite &write, size_t slot)
+{
+    const auto file = getFd(write.fileId);
+
+    // tried again from runOnce() until the file is open.
+    write.awaitFile = !file;
+
+    if (write.awaitFile)
+        return;
+
+    const auto fd = *file;
+
+    if (fd < 0)
+    {
+        spdlog::error("no mapped fd for file id {}"
+            , write.fileId);
+
+        return;
+    }
+
+    write.segments.push_back({fd, 0, roundBlockSize(write.len), write.offset});
+
+    postSegment(getSqe(), write, slot, write.segments.size() - 1);
+}
+
+void UringReceiver::postSegment(IoUring::Sqe *sqe, PendingWrite &write, size_t slot, size_t segment)
+{
+    const auto &seg = write.segments[segment];
+    const auto data = write.buf.uint8Data() + seg.bufOffset + seg.done;
+
+    if (ring_->registeredBufferCount())
+        IoUring::prepWriteFixed(sqe, seg.fd, data, seg.len - seg.done, seg.fileOffset + seg.done, 0);
+    else
+        IoUring::prepWrite(sqe, seg.fd, data, seg.len - seg.done, seg.fileOffset + seg.done);
+
+    sqe->user_data = writeData(slot, segment);
+
+    ++write.pending;
+}
+
+void UringReceiver::decompress(PendingWrite &write)
+{
+    if (write.codec != wire::ChunkHeader::Blosc2)
+    {
+        throw std::runtime_error(fmt::format(
+            "uring receiver: unknown chunk codec {}", write.codec));
+    }
+
+    ChunkCodec::local().decompress(
+        write.buf.uint8Data(), write.len, write.rawLen, write.buf.size());
+
+    write.len = write.rawLen;
+    write.codec = wire::ChunkHeader::Raw;
+}
+
+std::vector<ChunkRange> UringReceiver::verify(PendingWrite &write)
+{
+    const auto digested = (write.flags & wire::ChunkHeader::Digest) != 0;
+    const auto packed = (write.flags & wire::ChunkHeader::Packed) != 0;
+
+    auto corrupt = std::vector<ChunkRange>{ };
+
+    try
+    {
+        if (write.codec != wire::ChunkHeader::Raw)
+            decompress(write);
+
+        if (digested)
+        {
+            auto desc = BDesc{write.buf, write.fileId, write.offset, write.len, write.flags};
+
+            corrupt = verifyChunk(desc, write.digest);
+
+            // keep what was computed, for the journal.
+            write.digest = desc.digest;
+            write.hashed = desc.hashed;
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        // a plain chunk that won't decompress is sent again like any other.
+        if (!digested || packed)
+            throw;
+
+        spdlog::warn("uring receiver: {}", e.what());
+
+        corrupt = {{write.fileId, write.offset, write.rawLen}};
+    }
+
+    if (corrupt.empty())
+        return corrupt;
+
+    if (!retransmits_)
+    {
+        throw std::runtime_error(fmt::format(
+            "chunk digest mismatch: file id {} offset {}"
+            , corrupt.front().fileId
+            , corrupt.front().offset));
+    }
+
+    retransmits_->add(corrupt);
+
+    return corrupt;
+}
+
+void UringReceiver::postAccept(Connection &conn, size_t index)
+{
+    conn.state = Connection::State::Accept;
+
+    auto sqe = getSqe();
+    IoUring::prepAccept(sqe, conn.listenFd.get());
+    sqe->user_data = userData(Op::Accept, index);
+}
+
+void UringReceiver::postHeader(Connection &conn, size_t index)
+{
+    conn.state = Connection::State::Header;
+
+    auto sqe = getSqe();
+
+    IoUring::prepRecv(
+        sqe,
+        conn.fd.get(),
+        reinterpret_cast<uint8_t *>(&conn.header) + conn.offset,
+        sizeof(conn.header) - conn.offset,
+        0);
+
+    sqe->user_data = userData(Op::Header, index);
+}
+
+bool UringReceiver::postPayload(Connection &conn, size_t index)
+{
+    using Clock = std::chrono::steady_clock;
+
+    if (conn.state != Connection::State::Payload)
+    {
+        auto buf = pool_->get(Clock::now());
+
+        if (!buf)
+        {
+            conn.state = Connection::State::AwaitBuffer;
+            return false;
+        }
+
+        auto slot = std::find_if(
+            begin(writes_), end(writes_),
+            [](const auto &w) { return !w.buf; });
+
+        const auto packed = (conn.header.flags & wire::ChunkHeader::Packed) != 0;
+
+        *slot = PendingWrite{
+            std::move(buf),
+            conn.header.fileOffset,
+            conn.header.payloadLength,
+            packed ? PackedFileId : conn.header.fileId,
+            conn.header.flags,
+            conn.header.codec,
+            conn.header.rawLength,
+            conn.header.digest
+        };
+
+        ++activeWrites_;
+
+        conn.writeSlot = static_cast<size_t>(slot - begin(writes_));
+        conn.state = Connection::State::Payload;
+    }
+
+    auto &write = writes_[conn.writeSlot];
+
+    // packed & compressed chunks are written once they're all in, as are
+    // chunks for files that aren't open yet - waiting for them here would
+    // hold up every connection.
+    const auto deferred = (write.flags & wire::ChunkHeader::Packed) != 0
+        || write.codec != wire::ChunkHeader::Raw;
+    const auto fd = writesEnabled_ && !deferred ? getFd(write.fileId).value_or(-1) : -1;
+
+    write.linked = fd >= 0;
+
+    // the recv & its linked write must go out in the same submission.
+    if (ring_->sqSpace() < 2)
+        ring_->submit();
+
+    auto sqe = getSqe();
+
+    // MSG_WAITALL makes a short recv fail the link, rather than writing a
+    // partially received chunk.
+    IoUring::prepRecv(
+        sqe,
+        conn.fd.get(),
+        write.buf.uint8Data() + conn.offset,
+        write.len - conn.offset,
+        MSG_WAITALL);
+
+    sqe->user_data = userData(Op::Payload, index);
+
+    if (fd < 0)
+        return true;
+
+    sqe->flags |= IOSQE_IO_LINK;
+
+    // a write cancelled by a short recv is replaced, not resumed.
+    write.segments.push_back({fd, 0, roundBlockSize(write.len), write.offset});
+
+    postSegment(getSqe(), write, conn.writeSlot, write.segments.size() - 1);
+
+    return true;
+}
+
+void UringReceiver::completeChunk(const PendingWrite &write, const std::vector<ChunkRange> &corrupt)
+{
+    spdlog::trace("uring receiver got {} -> id {}"
+        , write.len
+        , write.fileId);
+
+    // corrupt data isn't journaled; verified packed files are journaled
+    // with the digests they were checked against.
+    if (hashLog_ && (write.flags & wire::ChunkHeader::Packed))
+    {
+        const auto verified = (write.flags & wire::ChunkHeader::Digest) != 0;
+
+        forEachPacked(write.buf.uint8Data(), write.len,
+            [this, verified, &corrupt](unsigned fileId, const uint8_t *data, size_t len, uint64_t digest) {
+                if (isCorrupt(corrupt, fileId))
+                    return;
+
+                hashLog_->writeHash(
+                    static_cast<uint16_t>(fileId), 0, len, verified ? digest : XXH3_64bits(data, len));
+            });
+    }
+    else if (hashLog_ && corrupt.empty())
+    {
+        const auto digest = write.hashed ?
+            write.digest :
+            XXH3_64bits(write.buf.data(), write.len);
+
+        hashLog_->writeHash(
+            static_cast<uint16_t>(write.fileId), write.offset, write.len, digest);
+    }
+
+    ++stats().queuedBlockCount;
+
+    if (auto s = stats(write.fileId))
+        ++s->queuedBlockCount;
+}
+
+void UringReceiver::finishWrite(const PendingWrite &write, size_t len)
+{
+    ++stats().dequeuedBlockCount;
+    stats().diskByteCount += len;
+
+    if (auto s = stats(write.fileId))
+    {
+        ++s->dequeuedBlockCount;
+        s->diskByteCount += len;
+    }
+}
+
+void UringReceiver::release(PendingWrite &write)
+{
+    write = PendingWrite{ };
+    --activeWrites_;
+}
+
+IoUring::Sqe *UringReceiver::getSqe()
+{
+    if (auto sqe = ring_->getSqe())
+        return sqe;
+
+    ring_->submit();
+
+    if (auto sqe = ring_->getSqe())
+        return sqe;
+
+    throw std::runtime_error("uring receiver: submission queue is full");
+}
+
+std::optional<int> UringReceiver::getFd(unsigned id) const
+{
+    return files_->tryFd(id);
+}
+
+}
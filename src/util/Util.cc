@@ -42,8 +42,11 @@
 
 #include <spdlog/spdlog.h>
 
+#include <draft/util/FileScanner.hh>
 #include <draft/util/Util.hh>
 
+#include "xxhash.h"
+
 namespace fs = std::filesystem;
 
 namespace draft::util {
@@ -99,6 +102,10 @@ size_t iovOp(int fd, const struct iovec *iovs, size_t iovlen, ssize_t (*op)(int,
                 errno, std::system_category(), "network::iovOp::read");
         }
 
+        // (only reads come up short; without this, eof would spin.)
+        if (!len)
+            throw std::runtime_error("network::iovOp: connection closed");
+
         total += static_cast<size_t>(len);
 
         while (len > 0)
@@ -284,15 +291,13 @@ std::vector<FileInfo> getFileInfo(const std::string &path)
     }
 
     auto infos = std::vector<FileInfo>{ };
+    auto scanner = FileScanner{path};
 
-    for (const auto &dentry : fs::recursive_directory_iterator(path))
+    for (auto batch = scanner.next(); !batch.empty(); batch = scanner.next())
     {
-        auto info = fileInfo(dentry);
-
-        if (!dentry.is_directory())
-            info.id = ++fileId;
-
-        infos.push_back(std::move(info));
+        infos.insert(end(infos),
+            std::make_move_iterator(begin(batch)),
+            std::make_move_iterator(end(batch)));
     }
 
     return infos;
@@ -340,44 +345,105 @@ size_t parseSize(const std::string &str)
     return sz;
 }
 
-void createTargetFiles(const std::string &root, const std::vector<FileInfo> &infos)
+std::vector<Segment> splitSegments(size_t fileSize, size_t segmentSize)
 {
-    namespace fs = std::filesystem;
+    const auto step = segmentSize ?
+        (segmentSize + BufSize - 1) / BufSize * BufSize :
+        fileSize;
 
-    for (const auto &info : infos)
-    {
-        if (S_ISDIR(info.status.mode))
-            continue;
+    auto segments = std::vector<Segment>{ };
 
-        auto path = rootedPath(root, info.path, info.targetSuffix);
-        spdlog::info("createTargetFiles: create file {}: '{}'", info.id, path.string());
+    for (size_t offset = 0; offset < fileSize; offset += step)
+        segments.push_back({offset, std::min(step, fileSize - offset)});
 
-        fs::create_directories(util::dirname(path));
+    return segments;
+}
+
+std::vector<Segment> subtractSegments(const std::vector<Segment> &segments, const std::vector<Segment> &completed)
+{
+    auto missing = std::vector<Segment>{ };
 
-        if (const auto max = static_cast<size_t>(std::numeric_limits<off_t>::max());
-            info.status.size > max)
+    for (auto seg : segments)
+    {
+        const auto segEnd = seg.offset + seg.len;
+
+        for (const auto &done : completed)
         {
-            throw std::runtime_error(fmt::format(
-                "createTargetFiles: file '{}' is too large for off_t (limit: {})"
-                , info.path
-                , max));
-        }
+            const auto doneEnd = done.offset + done.len;
 
-        auto fd = ScopedFd{::open(path.c_str(), O_RDWR | O_CREAT, info.status.mode & 0777)};
-        if (fd.get() < 0)
-            throw std::system_error(errno, std::system_category(), "createTargetFiles: open");
+            if (doneEnd <= seg.offset || done.offset >= segEnd)
+                continue;
 
-        if (!info.status.size)
-            continue;
+            if (done.offset > seg.offset)
+                missing.push_back({seg.offset, done.offset - seg.offset});
 
-        // allocate space for this file.
-        // this can take a while for large files.
-        if (auto stat = posix_fallocate(fd.get(), 0, static_cast<off_t>(info.status.size)))
-        {
-            spdlog::error("posix fallocate err {}", stat);
-            throw std::system_error(stat, std::system_category(), "createTargetFiles: posix_fallocate");
+            seg.offset = std::min(doneEnd, segEnd);
         }
+
+        if (seg.offset < segEnd)
+            missing.push_back({seg.offset, segEnd - seg.offset});
     }
+
+    return missing;
+}
+
+std::vector<Segment> findHoles(int fd, size_t fileSize)
+{
+    const auto size = static_cast<off_t>(std::min(
+        fileSize,
+        static_cast<size_t>(std::numeric_limits<off_t>::max())));
+
+    const auto chunk = static_cast<off_t>(BufSize);
+
+    auto holes = std::vector<Segment>{ };
+    auto offset = off_t{ };
+
+    while (offset < size)
+    {
+        const auto hole = ::lseek(fd, offset, SEEK_HOLE);
+
+        if (hole < 0 && errno == ENXIO)
+            break;
+
+        if (hole < 0)
+            throw std::system_error(errno, std::system_category(), "findHoles: lseek (SEEK_HOLE)");
+
+        if (hole >= size)
+            break;
+
+        auto data = ::lseek(fd, hole, SEEK_DATA);
+
+        // no more data - the hole runs to eof.
+        if (data < 0 && errno == ENXIO)
+            data = size;
+        else if (data < 0)
+            throw std::system_error(errno, std::system_category(), "findHoles: lseek (SEEK_DATA)");
+
+        const auto first = (hole + chunk - 1) / chunk * chunk;
+        const auto last = data == size ? size : data / chunk * chunk;
+
+        if (first < last)
+            holes.push_back({static_cast<size_t>(first), static_cast<size_t>(last - first)});
+
+        offset = data;
+    }
+
+    return holes;
+}
+
+uint64_t packedTableDigest(const uint8_t *payload, size_t payloadLen)
+{
+    if (payloadLen < sizeof(wire::PackedTable))
+        return XXH3_64bits(payload, payloadLen);
+
+    const auto table = reinterpret_cast<const wire::PackedTable *>(payload);
+
+    // a corrupt count only changes what's hashed, which won't match.
+    const auto len = std::min(
+        payloadLen,
+        sizeof(wire::PackedTable) + size_t{table->count} * sizeof(wire::PackedEntry));
+
+    return XXH3_64bits(payload, len);
 }
 
 std::string dirname(std::string path)
@@ -692,26 +758,43 @@ std::string peerName(int fd)
 
 }
 
-std::vector<ScopedFd> connectNetworkTargets(const std::vector<NetworkTarget> &targets)
+std::vector<ScopedFd> connectNetworkTargets(const std::vector<NetworkTarget> &targets, unsigned streams)
 {
-    const auto view = std::views::transform(
-        targets,
-        [](const NetworkTarget &t) {
-            return net::connectTcp(t.ip, t.port);
-        });
+    auto fds = std::vector<ScopedFd>{ };
+
+    for (const auto &t : targets)
+    {
+        for (unsigned i = 0; i < streams; ++i)
+            fds.push_back(net::connectTcp(t.ip, t.port));
+    }
 
-    return {begin(view), end(view)};
+    return fds;
 }
 
-std::vector<ScopedFd> bindNetworkTargets(const std::vector<NetworkTarget> &targets)
+std::vector<ScopedFd> bindNetworkTargets(const std::vector<NetworkTarget> &targets, unsigned streams)
 {
-    const auto view = std::views::transform(
-        targets,
-        [](const NetworkTarget &t) {
-            return net::bindTcp(t.ip, t.port);
-        });
+    auto fds = std::vector<ScopedFd>{ };
+
+    // a target's streams are all accepted from its one listening socket,
+    // through an fd per stream.
+    for (const auto &t : targets)
+    {
+        const auto first = fds.size();
+
+        fds.push_back(net::bindTcp(t.ip, t.port, std::max(streams, 1u)));
+
+        for (unsigned i = 1; i < streams; ++i)
+        {
+            auto fd = ScopedFd{::fcntl(fds[first].get(), F_DUPFD_CLOEXEC, 0)};
+
+            if (fd.get() < 0)
+                throw std::system_error(errno, std::system_category(), "bindNetworkTargets: dup");
+
+            fds.push_back(std::move(fd));
+        }
+    }
 
-    return {begin(view), end(view)};
+    return fds;
 }
 
 }
@@ -75,12 +75,12 @@ void from_json(const nlohmann::json &j, FileInfo &info)
     j.at("id").get_to(info.id);
 }
 
-Buffer generateTransferRequestMsg(std::vector<FileInfo> info)
+Buffer generateManifestMsg(const std::vector<FileInfo> &info, bool last)
 {
     auto j = nlohmann::json{ };
-    j["type"] = 0;
-    j["client"] = 0;
+    j["type"] = 2;
     j["info"] = info;
+    j["last"] = last;
 
     auto buf = std::vector<uint8_t>{ };
     buf.resize(sizeof(wire::ChunkHeader));
@@ -94,27 +94,155 @@ Buffer generateTransferRequestMsg(std::vector<FileInfo> info)
     return buf;
 }
 
-TransferRequest deserializeTransferRequest(const Buffer &buf)
+ManifestBatch deserializeManifestMsg(const uint8_t *data, size_t len)
 {
-    return deserializeTransferRequest(buf.vector());
+    const auto j = nlohmann::json::from_cbor(data, data + len);
+
+    if (j.at("type").get<int>() != 2)
+        throw std::runtime_error(fmt::format("unexpected message type: {}", j.at("type").dump()));
+
+    auto batch = ManifestBatch{ };
+    j.at("info").get_to(batch.info);
+    j.at("last").get_to(batch.last);
+
+    return batch;
 }
 
-TransferRequest deserializeTransferRequest(const std::vector<uint8_t> &buf)
+Buffer generateResumeMsg(const ResumeInfo &info)
 {
-    if (buf.size() < wire::UnalignedChunkHeaderSize)
+    auto files = nlohmann::json::array();
+
+    for (const auto &[id, ranges] : info.completed)
+    {
+        auto j = nlohmann::json::array();
+
+        for (const auto &range : ranges)
+            j.push_back({range.offset, range.len});
+
+        files.push_back({{"id", id}, {"ranges", std::move(j)}});
+    }
+
+    auto j = nlohmann::json{ };
+    j["type"] = 1;
+    j["completed"] = std::move(files);
+    j["streaming"] = info.streaming;
+
+    if (!info.digests.empty())
+    {
+        auto digests = nlohmann::json::array();
+
+        for (const auto &[id, chunks] : info.digests)
+        {
+            auto c = nlohmann::json::array();
+
+            for (const auto &[offset, hash] : chunks)
+                c.push_back({offset, hash});
+
+            digests.push_back({{"id", id}, {"chunks", std::move(c)}});
+        }
+
+        j["digests"] = std::move(digests);
+    }
+
+    auto buf = std::vector<uint8_t>{ };
+    buf.resize(sizeof(wire::ChunkHeader));
+
+    nlohmann::json::to_cbor(j, buf);
+
+    auto header = reinterpret_cast<wire::ChunkHeader *>(buf.data());
+    header->magic = wire::ChunkHeader::Magic;
+    header->payloadLength = buf.size() - sizeof(wire::ChunkHeader);
+
+    return buf;
+}
+
+ResumeInfo deserializeResumeMsg(const std::vector<uint8_t> &buf)
+{
+    if (buf.size() < sizeof(wire::ChunkHeader))
+        throw std::invalid_argument(fmt::format("resume message is too short: {}", buf.size()));
+
+    const auto header = reinterpret_cast<const wire::ChunkHeader *>(buf.data());
+
+    if (header->magic != wire::ChunkHeader::Magic)
+        throw std::runtime_error("invalid resume message magic");
+
+    if (sizeof(*header) + header->payloadLength > buf.size())
+    {
+        throw std::runtime_error(
+            "invalid resume message length: " + std::to_string(header->payloadLength));
+    }
+
+    const auto first = buf.data() + sizeof(*header);
+    const auto j = nlohmann::json::from_cbor(first, first + header->payloadLength);
+
+    auto info = ResumeInfo{ };
+
+    if (j.contains("streaming"))
+        j["streaming"].get_to(info.streaming);
+
+    for (const auto &file : j.at("completed"))
+    {
+        auto &ranges = info.completed[file.at("id").get<unsigned>()];
+
+        for (const auto &range : file.at("ranges"))
+            ranges.push_back({range.at(0).get<size_t>(), range.at(1).get<size_t>()});
+    }
+
+    if (!j.contains("digests"))
+        return info;
+
+    for (const auto &file : j.at("digests"))
     {
-        throw std::invalid_argument(fmt::format("request buffer is too short to contain a valid request: {}/{}"
-            , buf.size()
-            , sizeof(wire::ChunkHeader)));
+        auto &chunks = info.digests[file.at("id").get<unsigned>()];
+
+        for (const auto &chunk : file.at("chunks"))
+            chunks[chunk.at(0).get<size_t>()] = chunk.at(1).get<uint64_t>();
     }
 
-    const auto j = nlohmann::json::from_cbor(buf);
-    spdlog::info("req: {}", j.dump(4));
+    return info;
+}
+
+Buffer generateRetransmitMsg(const std::vector<ChunkRange> &chunks)
+{
+    auto c = nlohmann::json::array();
 
-    auto req = TransferRequest{ };
-    j.at("info").get_to(req.config.fileInfo);
+    for (const auto &chunk : chunks)
+        c.push_back({chunk.fileId, chunk.offset, chunk.len});
+
+    auto j = nlohmann::json{ };
+    j["type"] = 3;
+    j["chunks"] = std::move(c);
+
+    auto buf = std::vector<uint8_t>{ };
+    buf.resize(sizeof(wire::ChunkHeader));
+
+    nlohmann::json::to_cbor(j, buf);
+
+    auto header = reinterpret_cast<wire::ChunkHeader *>(buf.data());
+    header->magic = wire::ChunkHeader::Magic;
+    header->payloadLength = buf.size() - sizeof(wire::ChunkHeader);
+
+    return buf;
+}
+
+std::vector<ChunkRange> deserializeRetransmitMsg(const uint8_t *data, size_t len)
+{
+    const auto j = nlohmann::json::from_cbor(data, data + len);
+
+    if (j.at("type").get<int>() != 3)
+        throw std::runtime_error(fmt::format("unexpected message type: {}", j.at("type").dump()));
+
+    auto chunks = std::vector<ChunkRange>{ };
+
+    for (const auto &chunk : j.at("chunks"))
+    {
+        chunks.push_back({
+            chunk.at(0).get<unsigned>(),
+            chunk.at(1).get<size_t>(),
+            chunk.at(2).get<size_t>()});
+    }
 
-    return req;
+    return chunks;
 }
 
 }
@@ -24,8 +24,10 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
 #include <filesystem>
 #include <iterator>
+#include <thread>
 
 #include <sys/stat.h>
 
@@ -41,8 +43,10 @@ namespace draft::util {
 VerifySession::VerifySession(Config conf):
     conf_(std::move(conf))
 {
-    readExec_.resize(1);
+    readExec_.resize(std::max(conf_.readerCount, 1u));
     readExec_.setQueueSizeLimit(10);
+    readExec_.setNotifier(&notifier_);
+    hashExec_.setNotifier(&notifier_);
 
     hashQueue_.setSizeLimit(100);
 
@@ -67,16 +71,7 @@ void VerifySession::start(const Journal &inputJournal)
     info_ = inputJournal.fileInfo();
     journal_ = Journal{journalFile_.fd(), journalFile_.path(), info_};
 
-    // hashers are in a separate executor to make it easier to tell when read
-    // execs finish.
-    for (int i = 0; i < 2; ++i)
-    {
-        hashExec_.add(
-            util::Hasher{
-                hashQueue_,
-                [this](const auto &digest) { handleHash(digest); }},
-            ThreadExecutor::Options::DoFinalize);
-    }
+    startHashers();
 
     fileIter_ = nextFile(begin(info_), end(info_));
 
@@ -94,16 +89,7 @@ void VerifySession::start(std::vector<FileInfo> fileInfo)
     info_ = std::move(fileInfo);
     journal_ = Journal{journalFile_.fd(), journalFile_.path(), info_};
 
-    // hashers are in a separate executor to make it easier to tell when read
-    // execs finish.
-    for (int i = 0; i < 2; ++i)
-    {
-        hashExec_.add(
-            util::Hasher{
-                hashQueue_,
-                [this](const auto &digest) { handleHash(digest); }},
-            ThreadExecutor::Options::DoFinalize);
-    }
+    startHashers();
 
     fileIter_ = nextFile(begin(info_), end(info_));
 
@@ -174,11 +160,39 @@ std::optional<Journal> VerifySession::releaseJournal() &&
     if (!hashExec_.finished())
         return std::nullopt;
 
-    journalFile_.releaseFd();
+    // the journal owns the descriptor from here on.
+    static_cast<void>(journalFile_.releaseFd().release());
 
     return std::move(journal_);
 }
 
+void VerifySession::startHashers()
+{
+    auto count = conf_.hasherCount;
+
+    // xxh3 hashes several times faster than a reader reads, so a hasher
+    // per couple of readers keeps up - but always have two, so one busy
+    // hasher doesn't stall the readers, and never more than the cpus.
+    if (!count)
+    {
+        const auto cpus = std::max(std::thread::hardware_concurrency(), 1u);
+        count = std::clamp((conf_.readerCount + 1) / 2, std::min(2u, cpus), cpus);
+    }
+
+    spdlog::debug("verify session: {} hashers", count);
+
+    // hashers are in a separate executor to make it easier to tell when read
+    // execs finish.
+    for (unsigned i = 0; i < count; ++i)
+    {
+        hashExec_.add(
+            util::Hasher{
+                hashQueue_,
+                [this](const auto &digest) { handleHash(digest); }},
+            ThreadExecutor::Options::DoFinalize);
+    }
+}
+
 VerifySession::file_info_iter_type VerifySession::nextFile(file_info_iter_type first, file_info_iter_type last)
 {
     while (first != last && (!S_ISREG(first->status.mode) || !first->status.size))
@@ -189,43 +203,51 @@ VerifySession::file_info_iter_type VerifySession::nextFile(file_info_iter_type f
 
 bool VerifySession::startFile(const FileInfo &info)
 {
-    using namespace std::chrono_literals;
-
-    using Clock = std::chrono::steady_clock;
-
     const auto &filename = info.path;
     auto flags = O_RDONLY;
 
     if (conf_.useDirectIO)
         flags |= O_DIRECT;
 
-    auto fd = std::make_shared<ScopedFd>(
-        ScopedFd{::open(filename.c_str(), flags)});
+    // a file may take several calls to submit all of its segments, so
+    // hold on to its fd & remaining segments between calls.
+    if (!segmentFd_)
+    {
+        segmentFd_ = std::make_shared<ScopedFd>(
+            ScopedFd{::open(filename.c_str(), flags)});
 
-    spdlog::debug("verifier opened file id {}: {} @ fd {}", info.id, filename, fd->get());
+        spdlog::debug("verifier opened file id {}: {} @ fd {}", info.id, filename, segmentFd_->get());
 
-    auto fileSz = std::filesystem::file_size(filename);
+        const auto fileSz = std::filesystem::file_size(filename);
 
-    // try for a while to submit this reader.
-    // we may time-out here if the network is bottlenecking things.
-    const auto deadline = Clock::now() + 50ms;
-    while (!readExec_.cancelled() && Clock::now() < deadline)
+        segments_ = splitSegments(fileSz, conf_.segmentSize);
+        nextSegment_ = 0;
+    }
+
+    // submit readers for the remaining segments until the read queue fills
+    // up. reader progress wakes the session to submit the rest.
+    while (!readExec_.cancelled())
     {
-        const auto rateDeadline = Clock::now() + 1ms;
+        if (nextSegment_ == segments_.size())
+        {
+            segmentFd_.reset();
+            return true;
+        }
 
-        auto diskRead = Reader(fd, info.id, {0, fileSz}, pool_, nullptr);
+        auto diskRead = Reader(segmentFd_, info.id, segments_[nextSegment_], pool_, nullptr);
         diskRead.setHashQueue(hashQueue_);
 
         if (auto future = readExec_.launch(std::move(diskRead)))
         {
             readResults_.push_back(std::move(*future));
-            return true;
+            ++nextSegment_;
+            continue;
         }
 
-        std::this_thread::sleep_until(rateDeadline);
+        break;
     }
 
-    spdlog::debug("start file {}: timed-out, will resubmit later on."
+    spdlog::trace("start file {}: read queue full, will resubmit later on."
         , filename);
 
     return false;
@@ -31,9 +31,9 @@
 
 namespace draft::util {
 
-Writer::Writer(FdMap fdMap, BufQueue &queue):
+Writer::Writer(std::shared_ptr<FileTable> files, BufQueue &queue):
     queue_(&queue),
-    fdMap_(std::move(fdMap))
+    files_(std::move(files))
 {
 }
     
@@ -41,7 +41,9 @@ bool Writer::runOnce(std::stop_token stopToken)
 {
     using namespace std::chrono_literals;
 
-    while (auto desc = queue_->get(100ms))
+    using Clock = std::chrono::steady_clock;
+
+    while (auto desc = queue_->get(Clock::now() + 100ms, stopToken))
     {
         if (!desc->buf)
             break;
@@ -66,15 +68,14 @@ bool Writer::runOnce(std::stop_token stopToken)
 
 int Writer::getFd(unsigned id)
 {
-    auto iter = fdMap_.find(id);
-    if (iter == end(fdMap_))
-        return -1;
-
-    return iter->second;
+    return files_->fd(id);
 }
 
 size_t Writer::write(BDesc desc)
 {
+    if (desc.flags & wire::ChunkHeader::Packed)
+        return writePacked(desc);
+
     const auto fd = getFd(desc.fileId);
 
     if (fd < 0)
@@ -86,7 +87,7 @@ size_t Writer::write(BDesc desc)
     }
 
     iovec iov{
-        desc.buf->data(),
+        desc.buf.data(),
         roundBlockSize(desc.len)
     };
 
@@ -97,4 +98,35 @@ size_t Writer::write(BDesc desc)
     return writeChunk(fd, &iov, 1, desc.offset);
 }
 
+size_t Writer::writePacked(const BDesc &desc)
+{
+    auto total = size_t{ };
+
+    // each file's data is block aligned in the chunk, so it's written in
+    // place.
+    forEachPacked(desc.buf.uint8Data(), desc.len,
+        [this, &total](unsigned fileId, const uint8_t *data, size_t len) {
+            const auto fd = getFd(fileId);
+
+            if (fd < 0)
+            {
+                spdlog::error("no mapped fd for file id {}"
+                    , fileId);
+
+                return;
+            }
+
+            auto iov = iovec{const_cast<uint8_t *>(data), roundBlockSize(len)};
+
+            const auto written = writeChunk(fd, &iov, 1, 0);
+
+            if (auto s = stats(fileId))
+                s->diskByteCount += written;
+
+            total += written;
+        });
+
+    return total;
+}
+
 }
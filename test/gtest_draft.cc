@@ -25,23 +25,52 @@
 
 #include <gtest/gtest.h>
 
+#include <atomic>
 #include <chrono>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <future>
+#include <numeric>
+#include <random>
 #include <ranges>
 #include <regex>
 #include <string>
+#include <thread>
 
 #include <strings.h>
+#include <arpa/inet.h>
 #include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include <spdlog/spdlog.h>
 
+#include <draft/util/ChunkCodec.hh>
+#include <draft/util/Dispatcher.hh>
+#include <draft/util/FileScanner.hh>
+#include <draft/util/FileTable.hh>
+#include <draft/util/InfoReceiver.hh>
+#include <draft/util/IoUring.hh>
+#include <draft/util/Journal.hh>
+#include <draft/util/Notifier.hh>
+#include <draft/util/Numa.hh>
+#include <draft/util/PackedReader.hh>
 #include <draft/util/PollSet.hh>
+#include <draft/util/Reader.hh>
+#include <draft/util/Receiver.hh>
+#include <draft/util/Retransmit.hh>
+#include <draft/util/RingQueue.hh>
 #include <draft/util/ScopedTempFile.hh>
+#include <draft/util/Sender.hh>
+#include <draft/util/Stats.hh>
+#include <draft/util/TaskPool.hh>
 #include <draft/util/Util.hh>
+#include <draft/util/UringReceiver.hh>
+#include <draft/util/UtilJson.hh>
+#include <draft/util/Writer.hh>
+
+#include "xxhash.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 // Util
@@ -336,6 +365,83 @@ TEST(buffer_pool, buf_move_assign)
     EXPECT_EQ(*buf2.uint8Data(), 0x42);
 }
 
+TEST(buffer_pool, buf_copy)
+{
+    auto pool = BufferPool::make(64, 1);
+
+    auto buf = pool->get();
+    ASSERT_TRUE(buf);
+    EXPECT_EQ(buf.useCount(), 1u);
+
+    {
+        auto buf2 = buf;
+        EXPECT_EQ(buf.useCount(), 2u);
+        EXPECT_EQ(buf2.data(), buf.data());
+    }
+
+    EXPECT_EQ(buf.useCount(), 1u);
+
+    // still held, so the pool is empty.
+    EXPECT_FALSE(pool->get(std::chrono::steady_clock::now()));
+
+    auto buf3 = BufferPool::Buffer{ };
+    buf3 = buf;
+    buf.reset();
+
+    EXPECT_FALSE(buf);
+    EXPECT_EQ(buf3.useCount(), 1u);
+    EXPECT_FALSE(pool->get(std::chrono::steady_clock::now()));
+
+    buf3.reset();
+    EXPECT_TRUE(pool->get(std::chrono::steady_clock::now()));
+}
+
+TEST(buffer_pool, outlives_owner)
+{
+    auto pool = BufferPool::make(64, 2);
+    auto buf = pool->get();
+
+    pool.reset();
+
+    // the mapping stays valid until the last buffer is released.
+    std::memset(buf.data(), 0x42, buf.size());
+    EXPECT_EQ(buf.uint8Data()[63], 0x42);
+}
+
+TEST(buffer_pool, hugepages)
+{
+    using draft::util::HugePages;
+
+    // explicit huge pages are rarely reserved - either way the pool must
+    // come up usable, with the backing reporting what was actually used.
+    for (auto pages : {HugePages::Transparent, HugePages::Huge2M, HugePages::Huge1G})
+    {
+        auto pool = BufferPool::make(4096, 16, {.hugePages = pages, .lock = true});
+
+        EXPECT_TRUE(pool->backing() == pages
+            || pool->backing() == HugePages::Transparent
+            || pool->backing() == HugePages::None);
+
+        auto buf = pool->get();
+        std::memset(buf.data(), 0x42, buf.size());
+        EXPECT_EQ(buf.uint8Data()[4095], 0x42);
+    }
+}
+
+TEST(buffer_pool, lock)
+{
+    auto limit = rlimit{ };
+    ASSERT_EQ(::getrlimit(RLIMIT_MEMLOCK, &limit), 0);
+
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < 65536)
+        GTEST_SKIP() << "RLIMIT_MEMLOCK too low to lock a pool";
+
+    auto pool = BufferPool::make(4096, 16, {.lock = true});
+    EXPECT_TRUE(pool->locked());
+
+    EXPECT_FALSE(BufferPool::make(4096, 16)->locked());
+}
+
 TEST(buffer_pool, deplete)
 {
     using namespace std::chrono_literals;
@@ -392,415 +498,2134 @@ TEST(buffer_pool, put_all)
         bufs.push_back(pool->get());
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// PollSet
-
-TEST(pollset, empty_poll)
+TEST(buffer_pool, threads)
 {
-    auto ps = PollSet{ };
+    using namespace std::chrono_literals;
 
-    EXPECT_NO_THROW(ps.remove(0));
-    EXPECT_TRUE(ps.empty());
+    // large enough to enable per-thread magazines.
+    const size_t count = 64;
 
-    ps.waitOnce(1);
-}
+    auto pool = BufferPool::make(64, count);
+    auto inUse = std::vector<std::atomic_bool>(count);
+    auto failed = std::atomic_bool{ };
 
-TEST(pollset, evt_poll)
-{
-    auto fd = ScopedFd(eventfd(0, EFD_CLOEXEC));
-    ASSERT_GE(fd.get(), 0);
+    auto threads = std::vector<std::jthread>{ };
 
-    int evt{ };
-    unsigned events{ };
+    for (int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&] {
+                auto held = std::vector<BufferPool::Buffer>{ };
 
-    auto ps = PollSet{ };
-    ps.add(fd.get(), EPOLLIN, [&evt, &events](unsigned flags){ events = flags, ++evt; return true; });
+                for (int i = 0; i < 20000; ++i)
+                {
+                    auto buf = pool->get(std::chrono::steady_clock::now() + 1s);
 
-    EXPECT_FALSE(ps.empty());
+                    if (!buf || inUse[buf.freeIndex()].exchange(true))
+                        failed = true;
 
-    // with no events, expect a timeout.
-    auto count = ps.waitOnce(10);
-    EXPECT_EQ(count, 0);
+                    held.push_back(std::move(buf));
 
-    const auto postEvent = [&] {
-        // post an event.
-        auto v = uint64_t{42};
-        ASSERT_EQ(::write(fd.get(), &v, sizeof(v)), sizeof(v));
-    };
+                    // hold a few at a time, so puts & gets interleave.
+                    if (held.size() > 4)
+                    {
+                        for (auto &h : held)
+                            inUse[h.freeIndex()] = false;
 
-    const auto checkEvent = [&](int expectedWaitCount, int expectedEvtCount) {
-        // expect non-zero event count & updated event flag.
-        count = ps.waitOnce(10);
-        EXPECT_EQ(count, expectedWaitCount);
-        EXPECT_EQ(events, EPOLLIN);
+                        held.clear();
+                    }
+                }
 
-        EXPECT_EQ(evt, expectedEvtCount);
-    };
+                for (auto &h : held)
+                    inUse[h.freeIndex()] = false;
+            });
+    }
 
-    postEvent();
-    checkEvent(1, 1);
+    threads.clear();
 
-    postEvent();
-    postEvent();
-    // only 1 descriptor is ready, callback invoked once.
-    checkEvent(1, 2);
+    EXPECT_FALSE(failed);
 
-    // remove callback.
-    ps.remove(fd.get());
+    // everything made it back to the pool.
+    auto bufs = std::vector<BufferPool::Buffer>{ };
 
-    // expect no change in event count.
-    postEvent();
-    checkEvent(0, 2);
+    for (size_t i = 0; i < count; ++i)
+    {
+        bufs.push_back(pool->get(std::chrono::steady_clock::now() + 1ms));
+        EXPECT_TRUE(bufs.back());
+    }
 }
 
-TEST(pollset, evt_poll_multi)
-{
-    auto fd = ScopedFd(eventfd(0, EFD_CLOEXEC));
-    auto fd2 = ScopedFd(eventfd(0, EFD_CLOEXEC));
-    ASSERT_GE(fd.get(), 0);
-    ASSERT_GE(fd2.get(), 0);
-
-    int evt[2]{ };
-    unsigned events[2]{ };
-
-    auto ps = PollSet{ };
-
-    // add a handler that sticks around forever.
-    ps.add(fd.get(), EPOLLIN,
-        [&evt, &events](unsigned flags) {
-            events[0] = flags, ++evt[0]; return true;
-        });
+////////////////////////////////////////////////////////////////////////////////
+// IoUring
 
-    // expect exception in trying to add a second handler for an existing
-    // descriptor.
-    auto cb = [&evt, &events](unsigned flags) {
-            events[1] = flags, ++evt[1]; return false;
-        };
+namespace {
 
-    EXPECT_THROW(ps.add(fd.get(), EPOLLIN, cb), std::runtime_error);
+ScopedTempFile patternFile(size_t size)
+{
+    auto f = ScopedTempFile("/tmp/draft_test_", ".dat", O_RDWR);
 
-    ps.add(fd2.get(), EPOLLIN, cb);
+    auto data = std::vector<uint8_t>(size);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 7);
 
-    const auto postEvent = [&] {
-        auto v = uint64_t{42};
-        ASSERT_EQ(::write(fd.get(), &v, sizeof(v)), sizeof(v));
-        ASSERT_EQ(::write(fd2.get(), &v, sizeof(v)), sizeof(v));
-    };
+    net::writeAll(f.fd(), data.data(), data.size());
 
-    postEvent();
-    ps.waitOnce(1);
-    EXPECT_EQ(evt[0], 1);
-    EXPECT_EQ(evt[1], 1);
-    EXPECT_EQ(events[0], EPOLLIN);
-    EXPECT_EQ(events[1], EPOLLIN);
+    return f;
+}
 
-    postEvent();
-    ps.waitOnce(1);
-    EXPECT_EQ(evt[0], 2);
-    EXPECT_EQ(evt[1], 1);
-    EXPECT_EQ(events[0], EPOLLIN);
-    EXPECT_EQ(events[1], EPOLLIN);
 }
 
-TEST(pollset, evt_poll_callback)
+TEST(io_uring, read)
 {
-    auto fd = ScopedFd(eventfd(0, EFD_CLOEXEC));
-    ASSERT_GE(fd.get(), 0);
+    if (!IoUring::supported())
+        GTEST_SKIP() << "io_uring unavailable";
 
-    int evt{ };
-    unsigned events{ };
+    const auto f = patternFile(8192);
 
-    auto ps = PollSet{ };
-    ps.add(fd.get(), EPOLLIN,
-        [&evt, &events](unsigned flags) {
-            events = flags, ++evt; return true;
-        });
+    auto ring = IoUring{4};
+    auto buf = std::vector<uint8_t>(4096);
 
-    // post an event.
-    auto v = uint64_t{42};
-    ASSERT_EQ(::write(fd.get(), &v, sizeof(v)), sizeof(v));
+    auto sqe = ring.getSqe();
+    ASSERT_NE(sqe, nullptr);
 
-    auto count = ps.waitOnce(1,
-        [&evt, &events](const std::vector<epoll_event> &evs) {
-            ASSERT_FALSE(evs.empty());
-            events = evs[0].events;
-            ++evt;
-        });
+    IoUring::prepRead(sqe, f.fd(), buf.data(), buf.size(), 4096);
+    sqe->user_data = 42;
 
-    ASSERT_EQ(count, 1);
+    EXPECT_EQ(ring.submitAndWait(1u), 1u);
 
-    EXPECT_EQ(evt, 1);
-    EXPECT_EQ(events, EPOLLIN);
-}
+    auto count = ring.forEachCompletion([](const auto &cqe) {
+            EXPECT_EQ(cqe.user_data, 42u);
+            EXPECT_EQ(cqe.res, 4096);
+        });
 
-////////////////////////////////////////////////////////////////////////////////
-// IOVec
+    EXPECT_EQ(count, 1u);
+    EXPECT_EQ(buf[0], static_cast<uint8_t>(4096 * 7));
+}
 
-TEST(iovec, stack_no_copy)
+TEST(io_uring, wait_tmo)
 {
-    IOVec_<5> iov(5);
-    EXPECT_EQ(iov.count(), 5u);
+    using namespace std::chrono_literals;
 
-    auto p = iov.get();
+    if (!IoUring::supported())
+        GTEST_SKIP() << "io_uring unavailable";
 
-    ASSERT_NE(p, nullptr);
+    auto ring = IoUring{4};
+
+    EXPECT_FALSE(ring.submitAndWait(1ms));
 }
 
-TEST(iovec, heap_no_copy)
+TEST(io_uring, sq_full)
 {
-    IOVec_<5> iov(6);
-    EXPECT_EQ(iov.count(), 6u);
+    if (!IoUring::supported())
+        GTEST_SKIP() << "io_uring unavailable";
 
-    auto p = iov.get();
+    auto ring = IoUring{2};
 
-    ASSERT_NE(p, nullptr);
+    for (unsigned i = 0; i < ring.entries(); ++i)
+        EXPECT_NE(ring.getSqe(), nullptr);
+
+    EXPECT_EQ(ring.getSqe(), nullptr);
 }
 
-TEST(iovec, stack_copy)
+TEST(io_uring, reader)
 {
-    struct iovec iovs[3] { };
-    const auto iovsCount = sizeof(iovs)/sizeof(*iovs);
+    if (!IoUring::supported())
+        GTEST_SKIP() << "io_uring unavailable";
 
-    iovs[0].iov_base = iovs;
-    iovs[0].iov_len = sizeof(iovs);
+    const size_t chunk = 4096;
+    const size_t size = 10 * chunk + 100;
 
-    IOVec_<5> iov(iovs, iovsCount);
-    auto p = iov.get();
+    const auto f = patternFile(size);
 
-    ASSERT_NE(p, nullptr);
-    EXPECT_EQ(p[0].iov_base, iovs[0].iov_base);
-    EXPECT_EQ(p[0].iov_len, iovs[0].iov_len);
-    EXPECT_EQ(iov.count(), iovsCount);
-}
+    auto pool = BufferPool::make(chunk, 8);
+    auto rings = std::make_shared<IoUringPool>(pool, 4);
+    auto queue = BufQueue{ };
 
-////////////////////////////////////////////////////////////////////////////////
-// ScopedFd
+    auto fd = std::make_shared<ScopedFd>(::open(f.path().c_str(), O_RDONLY));
+    auto reader = Reader(fd, 1, {0, size}, pool, &queue);
+    reader.useRings(rings);
 
-namespace {
+    auto fut = std::async(std::launch::async, std::move(reader), std::stop_token{ });
 
-bool fdOpened(int fd)
-{
-    return std::filesystem::exists(
-        fmt::format("/proc/self/fd/{}", fd));
-}
+    size_t total{ };
+    while (total < size)
+    {
+        auto desc = queue.get(std::chrono::seconds{1});
+        ASSERT_TRUE(desc);
+
+        EXPECT_EQ(desc->buf.uint8Data()[0], static_cast<uint8_t>(desc->offset * 7));
+        total += desc->len;
+    }
 
+    EXPECT_EQ(fut.get(), 0);
+    EXPECT_EQ(total, size);
 }
 
-TEST(scoped_fd, ctor)
+TEST(io_uring, reader_error)
 {
-    auto fd = ScopedFd{ };
-    EXPECT_EQ(fd.get(), -1);
+    if (!IoUring::supported())
+        GTEST_SKIP() << "io_uring unavailable";
 
-    fd = ScopedFd{-1};
-    EXPECT_EQ(fd.get(), -1);
+    const size_t chunk = 4096;
+    const size_t size = 4 * chunk;
 
-    fd = ScopedFd{42};
-    EXPECT_EQ(fd.get(), 42);
-    EXPECT_EQ(static_cast<int>(fd), 42);
+    auto pool = BufferPool::make(chunk, 8);
+    auto rings = std::make_shared<IoUringPool>(pool, 4);
+    auto queue = BufQueue{ };
 
-    fd = ScopedFd(24);
-    EXPECT_EQ(fd.get(), 24);
-}
+    // a short read from a pipe is finished with pread, which fails - with
+    // the other reads still in flight.
+    int pipeFds[2];
+    ASSERT_EQ(::pipe(pipeFds), 0);
 
-TEST(scoped_fd, dtor)
-{
-    int rawFd{-1};
+    auto rfd = std::make_shared<ScopedFd>(pipeFds[0]);
+    auto wfd = ScopedFd{pipeFds[1]};
 
-    {
-        auto fd = ScopedFd{::eventfd(0, EFD_CLOEXEC)};
-        ASSERT_NE(fd.get(), -1);
+    const auto data = std::vector<uint8_t>(100, 0x11);
+    ASSERT_EQ(::write(wfd.get(), data.data(), data.size()), 100);
 
-        rawFd = fd.get();
-        EXPECT_TRUE(fdOpened(rawFd));
-    }
+    auto reader = Reader(rfd, 1, {0, size}, pool, &queue);
+    reader.useRings(rings);
 
-    EXPECT_FALSE(fdOpened(rawFd));
-}
+    // the reads still waiting on the pipe see eof once it's closed. this
+    // thread reads, since its reads are cancelled when it exits.
+    auto closer = std::jthread{[&wfd] {
+            std::this_thread::sleep_for(std::chrono::milliseconds{50});
+            wfd = ScopedFd{ };
+        }};
 
-TEST(scoped_fd, close)
-{
-    auto fd = ScopedFd{::eventfd(0, EFD_CLOEXEC)};
-    ASSERT_NE(fd.get(), -1);
+    EXPECT_THROW(reader(std::stop_token{ }), std::system_error);
 
-    auto rawFd = fd.get();
-    EXPECT_TRUE(fdOpened(rawFd));
+    closer.join();
 
-    fd.close();
+    // the ring goes back to the pool with nothing left in flight, so the
+    // next reader doesn't see stale completions.
+    const auto f = patternFile(size);
+    auto fd = std::make_shared<ScopedFd>(::open(f.path().c_str(), O_RDONLY));
 
-    EXPECT_FALSE(fdOpened(rawFd));
-}
+    auto next = Reader(fd, 1, {0, size}, pool, &queue);
+    next.useRings(rings);
 
-TEST(scoped_fd, release)
-{
-    int rawFd{-1};
+    EXPECT_EQ(next(std::stop_token{ }), 0);
 
+    size_t total{ };
+    while (auto desc = queue.tryGet())
     {
-        auto fd = ScopedFd{::eventfd(0, EFD_CLOEXEC)};
-        ASSERT_NE(fd.get(), -1);
-
-        rawFd = fd.get();
-        EXPECT_TRUE(fdOpened(rawFd));
-
-        rawFd = fd.release();
+        EXPECT_EQ(desc->buf.uint8Data()[0], static_cast<uint8_t>(desc->offset * 7));
+        total += desc->len;
     }
 
-    EXPECT_TRUE(fdOpened(rawFd));
-    ASSERT_EQ(::close(rawFd), 0);
+    EXPECT_EQ(total, size);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// ScopedMMap
+// Sender / Receiver
 
 namespace {
 
-std::pair<size_t, size_t> findMappingRange(void *base)
+ScopedFd tcpListener(sockaddr_in &addr)
 {
-    auto stream = std::ifstream("/proc/self/maps");
+    auto listener = ScopedFd{::socket(AF_INET, SOCK_STREAM, 0)};
 
-    if (!stream)
-        return { };
+    addr = sockaddr_in{ };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-    const auto rex = std::regex{"([0-9a-f]+)-([0-9a-f]+).*"};
+    socklen_t addrLen = sizeof(addr);
 
-    std::string line;
-    while (std::getline(stream, line))
-    {
-        auto match = std::smatch{ };
-        if (std::regex_match(line, match, rex))
-        {
-            if (match.size() < 2u)
-                continue;
+    EXPECT_EQ(::bind(listener.get(), reinterpret_cast<sockaddr *>(&addr), addrLen), 0);
+    EXPECT_EQ(::listen(listener.get(), 1), 0);
+    EXPECT_EQ(::getsockname(listener.get(), reinterpret_cast<sockaddr *>(&addr), &addrLen), 0);
 
-            const auto start = std::stoul(match[1], nullptr, 16);
-            const auto end = std::stoul(match[2], nullptr, 16);
+    return listener;
+}
 
-            if (start == reinterpret_cast<uintptr_t>(base))
+ScopedFd tcpConnect(const sockaddr_in &addr)
+{
+    auto fd = ScopedFd{::socket(AF_INET, SOCK_STREAM, 0)};
+    EXPECT_EQ(::connect(fd.get(), reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)), 0);
+
+    return fd;
+}
+
+std::pair<ScopedFd, ScopedFd> tcpPair()
+{
+    auto addr = sockaddr_in{ };
+    auto listener = tcpListener(addr);
+    auto tx = tcpConnect(addr);
+
+    return {std::move(tx), ScopedFd{::accept(listener.get(), nullptr, nullptr)}};
+}
+
+}
+
+TEST(sender, zerocopy)
+{
+    auto [tx, rx] = tcpPair();
+    ASSERT_GE(rx.get(), 0);
+
+    auto pool = BufferPool::make(4096, 2);
+    auto queue = BufQueue{ };
+
+    auto buf = pool->get();
+    std::memset(buf.data(), 0x5a, buf.size());
+
+    queue.put({std::move(buf), 3, 8192, 4096});
+
+    auto sender = Sender{std::move(tx), queue};
+
+    if (!sender.useZeroCopy())
+        GTEST_SKIP() << "zero-copy unavailable";
+
+    auto source = std::stop_source{ };
+    source.request_stop();
+
+    // the final run waits for send completions before releasing buffers.
+    EXPECT_FALSE(sender.runOnce(source.get_token()));
+
+    auto header = draft::wire::ChunkHeader{ };
+    auto payload = std::vector<uint8_t>(4096);
+
+    EXPECT_EQ(::recv(rx.get(), &header, sizeof(header), MSG_WAITALL), static_cast<ssize_t>(sizeof(header)));
+    EXPECT_EQ(::recv(rx.get(), payload.data(), payload.size(), MSG_WAITALL), 4096);
+
+    EXPECT_EQ(header.magic, draft::wire::ChunkHeader::Magic);
+    EXPECT_EQ(header.fileId, 3u);
+    EXPECT_EQ(header.fileOffset, 8192u);
+    EXPECT_EQ(header.payloadLength, 4096u);
+    EXPECT_EQ(payload[4095], 0x5a);
+
+    // both buffers are back in the pool.
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds{100};
+    auto a = pool->get(deadline);
+    auto b = pool->get(deadline);
+    EXPECT_TRUE(a && b);
+}
+
+TEST(sender, zerocopy_busy)
+{
+    using namespace std::chrono_literals;
+
+    auto [tx, rx] = tcpPair();
+    ASSERT_GE(rx.get(), 0);
+
+    constexpr auto ChunkCount = 32;
+
+    // more chunks than the pool holds go out without the queue running dry
+    // - each replacement buffer has to come back from a completed send well
+    // before the sender would give up waiting on the queue.
+    auto pool = BufferPool::make(4096, 4);
+    auto queue = BufQueue{ };
+
+    queue.put({pool->get(), 0, 0, 4096});
+    queue.put({pool->get(), 0, 4096, 4096});
+
+    auto sender = Sender{std::move(tx), queue};
+
+    if (!sender.useZeroCopy(2))
+        GTEST_SKIP() << "zero-copy unavailable";
+
+    auto sendThread = std::jthread{[&sender](std::stop_token stopToken) {
+            while (sender.runOnce(stopToken))
+                ;
+        }};
+
+    auto header = draft::wire::ChunkHeader{ };
+    auto payload = std::vector<uint8_t>(4096);
+
+    for (size_t i = 0; i < ChunkCount; ++i)
+    {
+        ASSERT_EQ(::recv(rx.get(), &header, sizeof(header), MSG_WAITALL), static_cast<ssize_t>(sizeof(header)));
+        ASSERT_EQ(::recv(rx.get(), payload.data(), payload.size(), MSG_WAITALL), 4096);
+        EXPECT_EQ(header.fileOffset, i * 4096);
+
+        if (i + 2 >= ChunkCount)
+            continue;
+
+        auto buf = pool->get(std::chrono::steady_clock::now() + 50ms);
+        ASSERT_TRUE(buf) << "chunk " << i;
+
+        queue.put({std::move(buf), 0, (i + 2) * 4096, 4096});
+    }
+
+    sendThread.request_stop();
+}
+
+TEST(sender, zerocopy_error)
+{
+    auto [tx, rx] = tcpPair();
+    ASSERT_GE(rx.get(), 0);
+
+    auto pool = BufferPool::make(4096, 1);
+    auto queue = BufQueue{ };
+
+    queue.put({pool->get(), 3, 0, 4096});
+
+    // the send fails before the kernel sees any of it.
+    ::shutdown(tx.get(), SHUT_WR);
+
+    auto sender = Sender{std::move(tx), queue};
+
+    if (!sender.useZeroCopy())
+        GTEST_SKIP() << "zero-copy unavailable";
+
+    const auto prevHandler = ::signal(SIGPIPE, SIG_IGN);
+    EXPECT_THROW(sender.runOnce(std::stop_token{ }), std::system_error);
+    ::signal(SIGPIPE, prevHandler);
+
+    // the failed send doesn't hold on to its buffer.
+    EXPECT_TRUE(pool->get(std::chrono::steady_clock::now() + std::chrono::milliseconds{100}));
+}
+
+TEST(sender, streams)
+{
+    auto addr = sockaddr_in{ };
+
+    {
+        // grab a free port.
+        auto probe = tcpListener(addr);
+    }
+
+    const auto targets = std::vector<NetworkTarget>{{"127.0.0.1", ntohs(addr.sin_port)}};
+
+    // one listening socket, shared by the target's receivers.
+    auto listeners = bindNetworkTargets(targets, 3);
+    ASSERT_EQ(listeners.size(), 3u);
+
+    auto listenAddr = sockaddr_in{ };
+    socklen_t addrLen = sizeof(listenAddr);
+    EXPECT_EQ(::getsockname(listeners[2].get(), reinterpret_cast<sockaddr *>(&listenAddr), &addrLen), 0);
+    EXPECT_EQ(listenAddr.sin_port, addr.sin_port);
+
+    auto streams = connectNetworkTargets(targets, 3);
+    ASSERT_EQ(streams.size(), 3u);
+
+    for (auto &listener : listeners)
+        EXPECT_GE(ScopedFd{::accept(listener.get(), nullptr, nullptr)}.get(), 0);
+
+    statsMgr().reallocateStreams(streams.size());
+    ASSERT_TRUE(streamStats(2));
+    EXPECT_FALSE(streamStats(3));
+
+    streamStats(2)->addChunk(4096);
+    streamStats(2)->addChunk(100);
+
+    EXPECT_EQ(streamStats(2)->byteCount, 4196u);
+    EXPECT_EQ(streamStats(2)->chunkCount, 2u);
+    EXPECT_EQ(streamStats(0)->chunkCount, 0u);
+
+    statsMgr().reallocateStreams(0);
+}
+
+TEST(stats, grow)
+{
+    statsMgr().reallocate(3);
+    ASSERT_TRUE(stats(2));
+    EXPECT_FALSE(stats(3));
+
+    auto first = stats(2);
+    first->fileByteCount = 42;
+
+    // existing entries stay put as the manifest streams in.
+    statsMgr().grow(2000);
+    ASSERT_TRUE(stats(1999));
+    EXPECT_FALSE(stats(2000));
+    EXPECT_EQ(stats(2), first);
+    EXPECT_EQ(stats(2)->fileByteCount, 42u);
+
+    statsMgr().grow(10);
+    EXPECT_TRUE(stats(1999));
+
+    statsMgr().grow(size_t{1} << 20);
+    EXPECT_TRUE(stats(65535));
+
+    statsMgr().reallocate(0);
+    EXPECT_FALSE(stats(0));
+}
+
+TEST(dispatcher, should_take)
+{
+    using Link = Dispatcher::LinkEstimate;
+
+    const auto MB = size_t{1} << 20;
+    const auto left = Dispatcher::Unknown;
+
+    const auto fast = Link{100.0 * MB, MB, .001};
+    const auto slow = Link{10.0 * MB, MB / 2, .050};
+
+    EXPECT_LT(Dispatcher::finishTime(fast, 4 * MB), Dispatcher::finishTime(slow, 4 * MB));
+
+    // while there's plenty left, both take chunks as they work through
+    // their backlogs.
+    EXPECT_TRUE(Dispatcher::shouldTake(fast, {slow}, 4 * MB, left));
+    EXPECT_TRUE(Dispatcher::shouldTake(slow, {fast}, 4 * MB, left));
+    EXPECT_TRUE(Dispatcher::shouldTake(slow, {fast}, 4 * MB, 400 * MB));
+
+    // ...but not past their horizon, so the slow link can't hoard chunks
+    // in a backlog it'll take far longer than the fast one to deliver.
+    const auto deepSlow = Link{10.0 * MB, 2 * MB, .050};
+
+    EXPECT_GT(2.0 * MB / deepSlow.rate, Dispatcher::horizon(deepSlow));
+    EXPECT_FALSE(Dispatcher::shouldTake(deepSlow, {fast}, 4 * MB, left));
+    EXPECT_TRUE(Dispatcher::shouldTake(fast, {deepSlow}, 4 * MB, left));
+
+    // near the end, the slow link is passed over once the fast one would
+    // finish the rest first.
+    EXPECT_TRUE(Dispatcher::shouldTake(fast, {slow}, 4 * MB, 4 * MB));
+    EXPECT_FALSE(Dispatcher::shouldTake(slow, {fast}, 4 * MB, 20 * MB));
+
+    // links with unknown rates take chunks, and aren't counted on to.
+    EXPECT_TRUE(Dispatcher::shouldTake({ }, {fast}, 4 * MB, 4 * MB));
+    EXPECT_TRUE(Dispatcher::shouldTake(slow, {Link{ }}, 4 * MB, 4 * MB));
+    EXPECT_TRUE(Dispatcher::shouldTake(slow, { }, 4 * MB, 4 * MB));
+}
+
+TEST(dispatcher, sample)
+{
+    auto [tx, rx] = tcpPair();
+    ASSERT_GE(rx.get(), 0);
+
+    statsMgr().reallocateStreams(2);
+
+    auto dispatcher = Dispatcher{ };
+    const auto slot = dispatcher.add(tx.get(), 1);
+
+    auto data = std::vector<uint8_t>(65536, 0x3c);
+    net::writeAll(tx.get(), data.data(), data.size());
+
+    // until the queue drains, every stream takes chunks.
+    EXPECT_TRUE(dispatcher.admit(slot, 1, false));
+    EXPECT_GT(streamStats(1)->cwnd, 0u);
+
+    // a lone stream takes them to the end.
+    EXPECT_TRUE(dispatcher.admit(slot, 1, true));
+
+    statsMgr().reallocateStreams(0);
+}
+
+TEST(receiver, splice)
+{
+    auto addr = sockaddr_in{ };
+    auto listener = tcpListener(addr);
+
+    auto queue = BufQueue{ };
+    auto receiver = Receiver{std::move(listener), queue};
+
+    const auto f = ScopedTempFile("/tmp/draft_test_", ".dat", O_RDWR);
+
+    auto files = std::make_shared<FileTable>();
+    files->add(7, f.fd());
+    files->close();
+
+    receiver.useSplice(files);
+
+    auto tx = tcpConnect(addr);
+
+    auto header = draft::wire::ChunkHeader{ };
+    header.magic = draft::wire::ChunkHeader::Magic;
+    header.fileId = 7;
+    header.fileOffset = 4096;
+    header.payloadLength = 5000;
+
+    auto payload = std::vector<uint8_t>(header.payloadLength, 0xa5);
+
+    net::writeAll(tx.get(), &header, sizeof(header));
+    net::writeAll(tx.get(), payload.data(), payload.size());
+    tx = ScopedFd{ };
+
+    // runs until EOF once the chunk is consumed.
+    for (int i = 0; i < 100 && receiver.runOnce(std::stop_token{ }); ++i)
+        ;
+
+    struct stat st{ };
+    ASSERT_EQ(::fstat(f.fd(), &st), 0);
+    EXPECT_EQ(st.st_size, 4096 + 5000);
+
+    auto check = std::vector<uint8_t>(payload.size());
+    EXPECT_EQ(::pread(f.fd(), check.data(), check.size(), 4096), static_cast<ssize_t>(check.size()));
+    EXPECT_EQ(check, payload);
+
+    // nothing is queued for a writer.
+    EXPECT_FALSE(queue.get(std::chrono::milliseconds{1}));
+}
+
+TEST(receiver, splice_verify)
+{
+    auto addr = sockaddr_in{ };
+    auto listener = tcpListener(addr);
+
+    auto queue = BufQueue{ };
+    auto receiver = Receiver{std::move(listener), queue};
+
+    const auto f = ScopedTempFile("/tmp/draft_test_", ".dat", O_RDWR);
+
+    auto files = std::make_shared<FileTable>();
+    files->add(7, f.fd());
+    files->close();
+
+    auto retransmits = std::make_shared<RetransmitList>();
+
+    receiver.useSplice(files);
+    receiver.useRetransmits(retransmits);
+
+    auto tx = tcpConnect(addr);
+
+    // an intact chunk, then one whose digest doesn't match.
+    auto payload = std::vector<uint8_t>(300000, 0x6b);
+
+    for (const auto offset : {size_t{0}, size_t{1} << 20})
+    {
+        auto header = draft::wire::ChunkHeader{ };
+        header.magic = draft::wire::ChunkHeader::Magic;
+        header.fileId = 7;
+        header.fileOffset = offset;
+        header.payloadLength = payload.size();
+        header.flags = draft::wire::ChunkHeader::Digest;
+        header.digest = XXH3_64bits(payload.data(), payload.size()) + (offset ? 1 : 0);
+
+        net::writeAll(tx.get(), &header, sizeof(header));
+        net::writeAll(tx.get(), payload.data(), payload.size());
+    }
+
+    tx = ScopedFd{ };
+
+    for (int i = 0; i < 1000 && receiver.runOnce(std::stop_token{ }); ++i)
+        ;
+
+    const auto corrupt = retransmits->take();
+    ASSERT_EQ(corrupt.size(), 1u);
+    EXPECT_EQ(corrupt[0].fileId, 7u);
+    EXPECT_EQ(corrupt[0].offset, size_t{1} << 20);
+    EXPECT_EQ(corrupt[0].len, payload.size());
+}
+
+TEST(uring_receiver, await_file)
+{
+    using namespace std::chrono_literals;
+
+    if (!IoUring::supported())
+        GTEST_SKIP() << "io_uring unavailable";
+
+    auto addrA = sockaddr_in{ };
+    auto addrB = sockaddr_in{ };
+
+    auto listeners = std::vector<ScopedFd>{ };
+    listeners.push_back(tcpListener(addrA));
+    listeners.push_back(tcpListener(addrB));
+
+    const auto f1 = ScopedTempFile("/tmp/draft_test_", ".dat", O_RDWR);
+    const auto f2 = ScopedTempFile("/tmp/draft_test_", ".dat", O_RDWR);
+
+    // file 2 isn't open yet.
+    auto files = std::make_shared<FileTable>();
+    files->add(1, f1.fd());
+
+    auto receiver = UringReceiver{std::move(listeners), files, 8};
+
+    auto rxThread = std::jthread{[&receiver](std::stop_token stopToken) {
+            while (receiver.runOnce(stopToken))
+                ;
+        }};
+
+    const auto sendChunk = [](int fd, unsigned fileId, uint8_t fill) {
+            auto header = draft::wire::ChunkHeader{ };
+            header.magic = draft::wire::ChunkHeader::Magic;
+            header.fileId = static_cast<uint16_t>(fileId);
+            header.payloadLength = 4096;
+
+            const auto payload = std::vector<uint8_t>(header.payloadLength, fill);
+
+            net::writeAll(fd, &header, sizeof(header));
+            net::writeAll(fd, payload.data(), payload.size());
+        };
+
+    const auto awaitData = [](int fd, uint8_t fill) {
+            auto check = std::vector<uint8_t>(4096);
+
+            for (int i = 0; i < 200; ++i)
+            {
+                if (::pread(fd, check.data(), check.size(), 0) == 4096 && check[4095] == fill)
+                    return true;
+
+                std::this_thread::sleep_for(10ms);
+            }
+
+            return false;
+        };
+
+    auto txA = tcpConnect(addrA);
+    sendChunk(txA.get(), 2, 0x22);
+
+    // the chunk waiting for file 2 doesn't hold up the other connection.
+    std::this_thread::sleep_for(50ms);
+
+    auto txB = tcpConnect(addrB);
+    sendChunk(txB.get(), 1, 0x11);
+
+    EXPECT_TRUE(awaitData(f1.fd(), 0x11));
+
+    files->add(2, f2.fd());
+    files->close();
+
+    EXPECT_TRUE(awaitData(f2.fd(), 0x22));
+
+    txA = ScopedFd{ };
+    txB = ScopedFd{ };
+}
+
+TEST(receiver, stream_hash)
+{
+    auto addr = sockaddr_in{ };
+    auto listener = tcpListener(addr);
+
+    auto queue = BufQueue{ };
+    auto receiver = Receiver{std::move(listener), queue};
+
+    auto [journalFd, path] = makeTempFile("/tmp/draft_test_", ".draft", O_RDWR);
+    auto journal = std::make_shared<Journal>(journalFd.release(), path, std::vector<FileInfo>{ });
+
+    receiver.useHashLog(journal);
+
+    auto tx = tcpConnect(addr);
+
+    auto header = draft::wire::ChunkHeader{ };
+    header.magic = draft::wire::ChunkHeader::Magic;
+    header.fileId = 7;
+    header.fileOffset = BufSize;
+    header.payloadLength = 3 * 100'000;
+
+    auto payload = std::vector<uint8_t>(header.payloadLength);
+    for (size_t i = 0; i < payload.size(); ++i)
+        payload[i] = static_cast<uint8_t>(i * 13);
+
+    // deliver the payload in pieces, so it's hashed across several reads.
+    auto sender = std::thread([&] {
+            net::writeAll(tx.get(), &header, sizeof(header));
+
+            for (size_t offset = 0; offset < payload.size(); offset += 100'000)
+            {
+                net::writeAll(tx.get(), payload.data() + offset, 100'000);
+                std::this_thread::sleep_for(std::chrono::milliseconds{10});
+            }
+
+            tx = ScopedFd{ };
+        });
+
+    // runs until EOF once the chunk is consumed.
+    for (int i = 0; i < 100 && receiver.runOnce(std::stop_token{ }); ++i)
+        ;
+
+    sender.join();
+
+    const auto digest = XXH3_64bits(payload.data(), payload.size());
+
+    auto desc = queue.get(std::chrono::milliseconds{1});
+    ASSERT_TRUE(desc);
+
+    EXPECT_TRUE(desc->hashed);
+    EXPECT_EQ(desc->digest, digest);
+
+    ASSERT_EQ(journal->hashCount(), 1u);
+
+    const auto &record = *journal->begin();
+    EXPECT_EQ(record.fileId, 7u);
+    EXPECT_EQ(record.offset, BufSize);
+    EXPECT_EQ(record.size, payload.size());
+    EXPECT_EQ(record.hash, digest);
+
+    std::filesystem::remove(path);
+}
+
+TEST(receiver, retransmit)
+{
+    auto addr = sockaddr_in{ };
+    auto listener = tcpListener(addr);
+
+    auto queue = BufQueue{ };
+    auto receiver = Receiver{std::move(listener), queue};
+
+    auto retransmits = std::make_shared<RetransmitList>();
+    receiver.useRetransmits(retransmits);
+
+    auto tx = tcpConnect(addr);
+
+    auto payload = std::vector<uint8_t>(10'000);
+    for (size_t i = 0; i < payload.size(); ++i)
+        payload[i] = static_cast<uint8_t>(i * 13);
+
+    auto header = draft::wire::ChunkHeader{ };
+    header.magic = draft::wire::ChunkHeader::Magic;
+    header.fileId = 7;
+    header.payloadLength = payload.size();
+    header.flags = draft::wire::ChunkHeader::Digest;
+    header.digest = XXH3_64bits(payload.data(), payload.size());
+
+    // an intact chunk, then one that was corrupted on the way.
+    net::writeAll(tx.get(), &header, sizeof(header));
+    net::writeAll(tx.get(), payload.data(), payload.size());
+
+    header.fileOffset = BufSize;
+    payload[5000] ^= 0xff;
+
+    net::writeAll(tx.get(), &header, sizeof(header));
+    net::writeAll(tx.get(), payload.data(), payload.size());
+    tx = ScopedFd{ };
+
+    for (int i = 0; i < 100 && receiver.runOnce(std::stop_token{ }); ++i)
+        ;
+
+    auto desc = queue.get(std::chrono::milliseconds{1});
+    ASSERT_TRUE(desc);
+    EXPECT_EQ(desc->offset, 0u);
+    EXPECT_EQ(desc->digest, header.digest);
+
+    // the corrupt chunk is dropped, and requested again.
+    EXPECT_FALSE(queue.get(std::chrono::milliseconds{1}));
+
+    const auto chunks = retransmits->take();
+    ASSERT_EQ(chunks.size(), 1u);
+    EXPECT_EQ(chunks[0].fileId, 7u);
+    EXPECT_EQ(chunks[0].offset, BufSize);
+    EXPECT_EQ(chunks[0].len, payload.size());
+    EXPECT_TRUE(retransmits->take().empty());
+
+    const auto msg = generateRetransmitMsg(chunks);
+    const auto out = deserializeRetransmitMsg(
+        msg.uint8Data() + sizeof(draft::wire::ChunkHeader),
+        msg.size() - sizeof(draft::wire::ChunkHeader));
+
+    ASSERT_EQ(out.size(), 1u);
+    EXPECT_EQ(out[0].fileId, 7u);
+    EXPECT_EQ(out[0].offset, BufSize);
+    EXPECT_EQ(out[0].len, payload.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PollSet
+
+TEST(pollset, empty_poll)
+{
+    auto ps = PollSet{ };
+
+    EXPECT_NO_THROW(ps.remove(0));
+    EXPECT_TRUE(ps.empty());
+
+    ps.waitOnce(1);
+}
+
+TEST(pollset, evt_poll)
+{
+    auto fd = ScopedFd(eventfd(0, EFD_CLOEXEC));
+    ASSERT_GE(fd.get(), 0);
+
+    int evt{ };
+    unsigned events{ };
+
+    auto ps = PollSet{ };
+    ps.add(fd.get(), EPOLLIN, [&evt, &events](unsigned flags){ events = flags, ++evt; return true; });
+
+    EXPECT_FALSE(ps.empty());
+
+    // with no events, expect a timeout.
+    auto count = ps.waitOnce(10);
+    EXPECT_EQ(count, 0);
+
+    const auto postEvent = [&] {
+        // post an event.
+        auto v = uint64_t{42};
+        ASSERT_EQ(::write(fd.get(), &v, sizeof(v)), sizeof(v));
+    };
+
+    const auto checkEvent = [&](int expectedWaitCount, int expectedEvtCount) {
+        // expect non-zero event count & updated event flag.
+        count = ps.waitOnce(10);
+        EXPECT_EQ(count, expectedWaitCount);
+        EXPECT_EQ(events, EPOLLIN);
+
+        EXPECT_EQ(evt, expectedEvtCount);
+    };
+
+    postEvent();
+    checkEvent(1, 1);
+
+    postEvent();
+    postEvent();
+    // only 1 descriptor is ready, callback invoked once.
+    checkEvent(1, 2);
+
+    // remove callback.
+    ps.remove(fd.get());
+
+    // expect no change in event count.
+    postEvent();
+    checkEvent(0, 2);
+}
+
+TEST(pollset, evt_poll_multi)
+{
+    auto fd = ScopedFd(eventfd(0, EFD_CLOEXEC));
+    auto fd2 = ScopedFd(eventfd(0, EFD_CLOEXEC));
+    ASSERT_GE(fd.get(), 0);
+    ASSERT_GE(fd2.get(), 0);
+
+    int evt[2]{ };
+    unsigned events[2]{ };
+
+    auto ps = PollSet{ };
+
+    // add a handler that sticks around forever.
+    ps.add(fd.get(), EPOLLIN,
+        [&evt, &events](unsigned flags) {
+            events[0] = flags, ++evt[0]; return true;
+        });
+
+    // expect exception in trying to add a second handler for an existing
+    // descriptor.
+    auto cb = [&evt, &events](unsigned flags) {
+            events[1] = flags, ++evt[1]; return false;
+        };
+
+    EXPECT_THROW(ps.add(fd.get(), EPOLLIN, cb), std::runtime_error);
+
+    ps.add(fd2.get(), EPOLLIN, cb);
+
+    const auto postEvent = [&] {
+        auto v = uint64_t{42};
+        ASSERT_EQ(::write(fd.get(), &v, sizeof(v)), sizeof(v));
+        ASSERT_EQ(::write(fd2.get(), &v, sizeof(v)), sizeof(v));
+    };
+
+    postEvent();
+    ps.waitOnce(1);
+    EXPECT_EQ(evt[0], 1);
+    EXPECT_EQ(evt[1], 1);
+    EXPECT_EQ(events[0], EPOLLIN);
+    EXPECT_EQ(events[1], EPOLLIN);
+
+    postEvent();
+    ps.waitOnce(1);
+    EXPECT_EQ(evt[0], 2);
+    EXPECT_EQ(evt[1], 1);
+    EXPECT_EQ(events[0], EPOLLIN);
+    EXPECT_EQ(events[1], EPOLLIN);
+}
+
+TEST(pollset, evt_poll_callback)
+{
+    auto fd = ScopedFd(eventfd(0, EFD_CLOEXEC));
+    ASSERT_GE(fd.get(), 0);
+
+    int evt{ };
+    unsigned events{ };
+
+    auto ps = PollSet{ };
+    ps.add(fd.get(), EPOLLIN,
+        [&evt, &events](unsigned flags) {
+            events = flags, ++evt; return true;
+        });
+
+    // post an event.
+    auto v = uint64_t{42};
+    ASSERT_EQ(::write(fd.get(), &v, sizeof(v)), sizeof(v));
+
+    auto count = ps.waitOnce(1,
+        [&evt, &events](const std::vector<epoll_event> &evs) {
+            ASSERT_FALSE(evs.empty());
+            events = evs[0].events;
+            ++evt;
+        });
+
+    ASSERT_EQ(count, 1);
+
+    EXPECT_EQ(evt, 1);
+    EXPECT_EQ(events, EPOLLIN);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// IOVec
+
+TEST(iovec, stack_no_copy)
+{
+    IOVec_<5> iov(5);
+    EXPECT_EQ(iov.count(), 5u);
+
+    auto p = iov.get();
+
+    ASSERT_NE(p, nullptr);
+}
+
+TEST(iovec, heap_no_copy)
+{
+    IOVec_<5> iov(6);
+    EXPECT_EQ(iov.count(), 6u);
+
+    auto p = iov.get();
+
+    ASSERT_NE(p, nullptr);
+}
+
+TEST(iovec, stack_copy)
+{
+    struct iovec iovs[3] { };
+    const auto iovsCount = sizeof(iovs)/sizeof(*iovs);
+
+    iovs[0].iov_base = iovs;
+    iovs[0].iov_len = sizeof(iovs);
+
+    IOVec_<5> iov(iovs, iovsCount);
+    auto p = iov.get();
+
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(p[0].iov_base, iovs[0].iov_base);
+    EXPECT_EQ(p[0].iov_len, iovs[0].iov_len);
+    EXPECT_EQ(iov.count(), iovsCount);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ScopedFd
+
+namespace {
+
+bool fdOpened(int fd)
+{
+    return std::filesystem::exists(
+        fmt::format("/proc/self/fd/{}", fd));
+}
+
+}
+
+TEST(scoped_fd, ctor)
+{
+    auto fd = ScopedFd{ };
+    EXPECT_EQ(fd.get(), -1);
+
+    fd = ScopedFd{-1};
+    EXPECT_EQ(fd.get(), -1);
+
+    fd = ScopedFd{42};
+    EXPECT_EQ(fd.get(), 42);
+    EXPECT_EQ(static_cast<int>(fd), 42);
+
+    fd = ScopedFd(24);
+    EXPECT_EQ(fd.get(), 24);
+}
+
+TEST(scoped_fd, dtor)
+{
+    int rawFd{-1};
+
+    {
+        auto fd = ScopedFd{::eventfd(0, EFD_CLOEXEC)};
+        ASSERT_NE(fd.get(), -1);
+
+        rawFd = fd.get();
+        EXPECT_TRUE(fdOpened(rawFd));
+    }
+
+    EXPECT_FALSE(fdOpened(rawFd));
+}
+
+TEST(scoped_fd, close)
+{
+    auto fd = ScopedFd{::eventfd(0, EFD_CLOEXEC)};
+    ASSERT_NE(fd.get(), -1);
+
+    auto rawFd = fd.get();
+    EXPECT_TRUE(fdOpened(rawFd));
+
+    fd.close();
+
+    EXPECT_FALSE(fdOpened(rawFd));
+}
+
+TEST(scoped_fd, release)
+{
+    int rawFd{-1};
+
+    {
+        auto fd = ScopedFd{::eventfd(0, EFD_CLOEXEC)};
+        ASSERT_NE(fd.get(), -1);
+
+        rawFd = fd.get();
+        EXPECT_TRUE(fdOpened(rawFd));
+
+        rawFd = fd.release();
+    }
+
+    EXPECT_TRUE(fdOpened(rawFd));
+    ASSERT_EQ(::close(rawFd), 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ScopedMMap
+
+namespace {
+
+std::pair<size_t, size_t> findMappingRange(void *base)
+{
+    auto stream = std::ifstream("/proc/self/maps");
+
+    if (!stream)
+        return { };
+
+    const auto rex = std::regex{"([0-9a-f]+)-([0-9a-f]+).*"};
+
+    std::string line;
+    while (std::getline(stream, line))
+    {
+        auto match = std::smatch{ };
+        if (std::regex_match(line, match, rex))
+        {
+            if (match.size() < 2u)
+                continue;
+
+            const auto start = std::stoul(match[1], nullptr, 16);
+            const auto end = std::stoul(match[2], nullptr, 16);
+
+            if (start == reinterpret_cast<uintptr_t>(base))
                 return {start, end};
         }
     }
 
-    return { };
+    return { };
+}
+
+} // namespace
+
+TEST(scoped_mmap, map)
+{
+    EXPECT_NO_THROW(ScopedMMap::map(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+}
+
+TEST(scoped_mmap, unmap)
+{
+    const size_t size = 4096;
+
+    auto sm = ScopedMMap::map(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    // look-up our anonymous mapping.
+    auto base = sm.data();
+    auto range = findMappingRange(base);
+    ASSERT_NE(range.first, 0);
+
+    // check range size.
+    EXPECT_EQ(range.second - range.first, size);
+
+    EXPECT_EQ(sm.unmap(), 0);
+
+    // expect range to not be found after unmap().
+    range = findMappingRange(base);
+    EXPECT_EQ(range.first, 0);
+}
+
+TEST(scoped_mmap, scope_unmap)
+{
+    const size_t size = 4096;
+    void *base{ };
+    std::pair<size_t, size_t> range{ };
+
+    {
+        auto sm = ScopedMMap::map(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        // look-up our anonymous mapping.
+        base = sm.data();
+        range = findMappingRange(base);
+        ASSERT_NE(range.first, 0);
+
+        // check range size.
+        EXPECT_EQ(range.second - range.first, size);
+    }
+
+    // expect range to not be found after end of scope.
+    range = findMappingRange(base);
+    EXPECT_EQ(range.first, 0);
+}
+
+TEST(scoped_mmap, data)
+{
+    const size_t size = 4096;
+    auto sm = ScopedMMap::map(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    ASSERT_EQ(sm.size(), size);
+
+    std::memset(sm.data(), 0x55, sm.size());
+    EXPECT_EQ(*sm.uint8Data(), 0x55);
+
+    EXPECT_TRUE(sm.offsetValid(0));
+    EXPECT_TRUE(sm.offsetValid(size - 1));
+    EXPECT_FALSE(sm.offsetValid(size));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FreeList
+
+TEST(free_list, get)
+{
+    auto list = FreeList{10};
+
+    for (size_t i = 0u; i < 10u; ++i)
+        EXPECT_EQ(i, list.get());
+
+    EXPECT_EQ(FreeList::End, list.get());
+}
+
+TEST(free_list, put_interleaved)
+{
+    auto list = FreeList{2};
+
+    EXPECT_EQ(0, list.get());
+    EXPECT_EQ(1, list.get());
+    EXPECT_EQ(FreeList::End, list.get());
+
+    list.put(0);
+    list.put(1);
+    EXPECT_EQ(1, list.get());
+    EXPECT_EQ(0, list.get());
+    EXPECT_EQ(FreeList::End, list.get());
+}
+
+TEST(free_list, threads)
+{
+    const size_t count = 16;
+
+    auto list = FreeList{count};
+    auto inUse = std::vector<std::atomic_bool>(count);
+    auto failed = std::atomic_bool{ };
+
+    auto threads = std::vector<std::jthread>{ };
+
+    for (int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&] {
+                for (int i = 0; i < 50000; ++i)
+                {
+                    const auto idx = list.get();
+
+                    if (idx == FreeList::End)
+                        continue;
+
+                    if (idx >= count || inUse[idx].exchange(true))
+                        failed = true;
+
+                    inUse[idx] = false;
+                    list.put(idx);
+                }
+            });
+    }
+
+    threads.clear();
+
+    EXPECT_FALSE(failed);
+
+    for (size_t i = 0; i < count; ++i)
+        EXPECT_NE(list.get(), FreeList::End);
+
+    EXPECT_EQ(list.get(), FreeList::End);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// WaitQueue
+
+TEST(wait_q, put_get)
+{
+    auto q = WaitQueue<int>{ };
+    q.put(42);
+
+    auto v = q.get();
+    ASSERT_TRUE(v);
+    EXPECT_EQ(*v, 42);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// RingQueue
+
+TEST(ring_q, put_get)
+{
+    auto q = RingQueue<int>{ };
+    EXPECT_TRUE(q.put(42));
+
+    auto v = q.get(std::chrono::milliseconds{1});
+    ASSERT_TRUE(v);
+    EXPECT_EQ(*v, 42);
+
+    EXPECT_FALSE(q.tryGet());
+}
+
+TEST(ring_q, full)
+{
+    auto q = RingQueue<int>{ };
+    q.setSizeLimit(3);
+
+    for (int i = 0; i < 3; ++i)
+        EXPECT_TRUE(q.put(i));
+
+    EXPECT_FALSE(q.put(3));
+    EXPECT_FALSE(q.put(3, std::chrono::milliseconds{1}));
+
+    // wraps around once space is freed.
+    for (int i = 0; i < 6; ++i)
+    {
+        auto v = q.tryGet();
+        ASSERT_TRUE(v);
+        EXPECT_EQ(*v, i);
+        EXPECT_TRUE(q.put(i + 3));
+    }
+}
+
+TEST(ring_q, get_tmo)
+{
+    using namespace std::chrono_literals;
+
+    auto q = RingQueue<int>{ };
+
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_FALSE(q.get(5ms));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 5ms);
+}
+
+TEST(ring_q, wake_getter)
+{
+    using namespace std::chrono_literals;
+
+    auto q = RingQueue<int>{ };
+
+    auto fut = std::async(std::launch::async, [&q] { return q.get(5s); });
+
+    std::this_thread::sleep_for(10ms);
+    q.put(7);
+
+    auto v = fut.get();
+    ASSERT_TRUE(v);
+    EXPECT_EQ(*v, 7);
+}
+
+TEST(ring_q, wake_putter)
+{
+    using namespace std::chrono_literals;
+
+    auto q = RingQueue<int>{2};
+    q.put(1);
+    q.put(2);
+
+    auto fut = std::async(std::launch::async, [&q] { return q.put(3, 5s); });
+
+    std::this_thread::sleep_for(10ms);
+    EXPECT_EQ(q.tryGet(), 1);
+
+    EXPECT_TRUE(fut.get());
+    EXPECT_EQ(q.tryGet(), 2);
+    EXPECT_EQ(q.tryGet(), 3);
+}
+
+TEST(ring_q, cancel)
+{
+    using namespace std::chrono_literals;
+
+    auto q = RingQueue<int>{ };
+
+    auto fut = std::async(std::launch::async, [&q] { return q.get(); });
+
+    std::this_thread::sleep_for(10ms);
+    q.cancel();
+
+    EXPECT_FALSE(fut.get());
+    EXPECT_TRUE(q.done());
+}
+
+TEST(ring_q, stop)
+{
+    using namespace std::chrono_literals;
+
+    using Clock = std::chrono::steady_clock;
+
+    auto q = RingQueue<int>{ };
+    auto stop = std::stop_source{ };
+
+    q.put(1);
+
+    auto fut = std::async(std::launch::async, [&q, &stop] {
+            auto got = std::vector<int>{ };
+
+            while (auto v = q.get(Clock::now() + 10s, stop.get_token()))
+                got.push_back(*v);
+
+            return got;
+        });
+
+    std::this_thread::sleep_for(10ms);
+    stop.request_stop();
+
+    // values queued before the stop are still delivered, then the getter
+    // returns without waiting out its deadline.
+    ASSERT_EQ(fut.wait_for(1s), std::future_status::ready);
+    EXPECT_EQ(fut.get(), std::vector<int>{1});
+    EXPECT_FALSE(q.done());
+}
+
+TEST(ring_q, many)
+{
+    using namespace std::chrono_literals;
+
+    auto q = RingQueue<int>{4};
+
+    const auto in = std::vector<int>{1, 2, 3, 4, 5, 6};
+    EXPECT_EQ(q.putMany(begin(in), end(in)), 4u);
+
+    auto out = std::vector<int>{ };
+    EXPECT_EQ(q.getMany(std::back_inserter(out), 3, std::chrono::steady_clock::now() + 1ms), 3u);
+    EXPECT_EQ(q.getMany(std::back_inserter(out), 3), 1u);
+
+    EXPECT_EQ(out, (std::vector<int>{1, 2, 3, 4}));
+
+    // batches wrap around the ring.
+    EXPECT_EQ(q.putMany(begin(in) + 1, begin(in) + 4), 3u);
+    EXPECT_EQ(q.putMany(begin(in), end(in), std::chrono::steady_clock::now() + 1ms), 1u);
+
+    out.clear();
+    EXPECT_EQ(q.getMany(std::back_inserter(out), 8), 4u);
+    EXPECT_EQ(out, (std::vector<int>{2, 3, 4, 1}));
+
+    EXPECT_EQ(q.getMany(std::back_inserter(out), 8, std::chrono::steady_clock::now() + 1ms), 0u);
+}
+
+TEST(ring_q, release_on_destroy)
+{
+    auto p = std::make_shared<int>(1);
+
+    {
+        auto q = RingQueue<std::shared_ptr<int>>{ };
+        q.put(p);
+        EXPECT_EQ(p.use_count(), 2);
+    }
+
+    EXPECT_EQ(p.use_count(), 1);
+}
+
+TEST(ring_q, mpmc)
+{
+    using namespace std::chrono_literals;
+
+    constexpr int producers = 4;
+    constexpr int consumers = 4;
+    constexpr int count = 20000;
+
+    auto q = RingQueue<int>{16};
+    auto sum = std::atomic<int64_t>{ };
+    auto received = std::atomic<int>{ };
+
+    auto threads = std::vector<std::jthread>{ };
+
+    for (int p = 0; p < producers; ++p)
+    {
+        threads.emplace_back([&q] {
+                for (int i = 1; i <= count; ++i)
+                    while (!q.put(i, 10ms)) { }
+            });
+    }
+
+    for (int c = 0; c < consumers; ++c)
+    {
+        threads.emplace_back([&] {
+                while (received < producers * count)
+                {
+                    if (auto v = q.get(1ms))
+                    {
+                        sum += *v;
+                        ++received;
+                    }
+                }
+            });
+    }
+
+    threads.clear();
+
+    EXPECT_EQ(received, producers * count);
+    EXPECT_EQ(sum, int64_t{producers} * count * (count + 1) / 2);
+}
+
+TEST(ring_q, mpmc_many)
+{
+    using namespace std::chrono_literals;
+
+    constexpr int producers = 4;
+    constexpr int consumers = 4;
+    constexpr int count = 20000;
+    constexpr int batch = 7;
+
+    auto q = RingQueue<int>{16};
+    auto sum = std::atomic<int64_t>{ };
+    auto received = std::atomic<int>{ };
+
+    auto threads = std::vector<std::jthread>{ };
+
+    for (int p = 0; p < producers; ++p)
+    {
+        threads.emplace_back([&q] {
+                auto in = std::vector<int>(count);
+                std::iota(begin(in), end(in), 1);
+
+                for (auto first = begin(in); first != end(in); )
+                {
+                    const auto last = first + std::min<ptrdiff_t>(batch, end(in) - first);
+                    first += static_cast<ptrdiff_t>(
+                        q.putMany(first, last, std::chrono::steady_clock::now() + 10ms));
+                }
+            });
+    }
+
+    for (int c = 0; c < consumers; ++c)
+    {
+        threads.emplace_back([&] {
+                auto out = std::vector<int>{ };
+
+                while (received < producers * count)
+                {
+                    out.clear();
+
+                    const auto n = q.getMany(
+                        std::back_inserter(out), batch, std::chrono::steady_clock::now() + 1ms);
+
+                    for (auto v : out)
+                        sum += v;
+
+                    received += static_cast<int>(n);
+                }
+            });
+    }
+
+    threads.clear();
+
+    EXPECT_EQ(received, producers * count);
+    EXPECT_EQ(sum, int64_t{producers} * count * (count + 1) / 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ScopedTempFile
+
+TEST(makeTempFile, create)
+{
+    namespace fs = std::filesystem;
+
+    auto path = []{
+            auto f = ScopedTempFile("foo", "bar");
+            EXPECT_TRUE(fs::exists(f.path()));
+            return f.path();
+        }();
+
+    EXPECT_FALSE(fs::exists(path));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Segments
+
+TEST(segments, split)
+{
+    const auto size = 5 * BufSize + 100;
+
+    auto segments = splitSegments(size, 2 * BufSize);
+    ASSERT_EQ(segments.size(), 3u);
+
+    EXPECT_EQ(segments[0].offset, 0u);
+    EXPECT_EQ(segments[0].len, 2 * BufSize);
+    EXPECT_EQ(segments[1].offset, 2 * BufSize);
+    EXPECT_EQ(segments[2].offset, 4 * BufSize);
+    EXPECT_EQ(segments[2].len, BufSize + 100);
+}
+
+TEST(segments, split_rounds_to_chunks)
+{
+    auto segments = splitSegments(3 * BufSize, BufSize + 1);
+    ASSERT_EQ(segments.size(), 2u);
+
+    EXPECT_EQ(segments[0].len, 2 * BufSize);
+    EXPECT_EQ(segments[1].offset, 2 * BufSize);
+    EXPECT_EQ(segments[1].len, BufSize);
+}
+
+TEST(segments, split_whole_file)
+{
+    auto segments = splitSegments(100, 0);
+    ASSERT_EQ(segments.size(), 1u);
+    EXPECT_EQ(segments[0].len, 100u);
+
+    EXPECT_TRUE(splitSegments(0, BufSize).empty());
+}
+
+TEST(file_scanner, order)
+{
+    namespace fs = std::filesystem;
+
+    char tmpl[] = "/tmp/draft_scan_XXXXXX";
+    ASSERT_TRUE(::mkdtemp(tmpl));
+
+    const auto root = std::string{tmpl};
+
+    fs::create_directories(root + "/b/d");
+    fs::create_directories(root + "/a");
+    std::ofstream{root + "/c"} << "cc";
+    std::ofstream{root + "/a/x"} << "x";
+    std::ofstream{root + "/b/d/y"} << "yyy";
+    std::ofstream{root + "/b/a"};
+    fs::create_symlink("a", root + "/e");
+
+    const auto expected = std::vector<std::string>{"a", "a/x", "b", "b/a", "b/d", "b/d/y", "c", "e"};
+
+    for (unsigned threads : {1u, 4u})
+    {
+        auto scanner = FileScanner{root, threads};
+        auto infos = std::vector<FileInfo>{ };
+
+        // small batches, to check the walk picks up where it left off.
+        for (auto batch = scanner.next(3); !batch.empty(); batch = scanner.next(3))
+            infos.insert(end(infos), begin(batch), end(batch));
+
+        ASSERT_EQ(infos.size(), expected.size());
+
+        auto id = uint16_t{ };
+
+        for (size_t i = 0; i < infos.size(); ++i)
+        {
+            EXPECT_EQ(infos[i].path, root + "/" + expected[i]);
+
+            const auto dir = S_ISDIR(infos[i].status.mode);
+            EXPECT_EQ(infos[i].id, dir ? 0 : ++id);
+        }
+
+        EXPECT_EQ(infos[5].status.size, 3u);
+        EXPECT_TRUE(S_ISLNK(infos[7].status.mode));
+    }
+
+    EXPECT_EQ(getFileInfo(root).size(), expected.size());
+
+    fs::remove_all(root);
 }
 
-} // namespace
+TEST(segments, subtract)
+{
+    const auto segs = std::vector<Segment>{{0, 4 * BufSize}, {4 * BufSize, 2 * BufSize + 10}};
 
-TEST(scoped_mmap, map)
+    // a hole in the middle of the first segment, and the second's tail.
+    const auto missing = subtractSegments(segs, {{BufSize, BufSize}, {5 * BufSize, BufSize + 10}});
+
+    ASSERT_EQ(missing.size(), 3u);
+    EXPECT_EQ(missing[0].offset, 0u);
+    EXPECT_EQ(missing[0].len, BufSize);
+    EXPECT_EQ(missing[1].offset, 2 * BufSize);
+    EXPECT_EQ(missing[1].len, 2 * BufSize);
+    EXPECT_EQ(missing[2].offset, 4 * BufSize);
+    EXPECT_EQ(missing[2].len, BufSize);
+
+    EXPECT_EQ(subtractSegments(segs, { }).size(), 2u);
+    EXPECT_TRUE(subtractSegments(segs, {{0, 6 * BufSize + 10}}).empty());
+}
+
+TEST(segments, resume_msg)
 {
-    EXPECT_NO_THROW(ScopedMMap::map(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    auto info = ResumeInfo{ };
+    info.completed[3] = {{0, BufSize}, {4 * BufSize, 10}};
+
+    const auto msg = generateResumeMsg(info);
+    const auto out = deserializeResumeMsg(msg.vector());
+
+    ASSERT_EQ(out.completed.size(), 1u);
+    ASSERT_EQ(out.completed.at(3).size(), 2u);
+    EXPECT_EQ(out.completed.at(3)[1].offset, 4 * BufSize);
+    EXPECT_EQ(out.completed.at(3)[1].len, 10u);
+    EXPECT_TRUE(out.digests.empty());
+    EXPECT_FALSE(out.streaming);
+
+    info.digests[1] = {{0, 0xdeadbeefcafef00dull}, {BufSize, 7}};
+
+    const auto delta = deserializeResumeMsg(generateResumeMsg(info).vector());
+
+    ASSERT_EQ(delta.digests.size(), 1u);
+    EXPECT_EQ(delta.digests.at(1).at(0), 0xdeadbeefcafef00dull);
+    EXPECT_EQ(delta.digests.at(1).at(BufSize), 7u);
 }
 
-TEST(scoped_mmap, unmap)
+TEST(manifest, batches)
 {
-    const size_t size = 4096;
+    auto addr = sockaddr_in{ };
+    auto rx = InfoReceiver{tcpListener(addr)};
 
-    auto sm = ScopedMMap::map(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    auto file = FileInfo{ };
+    file.path = "a/b.dat";
+    file.status.mode = S_IFREG | 0644;
+    file.status.size = 12345;
+    file.id = 9;
 
-    // look-up our anonymous mapping.
-    auto base = sm.data();
-    auto range = findMappingRange(base);
-    ASSERT_NE(range.first, 0);
+    // the payloads are larger than a single recv's worth.
+    auto first = std::vector<FileInfo>(2000, file);
+    first.back().targetSuffix = ".part";
 
-    // check range size.
-    EXPECT_EQ(range.second - range.first, size);
+    std::thread tx([&addr, &first, &file] {
+        auto fd = tcpConnect(addr);
 
-    EXPECT_EQ(sm.unmap(), 0);
+        for (const auto &msg : {generateManifestMsg(first, false), generateManifestMsg({file}, true)})
+            net::writeAll(fd.get(), msg.data(), msg.size());
+    });
 
-    // expect range to not be found after unmap().
-    range = findMappingRange(base);
-    EXPECT_EQ(range.first, 0);
+    auto a = rx.next();
+    auto b = rx.next();
+
+    tx.join();
+
+    ASSERT_TRUE(a && b);
+    ASSERT_EQ(a->info.size(), first.size());
+    EXPECT_FALSE(a->last);
+    EXPECT_EQ(a->info.back().path, "a/b.dat");
+    EXPECT_EQ(a->info.back().targetSuffix, ".part");
+    EXPECT_EQ(a->info.back().status.size, 12345u);
+
+    ASSERT_EQ(b->info.size(), 1u);
+    EXPECT_TRUE(b->last);
+    EXPECT_EQ(b->info[0].id, 9u);
+
+    // the sender's gone mid-manifest.
+    EXPECT_THROW(rx.next(), std::runtime_error);
 }
 
-TEST(scoped_mmap, scope_unmap)
+TEST(file_table, wait)
 {
-    const size_t size = 4096;
-    void *base{ };
-    std::pair<size_t, size_t> range{ };
+    auto files = FileTable{ };
+    files.add(1, 10);
+
+    EXPECT_EQ(files.fd(1), 10);
+
+    // a lookup ahead of its file's entry waits for it.
+    auto lookup = std::async(std::launch::async, [&files] { return files.fd(2); });
+
+    EXPECT_EQ(lookup.wait_for(std::chrono::milliseconds{10}), std::future_status::timeout);
+
+    files.add(2, 20);
+    EXPECT_EQ(lookup.get(), 20);
+
+    // ...until the table is closed.
+    lookup = std::async(std::launch::async, [&files] { return files.fd(3); });
+    files.close();
+
+    EXPECT_EQ(lookup.get(), -1);
+    EXPECT_EQ(files.fd(2), 20);
+}
+
+TEST(file_table, try_fd)
+{
+    auto files = FileTable{ };
+    files.add(1, 10);
+
+    EXPECT_EQ(files.tryFd(1), 10);
+    EXPECT_FALSE(files.tryFd(2));
+
+    files.close();
+
+    EXPECT_EQ(files.tryFd(2), -1);
+    EXPECT_EQ(files.tryFd(1), 10);
+}
+
+TEST(segments, holes)
+{
+    auto f = ScopedTempFile("/tmp/draft_test_", ".dat", O_RDWR);
+
+    // data in chunk 1 & at the end of chunk 4, holes elsewhere.
+    ASSERT_EQ(::ftruncate(f.fd(), 5 * BufSize), 0);
+    ASSERT_EQ(::pwrite(f.fd(), "data", 4, BufSize + 100), 4);
+    ASSERT_EQ(::pwrite(f.fd(), "data", 4, 5 * BufSize - 4), 4);
+    ::fsync(f.fd());
+
+    struct stat st{ };
+    ASSERT_EQ(::fstat(f.fd(), &st), 0);
+
+    if (static_cast<size_t>(st.st_blocks) * 512 >= 5 * BufSize)
+        GTEST_SKIP() << "filesystem doesn't support sparse files";
+
+    const auto holes = findHoles(f.fd(), 5 * BufSize);
+
+    ASSERT_EQ(holes.size(), 2u);
+    EXPECT_EQ(holes[0].offset, 0u);
+    EXPECT_EQ(holes[0].len, BufSize);
+    EXPECT_EQ(holes[1].offset, 2 * BufSize);
+    EXPECT_EQ(holes[1].len, 2 * BufSize);
+
+    const auto data = subtractSegments(splitSegments(5 * BufSize, 0), holes);
+
+    ASSERT_EQ(data.size(), 2u);
+    EXPECT_EQ(data[0].offset, BufSize);
+    EXPECT_EQ(data[1].offset, 4 * BufSize);
+
+    // a hole running to eof takes the partial chunk with it.
+    ASSERT_EQ(::ftruncate(f.fd(), 6 * BufSize + 10), 0);
+
+    const auto tail = findHoles(f.fd(), 6 * BufSize + 10);
+
+    ASSERT_EQ(tail.size(), 3u);
+    EXPECT_EQ(tail[2].offset, 5 * BufSize);
+    EXPECT_EQ(tail[2].len, BufSize + 10);
+}
+
+TEST(segments, reader)
+{
+    const size_t chunk = 4096;
+
+    const auto f = patternFile(10 * chunk + 100);
 
+    auto pool = BufferPool::make(chunk, 8);
+    auto queue = BufQueue{ };
+
+    auto fd = std::make_shared<ScopedFd>(::open(f.path().c_str(), O_RDONLY));
+    auto reader = Reader(fd, 1, {2 * chunk, 2 * chunk}, pool, &queue);
+
+    EXPECT_EQ(reader(std::stop_token{ }), 0);
+
+    for (auto offset : {2 * chunk, 3 * chunk})
     {
-        auto sm = ScopedMMap::map(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        auto desc = queue.get(std::chrono::milliseconds{1});
+        ASSERT_TRUE(desc);
 
-        // look-up our anonymous mapping.
-        base = sm.data();
-        range = findMappingRange(base);
-        ASSERT_NE(range.first, 0);
+        EXPECT_EQ(desc->offset, offset);
+        EXPECT_EQ(desc->len, chunk);
+        EXPECT_EQ(desc->buf.uint8Data()[0], static_cast<uint8_t>(offset * 7));
+    }
 
-        // check range size.
-        EXPECT_EQ(range.second - range.first, size);
+    EXPECT_FALSE(queue.get(std::chrono::milliseconds{1}));
+}
+
+TEST(segments, reader_delta)
+{
+    const size_t chunk = 4096;
+
+    const auto f = patternFile(4 * chunk);
+
+    auto pool = BufferPool::make(chunk, 8);
+    auto queue = BufQueue{ };
+
+    auto fd = std::make_shared<ScopedFd>(::open(f.path().c_str(), O_RDONLY));
+
+    // the receiver has chunks 0 & 2 intact, and a stale chunk 1.
+    auto expected = std::vector<uint8_t>(chunk);
+    auto digests = std::make_shared<ChunkDigests>();
+
+    for (auto offset : {0 * chunk, 2 * chunk})
+    {
+        ASSERT_EQ(readChunk(fd->get(), expected.data(), chunk, offset), chunk);
+        (*digests)[1][offset] = XXH3_64bits(expected.data(), chunk);
     }
 
-    // expect range to not be found after end of scope.
-    range = findMappingRange(base);
-    EXPECT_EQ(range.first, 0);
+    (*digests)[1][chunk] = 0;
+
+    auto reader = Reader(fd, 1, {0, 4 * chunk}, pool, &queue);
+    reader.skipMatching(digests);
+
+    EXPECT_EQ(reader(std::stop_token{ }), 0);
+
+    for (auto offset : {1 * chunk, 3 * chunk})
+    {
+        auto desc = queue.get(std::chrono::milliseconds{1});
+        ASSERT_TRUE(desc);
+
+        EXPECT_EQ(desc->offset, offset);
+    }
+
+    EXPECT_FALSE(queue.get(std::chrono::milliseconds{1}));
 }
 
-TEST(scoped_mmap, data)
+TEST(segments, reader_digests)
 {
-    const size_t size = 4096;
-    auto sm = ScopedMMap::map(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    // a whole chunk, then one that ends partway through a hash slice.
+    const auto size = BufSize + Reader::HashSliceSize / 2 + 100;
+    const auto f = patternFile(size);
 
-    ASSERT_EQ(sm.size(), size);
+    auto pool = BufferPool::make(BufSize, 4);
+    auto queue = BufQueue{ };
 
-    std::memset(sm.data(), 0x55, sm.size());
-    EXPECT_EQ(*sm.uint8Data(), 0x55);
+    auto fd = std::make_shared<ScopedFd>(::open(f.path().c_str(), O_RDONLY));
+    auto reader = Reader(fd, 1, {0, size}, pool, &queue);
+    reader.computeDigests();
 
-    EXPECT_TRUE(sm.offsetValid(0));
-    EXPECT_TRUE(sm.offsetValid(size - 1));
-    EXPECT_FALSE(sm.offsetValid(size));
+    EXPECT_EQ(reader(std::stop_token{ }), 0);
+
+    for (auto len : {BufSize, size - BufSize})
+    {
+        auto desc = queue.get(std::chrono::milliseconds{1});
+        ASSERT_TRUE(desc);
+
+        EXPECT_EQ(desc->len, len);
+        EXPECT_TRUE(desc->hashed);
+        EXPECT_EQ(desc->digest, XXH3_64bits(desc->buf.data(), desc->len));
+    }
+
+    EXPECT_FALSE(queue.get(std::chrono::milliseconds{1}));
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// FreeList
+TEST(packed, round_trip)
+{
+    const auto a = patternFile(100);
+    const auto b = patternFile(5000);
+    const auto c = patternFile(4096);
 
-TEST(free_list, get)
+    auto pool = BufferPool::make(BufSize, 2);
+    auto queue = BufQueue{ };
+
+    auto reader = PackedReader({
+            {a.path(), 100, 3},
+            {b.path(), 5000, 4},
+            {c.path(), 4096, 7}
+        }, pool, &queue);
+
+    reader.setDirectIO(false);
+    reader.computeDigests();
+
+    EXPECT_EQ(reader(std::stop_token{ }), 0);
+
+    auto desc = queue.get(std::chrono::milliseconds{1});
+    ASSERT_TRUE(desc);
+    EXPECT_FALSE(queue.get(std::chrono::milliseconds{1}));
+
+    EXPECT_EQ(desc->fileId, PackedFileId);
+    EXPECT_TRUE(desc->flags & draft::wire::ChunkHeader::Packed);
+    EXPECT_EQ(desc->len, packedPayloadSize(3, 4096 + 8192 + 4096));
+
+    auto seen = std::vector<std::pair<unsigned, size_t>>{ };
+
+    ASSERT_TRUE(desc->packedDigests);
+    ASSERT_EQ(desc->packedDigests->size(), 3u);
+
+    forEachPacked(desc->buf.uint8Data(), desc->len,
+        [&seen, &desc](unsigned fileId, const uint8_t *data, size_t len) {
+            const auto &digest = (*desc->packedDigests)[seen.size()];
+
+            EXPECT_EQ(digest.fileId, fileId);
+            EXPECT_EQ(digest.digest, XXH3_64bits(data, len));
+
+            seen.push_back({fileId, len});
+            EXPECT_EQ(data[len - 1], static_cast<uint8_t>((len - 1) * 7));
+        });
+
+    EXPECT_EQ(seen, (std::vector<std::pair<unsigned, size_t>>{{3, 100}, {4, 5000}, {7, 4096}}));
+
+    // unpack to fresh files.
+    auto outB = ScopedTempFile("/tmp/draft_test_", ".dat", O_RDWR);
+    auto outC = ScopedTempFile("/tmp/draft_test_", ".dat", O_RDWR);
+
+    auto files = std::make_shared<FileTable>();
+    files->add(4, outB.fd());
+    files->add(7, outC.fd());
+    files->close();
+
+    auto writer = Writer(files, queue);
+
+    queue.put(*desc);
+    queue.put({ });
+
+    writer.runOnce(std::stop_token{ });
+
+    ASSERT_EQ(::ftruncate(outB.fd(), 5000), 0);
+
+    auto data = std::vector<uint8_t>(5000);
+    ASSERT_EQ(readChunk(outB.fd(), data.data(), data.size(), 0), 5000u);
+    EXPECT_EQ(data[4999], static_cast<uint8_t>(4999 * 7));
+    EXPECT_EQ(std::filesystem::file_size(outC.path()), 4096u);
+
+    // a table that overruns the payload.
+    auto bad = std::vector<uint8_t>(BlockSize);
+    reinterpret_cast<draft::wire::PackedTable *>(bad.data())->count = 1000;
+
+    EXPECT_THROW(forEachPacked(bad.data(), bad.size(), [](auto...) { }), std::runtime_error);
+}
+
+TEST(packed, verify)
 {
-    auto list = FreeList{10};
+    const auto a = patternFile(100);
+    const auto b = patternFile(5000);
 
-    for (size_t i = 0u; i < 10u; ++i)
-        EXPECT_EQ(i, list.get());
+    auto pool = BufferPool::make(BufSize, 2);
+    auto queue = BufQueue{ };
 
-    EXPECT_EQ(FreeList::End, list.get());
+    auto reader = PackedReader({
+            {a.path(), 100, 3},
+            {b.path(), 5000, 4}
+        }, pool, &queue);
+
+    reader.setDirectIO(false);
+    reader.computeDigests();
+
+    EXPECT_EQ(reader(std::stop_token{ }), 0);
+
+    auto desc = queue.get(std::chrono::milliseconds{1});
+    ASSERT_TRUE(desc);
+    ASSERT_TRUE(desc->hashed);
+
+    const auto digest = desc->digest;
+    EXPECT_EQ(digest, packedTableDigest(desc->buf.uint8Data(), desc->len));
+
+    // the receiver's side, as sent.
+    desc->flags |= draft::wire::ChunkHeader::Digest;
+    EXPECT_TRUE(verifyChunk(*desc, digest).empty());
+
+    // a corrupt file is requested again on its own.
+    desc->buf.uint8Data()[packedPayloadSize(2, 4096) + 10] ^= 0xff;
+
+    const auto corrupt = verifyChunk(*desc, digest);
+    ASSERT_EQ(corrupt.size(), 1u);
+    EXPECT_EQ(corrupt[0].fileId, 4u);
+    EXPECT_EQ(corrupt[0].offset, 0u);
+    EXPECT_EQ(corrupt[0].len, 5000u);
+    EXPECT_TRUE(isCorrupt(corrupt, 4));
+    EXPECT_FALSE(isCorrupt(corrupt, 3));
+
+    // there's no telling which files a corrupt table held.
+    desc->buf.uint8Data()[sizeof(draft::wire::PackedTable)] ^= 0xff;
+
+    EXPECT_THROW(verifyChunk(*desc, digest), std::runtime_error);
 }
 
-TEST(free_list, put_interleaved)
+TEST(chunk_codec, compressible)
 {
-    auto list = FreeList{2};
+    auto data = std::vector<uint8_t>(BufSize);
 
-    EXPECT_EQ(0, list.get());
-    EXPECT_EQ(1, list.get());
-    EXPECT_EQ(FreeList::End, list.get());
+    auto rng = std::mt19937{42};
+    std::generate(begin(data), end(data), [&rng] { return static_cast<uint8_t>(rng()); });
 
-    list.put(0);
-    list.put(1);
-    EXPECT_EQ(1, list.get());
-    EXPECT_EQ(0, list.get());
-    EXPECT_EQ(FreeList::End, list.get());
+    EXPECT_FALSE(compressible(data.data(), data.size()));
+
+    std::fill(begin(data), end(data), 0);
+    EXPECT_TRUE(compressible(data.data(), data.size()));
+
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>('a' + i % 26);
+
+    EXPECT_TRUE(compressible(data.data(), data.size()));
+
+    // too small to sample.
+    EXPECT_TRUE(compressible(data.data(), 100));
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// WaitQueue
+#ifdef DRAFT_HAVE_COMPRESS
 
-TEST(wait_q, put_get)
+TEST(chunk_codec, round_trip)
 {
-    auto q = WaitQueue<int>{ };
-    q.put(42);
+    auto pool = BufferPool::make(BufSize, 1);
+    auto desc = BDesc{pool->get(), 3, BufSize, BufSize};
 
-    auto v = q.get();
-    ASSERT_TRUE(v);
-    EXPECT_EQ(*v, 42);
+    for (size_t i = 0; i < desc.len; ++i)
+        desc.buf.uint8Data()[i] = static_cast<uint8_t>(i / 1000);
+
+    compress(desc, 5);
+
+    EXPECT_EQ(desc.codec, draft::wire::ChunkHeader::Blosc2);
+    EXPECT_EQ(desc.rawLen, BufSize);
+    EXPECT_LT(desc.len, BufSize - BufSize / 8);
+
+    EXPECT_TRUE(decompress(desc));
+    EXPECT_EQ(desc.codec, draft::wire::ChunkHeader::Raw);
+    ASSERT_EQ(desc.len, BufSize);
+
+    for (size_t i = 0; i < desc.len; i += 4096)
+        EXPECT_EQ(desc.buf.uint8Data()[i], static_cast<uint8_t>(i / 1000));
+
+    EXPECT_FALSE(decompress(desc));
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// ScopedTempFile
+TEST(chunk_codec, incompressible)
+{
+    auto pool = BufferPool::make(BufSize, 1);
+    auto desc = BDesc{pool->get(), 3, 0, BufSize};
 
-TEST(makeTempFile, create)
+    auto rng = std::mt19937{42};
+    std::generate(desc.buf.uint8Data(), desc.buf.uint8Data() + desc.len,
+        [&rng] { return static_cast<uint8_t>(rng()); });
+
+    compress(desc, 5);
+
+    EXPECT_EQ(desc.codec, draft::wire::ChunkHeader::Raw);
+    EXPECT_EQ(desc.len, BufSize);
+}
+
+TEST(chunk_codec, corrupt)
 {
-    namespace fs = std::filesystem;
+    auto pool = BufferPool::make(BufSize, 1);
+    auto desc = BDesc{pool->get(), 3, 0, BufSize};
 
-    auto path = []{
-            auto f = ScopedTempFile("foo", "bar");
-            EXPECT_TRUE(fs::exists(f.path()));
-            return f.path();
-        }();
+    std::memset(desc.buf.data(), 0, desc.len);
+    compress(desc, 5);
 
-    EXPECT_FALSE(fs::exists(path));
+    ASSERT_EQ(desc.codec, draft::wire::ChunkHeader::Blosc2);
+
+    // claims to decompress past the end of its buffer.
+    auto big = desc;
+    big.rawLen = BufSize + 1;
+    EXPECT_THROW(decompress(big), std::runtime_error);
+
+    desc.codec = 99;
+    EXPECT_THROW(decompress(desc), std::runtime_error);
+}
+
+#else
+
+TEST(chunk_codec, unsupported)
+{
+    EXPECT_FALSE(ChunkCodec::supported());
+    EXPECT_THROW(ChunkCodec::local(), std::runtime_error);
+}
+
+#endif
+
+TEST(numa, cpu_list)
+{
+    EXPECT_EQ(numa::parseCpuList("0-3,8,10-11\n"), (std::vector<unsigned>{0, 1, 2, 3, 8, 10, 11}));
+    EXPECT_EQ(numa::parseCpuList("5"), (std::vector<unsigned>{5}));
+    EXPECT_TRUE(numa::parseCpuList("").empty());
+}
+
+TEST(numa, loopback_node)
+{
+    auto [tx, rx] = tcpPair();
+
+    // loopback has no device behind it.
+    EXPECT_EQ(numa::socketNode(tx.get()), -1);
+    EXPECT_EQ(numa::interfaceNode("lo"), -1);
+    EXPECT_TRUE(numa::nodeCpus(-1).empty());
+}
+
+TEST(numa, pool_node)
+{
+    auto pool = BufferPool::make(4096, 4, {.numaNode = 0});
+
+    auto buf = pool->get();
+    std::memset(buf.data(), 0x42, buf.size());
+    EXPECT_EQ(buf.uint8Data()[4095], 0x42);
+}
+
+TEST(notifier, wait)
+{
+    using namespace std::chrono_literals;
+
+    auto n = Notifier{ };
+
+    EXPECT_FALSE(n.wait(0));
+
+    // notifications coalesce until the next wait.
+    n.notify();
+    n.notify();
+    EXPECT_TRUE(n.wait(0));
+    EXPECT_FALSE(n.wait(0));
+
+    auto fut = std::async(std::launch::async, [&n] { return n.wait(5000); });
+
+    std::this_thread::sleep_for(10ms);
+    n.notify();
+
+    ASSERT_EQ(fut.wait_for(1s), std::future_status::ready);
+    EXPECT_TRUE(fut.get());
+}
+
+TEST(notifier, task_pool)
+{
+    auto n = Notifier{ };
+    auto pool = TaskPool{1};
+    pool.setNotifier(&n);
+
+    auto fut = pool.launch([](std::stop_token) { return 42; });
+    ASSERT_TRUE(fut);
+
+    ASSERT_TRUE(n.wait(5000));
+    EXPECT_EQ(fut->get(), 42);
 }
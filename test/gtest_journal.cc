@@ -26,12 +26,15 @@
 
 #include <cstdio>
 #include <filesystem>
+#include <fstream>
+#include <vector>
 
 #include <gtest/gtest.h>
 #include <spdlog/spdlog.h>
 
 #include <draft/util/Journal.hh>
 #include <draft/util/JournalOperations.hh>
+#include <draft/util/Stats.hh>
 
 namespace fs = std::filesystem;
 
@@ -663,3 +666,48 @@ TEST(journal_diff, mismatch_multi_file)
     EXPECT_EQ(diff.diffs[0].hashB, rec.hash);
     EXPECT_EQ(diff.diffs[0].fileId, 1);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+// Journal operations
+
+TEST(journal_ops, create_hashes_every_chunk)
+{
+    using draft::util::BufSize;
+
+    const auto root = tempFilename("/tmp/journal_root");
+    fs::create_directory(root);
+
+    // more segments in flight than hashers, so the readers wait on them.
+    const auto size = 6 * BufSize + 100;
+
+    {
+        auto data = std::vector<char>(size, 'x');
+        std::ofstream{root + "/data.bin", std::ios::binary}.write(data.data(), static_cast<std::streamsize>(size));
+    }
+
+    const auto path = tempFilename("/tmp/journal");
+    const auto janitor = FileJanitor{path};
+
+    const auto hashedBefore = draft::util::stats().hashByteCount.load();
+
+    auto journal = draft::util::createJournal(
+        draft::util::getFileInfo(root),
+        {
+            .readerCount = 4,
+            .segmentSize = BufSize,
+            .useDirectIO = false,
+            .hasherCount = 1
+        },
+        path);
+
+    ASSERT_TRUE(journal);
+    EXPECT_EQ(journal->hashCount(), 7u);
+    EXPECT_EQ(draft::util::stats().hashByteCount - hashedBefore, size);
+
+    const auto diff = draft::util::verifyJournal(*journal, {.useDirectIO = false});
+
+    ASSERT_TRUE(diff);
+    EXPECT_TRUE(diff->diffs.empty());
+
+    fs::remove_all(root);
+}